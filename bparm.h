@@ -38,6 +38,7 @@
 #define H_BPARM
 
 #include <inttypes.h>
+#include <stddef.h>
 #include "common.h"
 
 /* "PCID" boot data, describing a single PCI device. */
@@ -51,10 +52,68 @@ typedef struct __attribute__((packed)) {
 					   to); 0 if no ROM image */
 	uint16_t rimg_rt_seg;		/* final location of option ROM code
 					   after initialization (for PCI 3+
-					   compliant ROM images) */
+					   compliant ROM images); 0 if stage
+					   2 should find room in base mem. */
 	uint32_t rimg_sz;		/* ROM image size */
+	uint32_t rimg_rt_sz;		/* size of base mem. reserved at
+					   rimg_rt_seg for ROM code at run
+					   time */
+	uint8_t rimg_policy;		/* when stage 2 should run the ROM
+					   image's init. code, as RIMG_...
+					   (below) */
+	uint8_t reserved[3];
 } bdat_pci_dev_t;
 
+/* Values for bdat_pci_dev_t::rimg_policy. */
+#define RIMG_EAGER	0U		/* run it during boot */
+#define RIMG_DEFER	1U		/* run it only when stage 2 first
+					   needs the device */
+#define RIMG_SKIP	2U		/* never run it */
+
+/* A single BAR, within "PCIX" boot data (below). */
+typedef struct __attribute__((packed)) {
+	uint64_t base;			/* base address in memory or I/O
+					   space */
+	uint64_t sz;			/* size; 0 if unknown */
+	uint32_t flags;			/* PCIX_BAR_... (below) */
+	uint32_t reserved;
+} bdat_pci_bar_t;
+
+/* Values for bdat_pci_bar_t::flags. */
+#define PCIX_BAR_USED	0x01U		/* BAR is in use */
+#define PCIX_BAR_IO	0x02U		/* BAR is in I/O space */
+#define PCIX_BAR_64	0x04U		/* 64-bit memory BAR (taking up
+					   this & the next BAR slot) */
+#define PCIX_BAR_PF	0x08U		/* prefetchable memory */
+
+/*
+ * "PCIX" boot data, describing a single PCI function in more detail, so
+ * that an OS need not enumerate PCI configuration space again.  There is
+ * one of these for every PCI function UEFI reports, including bridges.
+ */
+typedef struct __attribute__((packed)) {
+	uint32_t pci_locn;		/* PCI segment, bus, device, fn. */
+	uint32_t pci_id;		/* vendor & device id. */
+	uint32_t class_if;		/* class, subclass, prog. IF, &
+					   rev. id. */
+	uint32_t subsys_id;		/* subsystem vendor & subsystem id.;
+					   0 if none */
+	uint8_t hdr_type;		/* conf. sp. header type, with the
+					   multi-function bit cleared */
+	uint8_t int_pin;		/* interrupt pin (1 = INTA#, etc.);
+					   0 if none */
+	uint8_t int_line;		/* interrupt line */
+	uint8_t cap_pm;			/* conf. sp. offsets of power
+					   management, */
+	uint8_t cap_msi;		/* MSI, */
+	uint8_t cap_msix;		/* MSI-X, */
+	uint8_t cap_pcie;		/* & PCI Express capabilities; 0 if
+					   absent */
+	uint8_t reserved;
+	bdat_pci_bar_t bars[6];		/* BARs, by BAR no.; header type 1
+					   has only 2 BARs, & type 2 none */
+} bdat_pci_ext_t;
+
 /*
  * "BMEM" boot data, describing base memory availability at boot time &
  * run time.
@@ -91,27 +150,154 @@ typedef struct __attribute__((packed)) {
 	uint32_t rsdp_sz;		/* size of RSDP */
 } bdat_rsdp_t;
 
-/* Node type for linked list of boot parameters. */
-struct __attribute__((packed)) bparm {
-	struct bparm *next;		/* pointer to next boot param. node */
-#ifndef __x86_64__
-	uint32_t reserved;
-#endif
+/*
+ * "SHDW" boot data, saying where stage 1 placed option ROM images in shadow
+ * RAM in the upper memory area, & how to make that RAM read-only once the
+ * ROMs have been initialized.  Each Programmable Attribute Map (PAM)
+ * register covers 32 KiB, as two 16 KiB halves: bits 1:0 for the lower
+ * half & bits 5:4 for the upper; in each, bit 0 = reads go to RAM, bit 1 =
+ * writes go to RAM.
+ */
+typedef struct __attribute__((packed)) {
+	uint32_t pci_locn;		/* PCI location of host bridge */
+	uint8_t pam_off;		/* offset in host bridge's PCI conf.
+					   sp. of PAM register for 0xc0000--
+					   0xc7fff */
+	uint8_t reserved[3];
+	uint32_t start, end;		/* range of shadow RAM made writable;
+					   16 KiB aligned */
+} bdat_shdw_t;
+
+/* A single entry in the "TIML" boot data (below). */
+typedef struct __attribute__((packed)) {
+	uint32_t tag;			/* boot phase, as TL_... (below) */
+	uint32_t arg;			/* extra phase-specific info. */
+	uint64_t tsc_start;		/* time stamp counter at start of
+					   phase */
+	uint64_t tsc_end;		/* time stamp counter at end of
+					   phase; 0 if phase unfinished */
+} bdat_tl_ent_t;
+
+/*
+ * "TIML" boot data, giving a timeline of the boot phases in stage 1 &
+ * stage 2.  Stage 1 leaves some empty entries at the end for stage 2 to
+ * fill in.
+ */
+typedef struct __attribute__((packed)) {
+	uint32_t tsc_khz;		/* approx. time stamp counter ticks
+					   per millisecond; 0 if unknown */
+	uint32_t num_ents;		/* no. of entries filled in */
+	uint32_t max_ents;		/* no. of entries there is space for */
+	bdat_tl_ent_t ents[];		/* entries */
+} bdat_timeline_t;
+
+/*
+ * "LOGB" boot data, holding the text of stage 1's boot log, in UTF-8.  If
+ * the log overflowed stage 1's buffer, only its tail is kept.
+ */
+typedef struct __attribute__((packed)) {
+	uint32_t lost_sz;		/* no. of bytes lost from start of
+					   log */
+	uint32_t text_sz;		/* no. of bytes of log text */
+	char text[];			/* log text, not NUL-terminated */
+} bdat_log_t;
+
+/*
+ * Boot parameter table.  This is a single contiguous block, made up of a
+ * header, an index with one entry per boot parameter type, & then, for
+ * each type, a packed array of all the boot data of that type.
+ */
+#define BPARM_MAGIC	MAGIC32('B', 'P', 'R', 'M')
+#define BPARM_VER	1U
+
+/* Index entry in the boot parameter table. */
+typedef struct __attribute__((packed)) {
 	uint32_t type;			/* "PCID", etc. */
-	uint32_t size;			/* size of boot param. data only */
-	union {				/* boot param. data */
-		bdat_pci_dev_t pci_dev;
-		bdat_bmem_t bmem;
-		bdat_mem_range_t mem_range;
-		bdat_rsdp_t rsdp;
-	} u[];
-};
+	uint32_t off;			/* offset of array of boot data, from
+					   start of table */
+	uint32_t count;			/* no. of entries in array */
+	uint32_t ent_sz;		/* size of each entry */
+} bparm_idx_t;
 
-typedef struct bparm bparm_t;
+/* Header of the boot parameter table. */
+typedef struct __attribute__((packed)) {
+	uint32_t magic;			/* BPARM_MAGIC */
+	uint16_t ver;			/* BPARM_VER */
+	uint16_t num_types;		/* no. of index entries */
+	uint32_t total_sz;		/* size of whole table */
+	uint32_t reserved;
+	bparm_idx_t idx[];		/* index entries */
+} bparm_tbl_t;
 
 #define BP_PCID		MAGIC32('P', 'C', 'I', 'D')
+#define BP_PCIX		MAGIC32('P', 'C', 'I', 'X')
 #define BP_BMEM		MAGIC32('B', 'M', 'E', 'M')
 #define BP_MRNG		MAGIC32('M', 'R', 'N', 'G')
 #define BP_RSDP		MAGIC32('R', 'S', 'D', 'P')
+#define BP_TIML		MAGIC32('T', 'I', 'M', 'L')
+#define BP_LOGB		MAGIC32('L', 'O', 'G', 'B')
+#define BP_SHDW		MAGIC32('S', 'H', 'D', 'W')
+
+/*
+ * Look up the array of boot data of type `type' in the boot parameter table
+ * `tbl'.  Return a pointer to the array, & the no. of entries in *p_count
+ * (if `p_count' is not NULL).  If there are no such boot data, return NULL.
+ */
+static inline void *bparm_tbl_find(const bparm_tbl_t *tbl, uint32_t type,
+    uint32_t *p_count)
+{
+	const bparm_idx_t *ent = tbl->idx;
+	unsigned n = tbl->num_types;
+	while (n-- != 0) {
+		if (ent->type == type) {
+			if (p_count)
+				*p_count = ent->count;
+			return (char *)tbl + ent->off;
+		}
+		++ent;
+	}
+	if (p_count)
+		*p_count = 0;
+	return NULL;
+}
+
+/* Boot phase tags for bdat_tl_ent_t::tag.  First, stage 1 phases... */
+#define TL_CONF		MAGIC32('c', 'o', 'n', 'f')	/* conf_init() */
+#define TL_BMEM		MAGIC32('b', 'm', 'e', 'm')	/* bmem_init() */
+#define TL_OPEN		MAGIC32('o', 'p', 'e', 'n')	/* s2file_open() */
+#define TL_FV		MAGIC32('f', 'v', ' ', ' ')	/* FV scan */
+#define TL_ACPI		MAGIC32('a', 'c', 'p', 'i')	/* ACPI & other
+							   sys. conf. tables */
+#define TL_PCI		MAGIC32('p', 'c', 'i', ' ')	/* process_pci() */
+#define TL_LOAD		MAGIC32('l', 'o', 'a', 'd')	/* load_stage2(),
+							   incl. waiting for
+							   any background
+							   read */
+#define TL_WAIT		MAGIC32('w', 'a', 'i', 't')	/* configured delay
+							   before exiting
+							   UEFI */
+#define TL_EXIT		MAGIC32('e', 'x', 'i', 't')	/* from preparing to
+							   exit UEFI, until
+							   just before
+							   stage 2 */
+/* ...then stage 2 phases. */
+#define TL_MEM		MAGIC32('M', 'E', 'M', ' ')	/* mem_init() */
+#define TL_RM16		MAGIC32('R', 'M', '1', '6')	/* rm16_init() */
+#define TL_ATAB		MAGIC32('A', 'T', 'A', 'B')	/* acpi_init(); arg. =
+							   no. of ACPI tables
+							   indexed */
+#define TL_IRQ		MAGIC32('I', 'R', 'Q', ' ')	/* irq_init(); arg. =
+							   no. of full TLB
+							   flushes avoided
+							   so far */
+#define TL_VROM		MAGIC32('V', 'R', 'O', 'M')	/* VGA option ROM
+							   init.; arg. = no.
+							   of ROMs run */
+#define TL_OROM		MAGIC32('O', 'R', 'O', 'M')	/* other option ROM
+							   init.; arg. = no.
+							   of ROMs run */
+#define TL_RIMG		MAGIC32('R', 'I', 'M', 'G')	/* init. of one
+							   option ROM; arg. =
+							   PCI location */
 
 #endif
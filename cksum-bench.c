@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2020--2021 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host-side microbenchmark for the checksum kernel in cksum.h.  This
+ * compares it against a plain byte-at-a-time loop (as stage 1 used to
+ * have) over multi-MiB buffers, & checks that both give the same results.
+ *
+ * Usage: ./cksum-bench [reps.]
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "cksum.h"
+
+static uint8_t scalar_sum_bytes(const void *buf, size_t n)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	uint8_t sum = 0;
+	while (n-- != 0)
+		sum += *p++;
+	return sum;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench(uint8_t (*fn)(const void *, size_t), const uint8_t *buf,
+    size_t sz, unsigned reps, uint8_t *p_res)
+{
+	double start = now();
+	unsigned i;
+	uint8_t res = 0;
+	for (i = 0; i < reps; ++i)
+		res ^= fn(buf + i % 16, sz - 16);
+	*p_res = res;
+	return (double)(sz - 16) * reps / (now() - start) / 1e6;
+}
+
+static uint8_t simd_sum_bytes(const void *buf, size_t n)
+{
+	return cksum_sum_bytes(buf, n);
+}
+
+int main(int argc, char **argv)
+{
+	static const size_t szs[] = { 0x100000, 0x400000, 0x1000000 };
+	unsigned reps = argc > 1 ? (unsigned)atoi(argv[1]) : 20, i;
+	size_t j, n;
+	int bad = 0;
+	uint8_t *buf = malloc(szs[2]);
+	if (!buf || !reps) {
+		fputs("cksum-bench: bad args. or no mem.\n", stderr);
+		return 1;
+	}
+	srand(1);
+	for (j = 0; j < szs[2]; ++j)
+		buf[j] = (uint8_t)rand();
+	/* Check odd sizes & alignments against the plain loop first. */
+	for (n = 0; n < 300; ++n)
+		for (j = 0; j < 16; ++j)
+			if (cksum_sum_bytes(buf + j, n) !=
+			    scalar_sum_bytes(buf + j, n))
+				bad = 1;
+	if (bad) {
+		fputs("cksum-bench: results differ!\n", stderr);
+		return 1;
+	}
+	printf("%10s %12s %12s %8s\n", "size", "scalar MB/s", "SIMD MB/s",
+	    "speedup");
+	for (i = 0; i < sizeof(szs) / sizeof(szs[0]); ++i) {
+		uint8_t r1, r2;
+		double t1 = bench(scalar_sum_bytes, buf, szs[i], reps, &r1),
+		       t2 = bench(simd_sum_bytes, buf, szs[i], reps, &r2);
+		if (r1 != r2) {
+			fputs("cksum-bench: results differ!\n", stderr);
+			return 1;
+		}
+		printf("%10zu %12.0f %12.0f %7.1fx\n", szs[i], t1, t2,
+		    t2 / t1);
+	}
+	free(buf);
+	return 0;
+}
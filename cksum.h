@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2021 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Byte-sum checksum kernel, as used for PCI option ROM images & ACPI
+ * tables.  Where SSE2 is available, bytes are summed 64 at a time with the
+ * `psadbw' instruction (via a compiler built-in, so that no system headers
+ * are needed), with a scalar loop for any remaining bytes.
+ *
+ * This header is used by both stage 1 & the host-side cksum-bench program.
+ */
+
+#ifndef H_CKSUM
+#define H_CKSUM
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#ifdef __SSE2__
+typedef char cksum_v16qi_t __attribute__((vector_size(16)));
+typedef long long cksum_v2di_t __attribute__((vector_size(16)));
+#endif
+
+/* Return the sum, modulo 256, of the `n' bytes at `buf'. */
+static inline uint8_t cksum_sum_bytes(const void *buf, size_t n)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	uint64_t sum = 0;
+#ifdef __SSE2__
+	const cksum_v16qi_t zero = { 0 };
+	cksum_v2di_t acc0 = { 0, 0 }, acc1 = { 0, 0 },
+		     acc2 = { 0, 0 }, acc3 = { 0, 0 };
+	cksum_v16qi_t v0, v1, v2, v3;
+	while (n >= 64) {
+		__builtin_memcpy(&v0, p, 16);
+		__builtin_memcpy(&v1, p + 16, 16);
+		__builtin_memcpy(&v2, p + 32, 16);
+		__builtin_memcpy(&v3, p + 48, 16);
+		acc0 += __builtin_ia32_psadbw128(v0, zero);
+		acc1 += __builtin_ia32_psadbw128(v1, zero);
+		acc2 += __builtin_ia32_psadbw128(v2, zero);
+		acc3 += __builtin_ia32_psadbw128(v3, zero);
+		p += 64;
+		n -= 64;
+	}
+	while (n >= 16) {
+		__builtin_memcpy(&v0, p, 16);
+		acc0 += __builtin_ia32_psadbw128(v0, zero);
+		p += 16;
+		n -= 16;
+	}
+	acc0 += acc1 + acc2 + acc3;
+	sum = (uint64_t)acc0[0] + (uint64_t)acc0[1];
+#endif
+	while (n-- != 0)
+		sum += *p++;
+	return (uint8_t)sum;
+}
+
+#endif
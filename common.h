@@ -75,6 +75,14 @@ static inline void hlt(void)
 	__asm volatile("hlt" : : : "memory");
 }
 
+/* Read the CPU's time stamp counter. */
+static inline uint64_t rdtsc(void)
+{
+	uint32_t lo, hi;
+	__asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return (uint64_t)hi << 32 | lo;
+}
+
 /* Type of a 64-bit pointer. */
 #ifndef __x86_64__
 typedef uint64_t ptr64_t;
@@ -28,11 +28,14 @@
  */
 
 /*
- * 32-bit Executable and Linking Format (ELF) structures.  See:
+ * 32-bit & 64-bit Executable and Linking Format (ELF) structures.  See:
  *
  *	TIS Committee.  _Tool Interface Standard (TIS) Executable and
  *	Linking Format (ELF) Specification: Version 1.2_.  May 1995.
  *	http://refspecs.linuxbase.org/elf/elf.pdf .
+ *
+ *	Santa Cruz Operation, Inc.  _System V Application Binary
+ *	Interface: Edition 4.1_.  Chapter 4 (Object Files).  March 1997.
  */
 
 #ifndef H_ELF
@@ -42,6 +45,9 @@
 
 typedef uint16_t Elf32_Half;
 typedef uint32_t Elf32_Word, Elf32_Addr, Elf32_Off;
+typedef uint16_t Elf64_Half;
+typedef uint32_t Elf64_Word;
+typedef uint64_t Elf64_Xword, Elf64_Addr, Elf64_Off;
 
 #define EI_NIDENT	16
 
@@ -57,6 +63,17 @@ typedef struct __attribute__((packed)) {
 		   e_shentsize, e_shnum, e_shstrndx;
 } Elf32_Ehdr;
 
+typedef struct __attribute__((packed)) {
+	uint8_t e_ident[EI_NIDENT];
+	Elf64_Half e_type, e_machine;
+	Elf64_Word e_version;
+	Elf64_Addr e_entry;
+	Elf64_Off e_phoff, e_shoff;
+	Elf64_Word e_flags;
+	Elf64_Half e_ehsize, e_phentsize, e_phnum,
+		   e_shentsize, e_shnum, e_shstrndx;
+} Elf64_Ehdr;
+
 /* e_ident[] field indices. */
 #define EI_MAG0		0
 #define EI_MAG1		1
@@ -73,10 +90,12 @@ typedef struct __attribute__((packed)) {
 #define ELFMAG2		0x4c
 #define ELFMAG3		0x46
 #define ELFCLASS32	1
+#define ELFCLASS64	2
 #define ELFDATA2LSB	1
 #define EV_CURRENT	1
 #define ET_EXEC		2
 #define EM_386		3
+#define EM_X86_64	62
 
 /* Program header. */
 typedef struct __attribute__((packed)) {
@@ -86,6 +105,13 @@ typedef struct __attribute__((packed)) {
 	Elf32_Word p_filesz, p_memsz, p_flags, p_align;
 } Elf32_Phdr;
 
+typedef struct __attribute__((packed)) {
+	Elf64_Word p_type, p_flags;
+	Elf64_Off p_offset;
+	Elf64_Addr p_vaddr, p_paddr;
+	Elf64_Xword p_filesz, p_memsz, p_align;
+} Elf64_Phdr;
+
 /* p_type field values. */
 #define PT_LOAD		1
 
@@ -104,4 +104,23 @@ static inline uint32_t pci_make_id(uint16_t vendor, uint16_t dev)
 					   VirtualBox VM hypervisor) */
 #define PCI_DEVICE_ID_VBOX_VESA	0xbeef	/* VirtualBox graphics card */
 
+/* PCI configuration space offsets & fields. */
+#define PCI_CONF_SZ		0x100	/* size of (non-extended) conf. sp. */
+#define PCI_CONF_STATUS		0x06	/* status register */
+#define PCI_STATUS_CAP_LIST	0x0010U	/* capability list present */
+#define PCI_CONF_HDR_TYPE	0x0e	/* header type */
+#define PCI_HDR_TYPE_MASK	0x7fU
+#define PCI_CONF_BAR0		0x10	/* 1st BAR */
+#define PCI_CONF_CB_CAP_PTR	0x14	/* capability ptr. (CardBus bridge) */
+#define PCI_CONF_SUBSYS_ID	0x2c	/* subsystem vendor & subsys. id. */
+#define PCI_CONF_CAP_PTR	0x34	/* capability ptr. (header types 0
+					   & 1) */
+#define PCI_CONF_INT_LINE	0x3c	/* interrupt line */
+#define PCI_CONF_INT_PIN	0x3d	/* interrupt pin */
+/* Capability ids. */
+#define PCI_CAP_ID_PM		0x01	/* power management */
+#define PCI_CAP_ID_MSI		0x05	/* message signalled interrupts */
+#define PCI_CAP_ID_PCIE		0x10	/* PCI Express */
+#define PCI_CAP_ID_MSIX		0x11	/* MSI-X */
+
 #endif
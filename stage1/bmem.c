@@ -43,9 +43,17 @@
  * To ensure this, bmem_init() first reserves as much base memory as
  * possible.  Any attempts to allocate from base memory should then go
  * through this module instead of going directly to UEFI.
+ *
+ * Within the reserved blocks, we keep a sorted list of free extents.
+ * Memory for use at run time is taken from the tops of the highest free
+ * extents, & memory for use only at boot time is taken from the bottoms of
+ * the lowest extents, so that the two kinds of allocations stay apart. 
+ * bmem_free(, ) returns memory to the free list, merging it with any
+ * neighbouring free extents.
  */
 
 #define MAX_BMEM_BLKS	(BMEM_MAX_ADDR / EFI_PAGE_SIZE / 2)
+#define MAX_FREE_EXTS	(MAX_BMEM_BLKS + 64)
 
 #ifndef EFI_MEMORY_RO
 #   define EFI_MEMORY_RO (1ULL << 17)
@@ -55,12 +63,15 @@
 #endif
 
 typedef struct {
-	UINT32 start, end, orig_end;
+	UINT32 start, end;
 } blk_info_t;
 
-/* Variables to keep track of available base memory blocks. */
+/* Variables to keep track of the base memory blocks we reserved. */
 static UINT32 num_blks = 0;
 static blk_info_t blk[MAX_BMEM_BLKS];
+/* Variables to keep track of free extents within these blocks. */
+static UINT32 num_exts = 0;
+static blk_info_t ext[MAX_FREE_EXTS];
 /*
  * Variable to keep track of the start of base memory that is available at
  * boot time.  The area below boottime_bmem_bot may be filled with boot
@@ -73,7 +84,7 @@ static uint32_t boottime_bmem_bot = EFI_PAGE_SIZE;
  * Variable to keep track of the size of the base memory starting at address
  * 0 that will be available at run time.
  */
-static uint32_t runtime_bmem_top = 0;
+static uint32_t runtime_bmem_top = 0, max_runtime_bmem_top = 0;
 /*
  * Memory region attributes supported by all the usable memory below 1 MiB. 
  * We start out by assuming that all cacheability & protection attributes
@@ -137,93 +148,159 @@ static void add_uefi_mem_bparms(EFI_MEMORY_DESCRIPTOR *descs, UINTN num_ents,
  */
 static void add_our_mem_bparms(void)
 {
-	UINT32 blk_idx = 0;
+	UINT32 blk_idx = 0, ext_idx = 0;
 	bparm_add_mem_range(0, runtime_bmem_top, E820_RAM, 1, bmem_uefi_attr);
+	/*
+	 * Above runtime_bmem_top, free extents are RAM, & the rest of our
+	 * blocks are in use at run time.
+	 */
 	while (blk_idx < num_blks && blk[blk_idx].start < runtime_bmem_top)
 		++blk_idx;
 	while (blk_idx < num_blks) {
 		UINT32 start = blk[blk_idx].start;
 		UINT32 end = blk[blk_idx].end;
-		UINT32 orig_end = blk[blk_idx].orig_end;
-		bparm_add_mem_range(start, end - start, E820_RAM, 1,
-		    bmem_uefi_attr);
-		bparm_add_mem_range(end, orig_end - end, E820_RESERVED, 1,
+		while (ext_idx < num_exts && ext[ext_idx].end <= start)
+			++ext_idx;
+		while (ext_idx < num_exts && ext[ext_idx].start < end) {
+			UINT32 ext_start = ext[ext_idx].start,
+			       ext_end = ext[ext_idx].end;
+			bparm_add_mem_range(start, ext_start - start,
+			    E820_RESERVED, 1, bmem_uefi_attr);
+			bparm_add_mem_range(ext_start, ext_end - ext_start,
+			    E820_RAM, 1, bmem_uefi_attr);
+			start = ext_end;
+			++ext_idx;
+		}
+		bparm_add_mem_range(start, end - start, E820_RESERVED, 1,
 		    bmem_uefi_attr);
 		++blk_idx;
 	}
 }
 
+/*
+ * Record a block of base memory that we have reserved, keeping the blocks
+ * sorted by address, & merging adjacent blocks.
+ */
+static void bmem_add_blk(UINT32 start, UINT32 end)
+{
+	UINT32 idx = num_blks, top;
+	while (idx != 0 && blk[idx - 1].start > start)
+		--idx;
+	if (idx != 0 && blk[idx - 1].end == start) {
+		blk[idx - 1].end = end;
+		if (idx < num_blks && blk[idx].start == end) {
+			blk[idx - 1].end = blk[idx].end;
+			--num_blks;
+			while (idx < num_blks) {
+				blk[idx] = blk[idx + 1];
+				++idx;
+			}
+		}
+		return;
+	}
+	if (idx < num_blks && blk[idx].start == end) {
+		blk[idx].start = start;
+		return;
+	}
+	if (num_blks == MAX_BMEM_BLKS)
+		error(u"too many base mem. blocks!");
+	for (top = num_blks; top > idx; --top)
+		blk[top] = blk[top - 1];
+	blk[idx].start = start;
+	blk[idx].end = end;
+	++num_blks;
+}
+
+/*
+ * Get a UEFI memory map, reserve all the free base memory listed in it, &
+ * mark the reserved pages as available in `avail'.  Return false if some
+ * free memory could not be reserved --- e.g. if the memory map went stale
+ * --- & true otherwise.  In either case, return the memory map in *p_descs
+ * etc.
+ */
+static bool bmem_reserve_free(void *avail, EFI_MEMORY_DESCRIPTOR **p_descs,
+    UINTN *p_num_ents, UINTN *p_desc_sz)
+{
+	EFI_MEMORY_DESCRIPTOR *desc, *descs;
+	EFI_PHYSICAL_ADDRESS start, end;
+	UINTN num_ents, map_key, desc_sz, ent_iter, pages;
+	UINT32 idx;
+	EFI_STATUS status;
+	bool ok = true;
+	descs = get_mem_map(&num_ents, &map_key, &desc_sz);
+	FOR_EACH_MEM_DESC(desc, descs, desc_sz, num_ents, ent_iter) {
+		if (desc->Type != EfiConventionalMemory)
+			continue;
+		start = desc->PhysicalStart;
+		if (start >= BMEM_MAX_ADDR)
+			continue;
+		pages = desc->NumberOfPages;
+		if (pages > (BMEM_MAX_ADDR - start) / EFI_PAGE_SIZE)
+			pages = (BMEM_MAX_ADDR - start) / EFI_PAGE_SIZE;
+		status = BS->AllocatePages(AllocateAddress,
+		    EfiRuntimeServicesData, pages, &start);
+		if (EFI_ERROR(status)) {
+			ok = false;
+			continue;
+		}
+		end = start + pages * EFI_PAGE_SIZE;
+		for (idx = start / EFI_PAGE_SIZE; idx < end / EFI_PAGE_SIZE;
+		     ++idx)
+			bvec_set(avail, idx);
+		/*
+		 * Do not count the page at address 0 as part of a block,
+		 * even if we successfully reserved it.
+		 */
+		if (!start)
+			start = EFI_PAGE_SIZE;
+		if (start < end)
+			bmem_add_blk((UINT32)start, (UINT32)end);
+	}
+	*p_descs = descs;
+	*p_num_ents = num_ents;
+	*p_desc_sz = desc_sz;
+	return ok;
+}
+
 /* Initialize base memory allocation. */
 void bmem_init(void)
 {
-	UINTN page_count = BMEM_MAX_ADDR / EFI_PAGE_SIZE / 2;
 	EFI_MEMORY_DESCRIPTOR *desc, *descs;
 	EFI_PHYSICAL_ADDRESS start, end;
 	UINT32 idx, end_idx;
-	UINTN num_ents, map_key, desc_sz, ent_iter, num_extra_blks = 0;
+	UINTN num_ents, desc_sz, ent_iter, num_extra_blks = 0;
+	unsigned tries = 4;
 	/* Bit vector saying whether each page is available for use. */
 	BVEC_TYPE(BMEM_MAX_ADDR / EFI_PAGE_SIZE) avail;
 	memset(&avail, 0, sizeof avail);
 	/*
-	 * Grab all the base memory pages we can grab from UEFI.  Mark as
-	 * available all the pages we can grab at boot time.
+	 * Reserve all the free base memory pages that UEFI tells us about,
+	 * in one go for each free range.  Getting the memory map may itself
+	 * take away some free memory, making our map stale; if so, get a
+	 * fresh map & try again.  The pages counted below are only right
+	 * once a try has reserved every free range in its map.
 	 */
-	do {
-		for (;;) {
-			start = BMEM_MAX_ADDR;
-			EFI_STATUS status =
-			    BS->AllocatePages(AllocateMaxAddress,
-				EfiRuntimeServicesData, page_count, &start);
-			if (EFI_ERROR(status))
-				break;
-			idx = (UINT32)(start / EFI_PAGE_SIZE);
-			while (page_count-- != 0) {
-				bvec_set(&avail, idx);
-				++idx;
-			}
-		}
-		page_count /= 2;
-	} while (page_count);
-	/*
-	 * Group the available base memory into blocks for ease of tracking. 
-	 * Do not count the page at address 0, even if we successfull
-	 * allocated it.
-	 */
-	Output(u"avail. base mem. blocks:");
-	start = BMEM_MAX_ADDR;
-	for (idx = 1; idx < BMEM_MAX_ADDR / EFI_PAGE_SIZE; ++idx) {
-		if (bvec_test(&avail, idx)) {
-			if (start == BMEM_MAX_ADDR)
-				start = (UINT32)idx * EFI_PAGE_SIZE;
-		} else if (start != BMEM_MAX_ADDR) {
-			end = (UINT32)idx * EFI_PAGE_SIZE;
-			blk[num_blks].start = start;
-			blk[num_blks].end = blk[num_blks].orig_end = end;
-			if (num_blks % 4 == 0)
-				Output(u"\r\n");
-			Print(u"  @0x%lx~@0x%lx", start, end - 1);
-			++num_blks;
-			start = BMEM_MAX_ADDR;
-		}
+	while (!bmem_reserve_free(&avail, &descs, &num_ents, &desc_sz)) {
+		FreePool(descs);
+		if (--tries == 0)
+			error(u"cannot reserve base mem.!");
 	}
-	if (start != BMEM_MAX_ADDR) {
-		end = (UINT32)idx * EFI_PAGE_SIZE;
-		blk[num_blks].start = start;
-		blk[num_blks].end = blk[num_blks].orig_end = end;
-		if (num_blks % 4 == 0)
-			Output(u"\r\n");
-		Print(u"  @0x%lx~@0x%lx", start, end - 1);
-		++num_blks;
+	/* Group the available base memory into blocks for ease of tracking. */
+	say(V_TABLES, u"avail. base mem. blocks:");
+	for (idx = 0; idx < num_blks; ++idx) {
+		if (idx % 4 == 0)
+			say(V_TABLES, u"\r\n");
+		say(V_TABLES, u"  @0x%lx~@0x%lx", (UINT64)blk[idx].start,
+		    (UINT64)blk[idx].end - 1);
 	}
 	/*
 	 * While at it, also start to gauge the base memory at 0 that will
 	 * be available at run time (for filling in 0x40:0x13 later).  For
 	 * this, we should also count existing EfiBootServices{Code, Data} &
 	 * EfiLoader{Code, Data} pages, which will effectively be freed once
-	 * we exit boot services.  To count this, we need to obtain a UEFI
-	 * memory map.
+	 * we exit boot services.  To count this, use the last UEFI memory
+	 * map we obtained above.
 	 */
-	descs = get_mem_map(&num_ents, &map_key, &desc_sz);
 	FOR_EACH_MEM_DESC(desc, descs, desc_sz, num_ents, ent_iter) {
 		switch (desc->Type) {
 		    default:
@@ -242,8 +319,8 @@ void bmem_init(void)
 			if (end_idx > BMEM_MAX_ADDR / EFI_PAGE_SIZE)
 				end_idx = BMEM_MAX_ADDR / EFI_PAGE_SIZE;
 			if ((num_blks + num_extra_blks) % 4 == 0)
-				Output(u"\r\n");
-			Print(u"  [@0x%lx~@0x%lx]", start, end - 1);
+				say(V_TABLES, u"\r\n");
+			say(V_TABLES, u"  [@0x%lx~@0x%lx]", start, end - 1);
 			++num_extra_blks;
 			while (idx < end_idx) {
 				bvec_set(&avail, idx);
@@ -252,14 +329,49 @@ void bmem_init(void)
 			bmem_uefi_attr &= desc->Attribute;
 		}
 	}
-	Output(u"\r\n");
+	say(V_TABLES, u"\r\n");
+	FreePool(descs);
 	idx = 0;
 	while (idx < BMEM_MAX_ADDR / EFI_PAGE_SIZE && bvec_test(&avail, idx))
 		++idx;
 	if (idx < (192 * KIBYTE) / EFI_PAGE_SIZE)
 		error(u"not enough base mem.!");
-	runtime_bmem_top = (UINT32)idx * EFI_PAGE_SIZE;
+	runtime_bmem_top = max_runtime_bmem_top = (UINT32)idx * EFI_PAGE_SIZE;
 	bmem_check_enough();
+	/* Initially, all of our blocks are free. */
+	memcpy(ext, blk, num_blks * sizeof(blk_info_t));
+	num_exts = num_blks;
+}
+
+/*
+ * Take the address range `astart' up to `aend' out of free extent number
+ * `ext_idx', which should contain the range.
+ */
+static void bmem_carve(UINT32 ext_idx, UINT32 astart, UINT32 aend)
+{
+	UINT32 start = ext[ext_idx].start, end = ext[ext_idx].end, idx;
+	if (start == astart) {
+		if (end == aend) {
+			--num_exts;
+			for (idx = ext_idx; idx < num_exts; ++idx)
+				ext[idx] = ext[idx + 1];
+		} else
+			ext[ext_idx].start = aend;
+	} else {
+		ext[ext_idx].end = astart;
+		/*
+		 * If there is free space left above the allocation, add an
+		 * extent for it.  If we have run out of extents, just leave
+		 * the space unused.
+		 */
+		if (end != aend && num_exts != MAX_FREE_EXTS) {
+			for (idx = num_exts; idx > ext_idx + 1; --idx)
+				ext[idx] = ext[idx - 1];
+			ext[ext_idx + 1].start = aend;
+			ext[ext_idx + 1].end = end;
+			++num_exts;
+		}
+	}
 }
 
 /*
@@ -268,21 +380,21 @@ void bmem_init(void)
  */
 void *bmem_alloc(UINTN size, UINTN align)
 {
-	UINTN blk_idx;
-	/* Try to allocate from higher-addressed blocks first. */
-	blk_idx = num_blks;
-	while (blk_idx-- != 0) {
-		UINT32 bstart = blk[blk_idx].start, bend = blk[blk_idx].end;
+	UINT32 ext_idx;
+	/* Try to allocate from higher-addressed extents first. */
+	ext_idx = num_exts;
+	while (ext_idx-- != 0) {
+		UINT32 estart = ext[ext_idx].start, eend = ext[ext_idx].end;
 		UINT32 astart;
-		if (bend - bstart < size)
+		if (eend - estart < size)
 			continue;
-		astart = (bend - size) & -(UINT32)align;
-		if (astart < bstart)
+		astart = (eend - size) & -(UINT32)align;
+		if (astart < estart)
 			continue;
 		/* Success! */
 		if (runtime_bmem_top > astart)
 			runtime_bmem_top = astart;
-		blk[blk_idx].end = astart;
+		bmem_carve(ext_idx, astart, astart + size);
 		return (void *)(EFI_PHYSICAL_ADDRESS)astart;
 	}
 	error(u"cannot alloc. from base mem.!");
@@ -296,17 +408,17 @@ void *bmem_alloc(UINTN size, UINTN align)
  */
 void *bmem_alloc_boottime(UINTN size, UINTN align)
 {
-	UINTN blk_idx;
-	/* Try to allocate from lower-addressed blocks first. */
-	for (blk_idx = 0; blk_idx < num_blks; ++blk_idx) {
-		UINT32 bstart = blk[blk_idx].start, bend = blk[blk_idx].end;
+	UINT32 ext_idx;
+	/* Try to allocate from lower-addressed extents first. */
+	for (ext_idx = 0; ext_idx < num_exts; ++ext_idx) {
+		UINT32 estart = ext[ext_idx].start, eend = ext[ext_idx].end;
 		UINT32 astart, aend;
-		if (bend - bstart < size)
+		if (eend - estart < size)
 			continue;
-		astart = (bstart + (UINT32)align - 1) & -(UINT32)align;
-		if (astart > bend)
+		astart = (estart + (UINT32)align - 1) & -(UINT32)align;
+		if (astart > eend)
 			continue;
-		if (bend - astart < size)
+		if (eend - astart < size)
 			continue;
 		if (astart >= runtime_bmem_top)
 			error(u"cannot alloc. for boot time from base mem.!");
@@ -314,23 +426,83 @@ void *bmem_alloc_boottime(UINTN size, UINTN align)
 		aend = astart + size;
 		if (boottime_bmem_bot < aend)
 			boottime_bmem_bot = aend;
-		if (aend != bend)
-			blk[blk_idx].start = aend;
-		else {
-			while (blk_idx < num_blks - 1) {
-				blk[blk_idx] = blk[blk_idx + 1];
-				++blk_idx;
-			}
-			--num_blks;
-		}
+		bmem_carve(ext_idx, astart, aend);
 		return (void *)(EFI_PHYSICAL_ADDRESS)astart;
 	}
 	error(u"cannot alloc. for boot time from base mem.!");
 }
 
+/*
+ * Free `size' bytes of base memory at `p', which should have been
+ * allocated with bmem_alloc(, ) or bmem_alloc_boottime(, ).  If the memory
+ * is not in any of our blocks --- e.g. it is in shadow RAM --- do nothing.
+ */
+void bmem_free(void *p, UINTN size)
+{
+	UINT32 start = (UINT32)(EFI_PHYSICAL_ADDRESS)p, end = start + size,
+	       ext_idx = 0, idx;
+	bool merge_lo, merge_hi;
+	if (!size)
+		return;
+	for (idx = 0; idx < num_blks; ++idx)
+		if (start >= blk[idx].start && end <= blk[idx].end)
+			break;
+	if (idx == num_blks)
+		return;
+	while (ext_idx < num_exts && ext[ext_idx].start < start)
+		++ext_idx;
+	if ((ext_idx != 0 && ext[ext_idx - 1].end > start) ||
+	    (ext_idx < num_exts && ext[ext_idx].start < end))
+		error(u"freeing free base mem.!");
+	/*
+	 * Merge the freed range with its neighbours, if they are adjacent.
+	 * (Reserved blocks are never adjacent, so an extent never straddles
+	 * two blocks.)
+	 */
+	merge_lo = ext_idx != 0 && ext[ext_idx - 1].end == start;
+	merge_hi = ext_idx < num_exts && ext[ext_idx].start == end;
+	if (merge_lo && merge_hi) {
+		ext[ext_idx - 1].end = ext[ext_idx].end;
+		--num_exts;
+		for (idx = ext_idx; idx < num_exts; ++idx)
+			ext[idx] = ext[idx + 1];
+		--ext_idx;
+	} else if (merge_lo) {
+		ext[ext_idx - 1].end = end;
+		--ext_idx;
+	} else if (merge_hi)
+		ext[ext_idx].start = start;
+	else {
+		if (num_exts == MAX_FREE_EXTS)
+			return;
+		for (idx = num_exts; idx > ext_idx; --idx)
+			ext[idx] = ext[idx - 1];
+		ext[ext_idx].start = start;
+		ext[ext_idx].end = end;
+		++num_exts;
+	}
+	/*
+	 * If the free extent now reaches up to boottime_bmem_bot, or down
+	 * to runtime_bmem_top, then move these marks.
+	 */
+	start = ext[ext_idx].start;
+	end = ext[ext_idx].end;
+	if (start < boottime_bmem_bot && end >= boottime_bmem_bot) {
+		boottime_bmem_bot = start;
+		if (boottime_bmem_bot < EFI_PAGE_SIZE)
+			boottime_bmem_bot = EFI_PAGE_SIZE;
+	}
+	if (start <= runtime_bmem_top && end > runtime_bmem_top) {
+		runtime_bmem_top = end;
+		if (runtime_bmem_top > max_runtime_bmem_top)
+			runtime_bmem_top = max_runtime_bmem_top;
+	}
+}
+
 /*
  * Wrap up base memory allocation.  As part of this, add information about
- * memory address ranges below the 1 MiB mark, as boot parameters.
+ * memory address ranges below the 1 MiB mark, as boot parameters, & then
+ * seal the boot parameters.
  *
  * This routine accepts a memory map which the caller should have retrieved
  * via BS->GetMemoryMap(...) or some such.
@@ -340,11 +512,17 @@ void bmem_fini(EFI_MEMORY_DESCRIPTOR *descs, UINTN num_ents, UINTN desc_sz,
 {
 	add_uefi_mem_bparms(descs, num_ents, desc_sz);
 	add_our_mem_bparms();
+	/*
+	 * All the boot parameters should now be in.  Pack them into base
+	 * memory.  This is a boot-time allocation, so it does not change the
+	 * memory ranges just added above runtime_bmem_top.
+	 */
+	bparm_seal();
 	boottime_bmem_bot = (boottime_bmem_bot + PARA_SIZE - 1) & -PARA_SIZE;
 	runtime_bmem_top &= -KIBYTE;
 #if 0
 	/* FIXME: this alters the UEFI memory map. */
-	Print(u"base mem. at boottime: @0x%x~@0x%x\r\n",
+	say(V_TABLES, u"base mem. at boottime: @0x%x~@0x%x\r\n",
 	    boottime_bmem_bot, runtime_bmem_top);
 #endif
 	bmem_check_enough();
@@ -33,41 +33,84 @@
 #include <string.h>
 #include "stage1/stage1.h"
 
-static bparm_t *bp_head = NULL, *bp_tail = NULL;
+/*
+ * Boot parameters are first staged in a static buffer, as they are added. 
+ * Once all of them are in, bparm_seal() packs them into a boot parameter
+ * table in base memory, grouped by type.
+ *
+ * The staging buffer lives in stage 1's own image, so adding boot
+ * parameters does not change the UEFI memory map.
+ */
+
+#define STAGE_SZ	0x20000U	/* size of staging buffer */
+#define MAX_TYPES	16U		/* max. no. of boot param. types */
+
+/* Header for each boot parameter in the staging buffer. */
+typedef struct {
+	uint32_t type, size;
+} stage_hdr_t;
+
+/* UEFI memory attributes that say how a memory range can be cached. */
+#define CACHE_ATTRS	(EFI_MEMORY_UC | EFI_MEMORY_WC | EFI_MEMORY_WT | \
+			 EFI_MEMORY_WB | EFI_MEMORY_UCE)
+
+static char stage_buf[STAGE_SZ] __attribute__((aligned(8)));
+static uint32_t stage_used = 0;
+static bparm_tbl_t *tbl = NULL;
+/* Last memory range boot parameter added, if any. */
+static bdat_mem_range_t *last_mr = NULL;
+
+static uint32_t round_up_8(uint32_t x)
+{
+	return (x + 7) & -8U;
+}
 
 /*
- * Add a boot parameter node with the given type & a data field of the given
+ * Add a boot parameter with the given type & a data field of the given
  * size.  Return a pointer to the data field, which the caller should then
- * fill with the actual data.
+ * fill with the actual data.  The pointer stays valid until bparm_seal()
+ * is called.
  */
 void *bparm_add(uint32_t type, uint32_t size)
 {
-	bparm_t *bp = bmem_alloc_boottime(sizeof(bparm_t) + size,
-					  sizeof(void *));
-	if (!bp_head)
-		bp_head = bp_tail = bp;
-	else {
-		bp_tail->next = bp;
-		bp_tail = bp;
-	}
-	bp->next = NULL;
-	bp->type = type;
-	bp->size = size;
-	memset(bp->u, 0, size);
-	return bp->u;
+	stage_hdr_t *hdr;
+	uint32_t node_sz = round_up_8(sizeof(stage_hdr_t) + size);
+	if (tbl)
+		error(u"boot params. already sealed!");
+	if (node_sz > STAGE_SZ - stage_used)
+		error(u"too many boot params.!");
+	hdr = (stage_hdr_t *)(stage_buf + stage_used);
+	stage_used += node_sz;
+	hdr->type = type;
+	hdr->size = size;
+	memset(hdr + 1, 0, size);
+	return hdr + 1;
 }
 
 /*
- * Convenience function: add a boot parameter node for a memory address
- * range.  If the range is empty, do nothing.
+ * Convenience function: add a boot parameter for a memory address range.
+ * If the range is empty, do nothing.
+ *
+ * If the range follows right after the last range added, & has the same
+ * E820 type & the same cacheability, then just extend the last range.  The
+ * UEFI memory map often has many small adjacent ranges which map to the
+ * same E820 type.
  */
 bdat_mem_range_t *bparm_add_mem_range(uint64_t start, uint64_t len,
     uint32_t e820_type, uint32_t e820_ext_attr, uint64_t uefi_attr)
 {
-	bdat_mem_range_t *bd;
+	bdat_mem_range_t *bd = last_mr;
 	if (!len)
 		return NULL;
-	bd = bparm_add(BP_MRNG, sizeof(bdat_mem_range_t));
+	if (bd && bd->start + bd->len == start &&
+	    bd->e820_type == e820_type &&
+	    bd->e820_ext_attr == e820_ext_attr &&
+	    ((bd->uefi_attr ^ uefi_attr) & CACHE_ATTRS) == 0) {
+		bd->len += len;
+		bd->uefi_attr &= uefi_attr;
+		return bd;
+	}
+	bd = last_mr = bparm_add(BP_MRNG, sizeof(bdat_mem_range_t));
 	bd->start = start;
 	bd->len = len;
 	bd->e820_type = e820_type;
@@ -76,8 +119,77 @@ bdat_mem_range_t *bparm_add_mem_range(uint64_t start, uint64_t len,
 	return bd;
 }
 
-/* Return the linked list of boot parameters built up. */
-bparm_t *bparm_get(void)
+/*
+ * Pack all the boot parameters added so far into a boot parameter table
+ * in base memory, for use at boot time.  After this, bparm_find(, ) gives
+ * the new locations of the boot data.
+ */
+void bparm_seal(void)
+{
+	bparm_idx_t idx[MAX_TYPES];
+	uint32_t fill[MAX_TYPES];
+	unsigned num_types = 0, i;
+	uint32_t pos, total_sz;
+	const stage_hdr_t *hdr;
+	/* Count the boot parameters of each type. */
+	for (pos = 0; pos < stage_used;
+	     pos += round_up_8(sizeof(stage_hdr_t) + hdr->size)) {
+		hdr = (const stage_hdr_t *)(stage_buf + pos);
+		for (i = 0; i < num_types; ++i)
+			if (idx[i].type == hdr->type)
+				break;
+		if (i == num_types) {
+			if (num_types == MAX_TYPES)
+				error(u"too many boot param. types!");
+			idx[i].type = hdr->type;
+			idx[i].count = 0;
+			idx[i].ent_sz = hdr->size;
+			++num_types;
+		} else if (idx[i].ent_sz != hdr->size)
+			error(u"boot param. size mismatch!");
+		++idx[i].count;
+	}
+	/* Lay out the table. */
+	total_sz = round_up_8(sizeof(bparm_tbl_t) +
+			      num_types * sizeof(bparm_idx_t));
+	for (i = 0; i < num_types; ++i) {
+		idx[i].off = total_sz;
+		fill[i] = total_sz;
+		total_sz += round_up_8(idx[i].count * idx[i].ent_sz);
+	}
+	tbl = bmem_alloc_boottime(total_sz, 8);
+	memset(tbl, 0, total_sz);
+	tbl->magic = BPARM_MAGIC;
+	tbl->ver = BPARM_VER;
+	tbl->num_types = num_types;
+	tbl->total_sz = total_sz;
+	memcpy(tbl->idx, idx, num_types * sizeof(bparm_idx_t));
+	/* Copy the boot data to their places in the table. */
+	for (pos = 0; pos < stage_used;
+	     pos += round_up_8(sizeof(stage_hdr_t) + hdr->size)) {
+		hdr = (const stage_hdr_t *)(stage_buf + pos);
+		for (i = 0; idx[i].type != hdr->type; ++i);
+		memcpy((char *)tbl + fill[i], hdr + 1, hdr->size);
+		fill[i] += hdr->size;
+	}
+	stage_used = 0;
+	last_mr = NULL;
+}
+
+/*
+ * Find the boot data of the given type in the sealed boot parameter table.
+ * Return a pointer to the first entry, & the no. of entries in *p_count
+ * (if `p_count' != NULL).
+ */
+void *bparm_find(uint32_t type, uint32_t *p_count)
+{
+	if (!tbl)
+		error(u"boot params. not sealed!");
+	return bparm_tbl_find(tbl, type, p_count);
+}
+
+/* Return the sealed boot parameter table. */
+bparm_tbl_t *bparm_get(void)
 {
-	return bp_head;
+	return tbl;
 }
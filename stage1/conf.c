@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2021 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include "stage1/stage1.h"
+
+/*
+ * Boot configuration file handling.
+ *
+ * The configuration file is a plain ASCII (or UTF-8) text file, placed
+ * next to the stage 2 program on the boot volume.  Each line is either
+ * blank, a comment starting with `#' or `;', or a setting of the form
+ * `key = value'.  Recognized settings:
+ *
+ *   delay = <secs.>	seconds to wait before exiting UEFI (may be 0)
+ *   skip_delay_on_key = yes|no
+ *			whether a keypress cuts the above wait short
+ *   verbosity = 0|1|2	0 = errors & warnings only, 1 = also progress
+ *			info., 2 = also detailed tables (default)
+ *   stage2 = <path>	a path name to try loading stage 2 from; may be
+ *			given several times, to say which paths to try &
+ *			in what order
+ *   log_file = <path>	a path name to write the boot log to, just before
+ *			exiting UEFI (default: none)
+ *   rom_cache = yes|no	whether to cache the option ROM images found in
+ *			the firmware volumes in a file on the boot volume,
+ *			so that later boots can skip the FV scan
+ *			(default: yes)
+ *   rom = <vvvv>:<dddd> eager|defer|skip
+ *   rom = class:<cc>[<ss>] eager|defer|skip
+ *			when stage 2 should run the option ROM for PCI
+ *			devices with the given vendor & device id., or
+ *			class (& subclass), all in hex.: during boot
+ *			(default), only when first needed, or never; may
+ *			be given several times, & the last matching rule
+ *			wins
+ *
+ * Anything not understood is warned about & then ignored.
+ */
+
+#define CONF		u"EFI\\biefirc\\biefirc.cfg"
+#define CONF_ALT	u"biefirc.cfg"
+
+#define STAGE2		u"EFI\\biefirc\\stage2.sys"
+#define STAGE2_ALT	u"biefist2.sys"
+#define STAGE2_ALT_ALT	u"kernel.sys"
+
+#define MAX_CONF_SZ	0x10000U
+#define MAX_PATH_LEN	128U
+
+static CHAR16 stage2_path_buf[MAX_STAGE2_PATHS][MAX_PATH_LEN],
+	      log_path_buf[MAX_PATH_LEN];
+
+conf_t conf = {
+	.delay_secs = 3,
+	.skip_delay_on_key = true,
+	.verbosity = V_TABLES,
+	.num_stage2_paths = 3,
+	.stage2_paths = { STAGE2, STAGE2_ALT, STAGE2_ALT_ALT },
+	.rom_cache = true
+};
+
+static bool conf_space_p(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static void conf_warn(unsigned line_no, IN CONST CHAR16 *msg)
+{
+	warn(u"config. line %u: %s", line_no, msg);
+}
+
+static bool conf_parse_uint(const char *val, unsigned max, unsigned *p_res)
+{
+	unsigned res = 0;
+	if (!*val)
+		return false;
+	while (*val) {
+		unsigned dig;
+		if (*val < '0' || *val > '9')
+			return false;
+		dig = (unsigned)(*val++ - '0');
+		if (dig > max || res > (max - dig) / 10)
+			return false;
+		res = res * 10 + dig;
+	}
+	*p_res = res;
+	return true;
+}
+
+static bool conf_parse_bool(const char *val, bool *p_res)
+{
+	static const char * const yes[] = { "yes", "true", "on", "1" },
+			   * const no[] = { "no", "false", "off", "0" };
+	unsigned i;
+	for (i = 0; i < sizeof(yes) / sizeof(yes[0]); ++i) {
+		if (strcmp(val, yes[i]) == 0) {
+			*p_res = true;
+			return true;
+		}
+		if (strcmp(val, no[i]) == 0) {
+			*p_res = false;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Parse exactly `digits' hex. digits, & advance past them. */
+static bool conf_parse_hex(const char **p_val, unsigned digits,
+    uint32_t *p_res)
+{
+	const char *val = *p_val;
+	uint32_t res = 0;
+	while (digits-- != 0) {
+		char c = *val++;
+		if (c >= '0' && c <= '9')
+			res = res << 4 | (uint32_t)(c - '0');
+		else if (c >= 'a' && c <= 'f')
+			res = res << 4 | (uint32_t)(c - 'a' + 10);
+		else if (c >= 'A' && c <= 'F')
+			res = res << 4 | (uint32_t)(c - 'A' + 10);
+		else
+			return false;
+	}
+	*p_val = val;
+	*p_res = res;
+	return true;
+}
+
+static bool conf_parse_rom_rule(const char *val, conf_rom_rule_t *rule)
+{
+	static const char class_pfx[] = "class:";
+	/* Indexed by RIMG_... value. */
+	static const char * const policies[] = { "eager", "defer", "skip" };
+	const char *p = val;
+	uint32_t x, y;
+	unsigned i;
+	for (i = 0; class_pfx[i] && p[i] == class_pfx[i]; ++i);
+	if (!class_pfx[i]) {
+		p += i;
+		if (!conf_parse_hex(&p, 2, &x))
+			return false;
+		rule->class_p = true;
+		rule->mask = 0xff000000U;
+		rule->val = x << 24;
+		if (conf_parse_hex(&p, 2, &y)) {
+			rule->mask |= 0x00ff0000U;
+			rule->val |= y << 16;
+		}
+	} else {
+		if (!conf_parse_hex(&p, 4, &x) || *p++ != ':' ||
+		    !conf_parse_hex(&p, 4, &y))
+			return false;
+		rule->class_p = false;
+		rule->mask = 0xffffffffU;
+		rule->val = pci_make_id((uint16_t)x, (uint16_t)y);
+	}
+	if (!conf_space_p(*p))
+		return false;
+	while (conf_space_p(*p))
+		++p;
+	for (i = 0; i < sizeof(policies) / sizeof(policies[0]); ++i) {
+		if (strcmp(p, policies[i]) == 0) {
+			rule->policy = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool conf_parse_path(const char *val, CHAR16 *path)
+{
+	unsigned len = 0;
+	if (!*val)
+		return false;
+	while (*val) {
+		char c = *val++;
+		if ((unsigned char)c < 0x20 || (unsigned char)c >= 0x7f)
+			return false;
+		if (len == MAX_PATH_LEN - 1)
+			return false;
+		/* Accept forward slashes as path separators too. */
+		path[len++] = c == '/' ? u'\\' : (CHAR16)c;
+	}
+	/* Strip any leading backslash --- paths are relative to the root. */
+	path[len] = 0;
+	if (path[0] == u'\\') {
+		unsigned i;
+		for (i = 0; i < len; ++i)
+			path[i] = path[i + 1];
+		--len;
+	}
+	return len != 0;
+}
+
+static void conf_process_setting(unsigned line_no, const char *key,
+    const char *val, bool *p_saw_stage2)
+{
+	if (strcmp(key, "delay") == 0) {
+		if (!conf_parse_uint(val, 3600U, &conf.delay_secs))
+			conf_warn(line_no, u"bad delay");
+	} else if (strcmp(key, "skip_delay_on_key") == 0) {
+		if (!conf_parse_bool(val, &conf.skip_delay_on_key))
+			conf_warn(line_no, u"bad yes/no value");
+	} else if (strcmp(key, "verbosity") == 0) {
+		if (!conf_parse_uint(val, V_TABLES, &conf.verbosity))
+			conf_warn(line_no, u"bad verbosity");
+	} else if (strcmp(key, "stage2") == 0) {
+		unsigned n;
+		/* The first stage2 = ... setting replaces the defaults. */
+		if (!*p_saw_stage2) {
+			conf.num_stage2_paths = 0;
+			*p_saw_stage2 = true;
+		}
+		n = conf.num_stage2_paths;
+		if (n == MAX_STAGE2_PATHS)
+			conf_warn(line_no, u"too many stage2 paths");
+		else if (!conf_parse_path(val, stage2_path_buf[n]))
+			conf_warn(line_no, u"bad stage2 path");
+		else {
+			conf.stage2_paths[n] = stage2_path_buf[n];
+			conf.num_stage2_paths = n + 1;
+		}
+	} else if (strcmp(key, "log_file") == 0) {
+		if (!conf_parse_path(val, log_path_buf))
+			conf_warn(line_no, u"bad log file path");
+		else
+			conf.log_path = log_path_buf;
+	} else if (strcmp(key, "rom_cache") == 0) {
+		if (!conf_parse_bool(val, &conf.rom_cache))
+			conf_warn(line_no, u"bad yes/no value");
+	} else if (strcmp(key, "rom") == 0) {
+		unsigned n = conf.num_rom_rules;
+		if (n == MAX_ROM_RULES)
+			conf_warn(line_no, u"too many rom rules");
+		else if (!conf_parse_rom_rule(val, &conf.rom_rules[n]))
+			conf_warn(line_no, u"bad rom rule");
+		else
+			conf.num_rom_rules = n + 1;
+	} else
+		conf_warn(line_no, u"unknown setting");
+}
+
+static void conf_parse(char *text)
+{
+	unsigned line_no = 0;
+	bool saw_stage2 = false;
+	char *line = text, *next;
+	/* Skip any UTF-8 byte order mark. */
+	if ((unsigned char)line[0] == 0xef && (unsigned char)line[1] == 0xbb &&
+	    (unsigned char)line[2] == 0xbf)
+		line += 3;
+	for (; line; line = next) {
+		char *key, *val, *p;
+		++line_no;
+		/* Isolate this line. */
+		next = line;
+		while (*next && *next != '\n')
+			++next;
+		if (*next)
+			*next++ = 0;
+		else
+			next = NULL;
+		/* Strip comments & leading & trailing blanks. */
+		for (p = line; *p && *p != '#' && *p != ';'; ++p);
+		*p = 0;
+		while (conf_space_p(*line))
+			++line;
+		while (p != line && conf_space_p(p[-1]))
+			*--p = 0;
+		if (!*line)
+			continue;
+		/* Split into key & value. */
+		key = line;
+		for (p = key; *p && *p != '='; ++p);
+		if (!*p) {
+			conf_warn(line_no, u"no `='");
+			continue;
+		}
+		val = p + 1;
+		while (p != key && conf_space_p(p[-1]))
+			--p;
+		*p = 0;
+		while (conf_space_p(*val))
+			++val;
+		conf_process_setting(line_no, key, val, &saw_stage2);
+	}
+	if (saw_stage2 && !conf.num_stage2_paths)
+		error(u"config. gives no usable stage2 paths");
+}
+
+/*
+ * Say when stage 2 should run the option ROM for a PCI device, going by
+ * the last matching rom = ... setting, if any.
+ */
+unsigned conf_rom_policy(uint32_t pci_id, uint32_t class_if)
+{
+	unsigned n = conf.num_rom_rules;
+	while (n-- != 0) {
+		const conf_rom_rule_t *rule = &conf.rom_rules[n];
+		uint32_t x = rule->class_p ? class_if : pci_id;
+		if ((x & rule->mask) == rule->val)
+			return rule->policy;
+	}
+	return RIMG_EAGER;
+}
+
+/*
+ * Read & apply the boot configuration file, if there is one.  Settings not
+ * mentioned in the file keep their defaults.
+ */
+void conf_init(void)
+{
+	EFI_FILE_PROTOCOL *vol = open_boot_vol();
+	CONST CHAR16 *name = CONF;
+	char *text = read_whole_file(vol, name, MAX_CONF_SZ, NULL);
+	if (!text) {
+		name = CONF_ALT;
+		text = read_whole_file(vol, name, MAX_CONF_SZ, NULL);
+	}
+	vol->Close(vol);
+	if (!text)
+		return;
+	conf_parse(text);
+	FreePool(text);
+	say(V_INFO, u"config.: %s  delay: %u s.%s  verbosity: %u\r\n",
+	    name, conf.delay_secs,
+	    conf.skip_delay_on_key ? u" (skippable)" : u"",
+	    conf.verbosity);
+}
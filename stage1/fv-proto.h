@@ -44,7 +44,11 @@ typedef UINT64 EFI_FV_ATTRIBUTES;
 
 /* EFI_FV_FILETYPE values. */
 #define EFI_FV_FILETYPE_ALL			0x00
+#define EFI_FV_FILETYPE_RAW			0x01
+#define EFI_FV_FILETYPE_FREEFORM		0x02
 #define EFI_FV_FILETYPE_FIRMWARE_VOLUME_IMAGE	0x0b
+#define EFI_FV_FILETYPE_OEM_MIN			0xc0
+#define EFI_FV_FILETYPE_OEM_MAX			0xdf
 #define EFI_FV_FILETYPE_FFS_PAD			0xf0
 
 /* EFI_SECTION_TYPE values. */
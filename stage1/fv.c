@@ -35,71 +35,269 @@ static EFI_GUID gEfiFirmwareVolume2ProtocolGuid =
 		    { 0x220e73b6, 0x6bdb, 0x4413,
 		      { 0x84, 0x05, 0xb9, 0x74, 0xb1, 0x08, 0x61, 0x9a } };
 
+static EFI_GUID gSmbiosTableGuid =
+		    { 0xeb9d2d31, 0x2d88, 0x11d3,
+		      { 0x9a, 0x16, 0x00, 0x90, 0x27, 0x3f, 0xc1, 0x4d } },
+		  gSmbios3TableGuid =
+		    { 0xf2fd1544, 0x9794, 0x4a2c,
+		      { 0x99, 0x2e, 0xe5, 0xbb, 0xcf, 0x20, 0xe3, 0x94 } };
+
 #define MAX_OROM_SZ	0xf0000ULL
-#define HASH_BUCKETS	1381
+/* Range of FV file sizes worth looking at for option ROM images. */
+#define MIN_FV_FILE_SZ	0x20ULL
+#define MAX_FV_FILE_SZ	0x400000ULL
+
+/*
+ * Option ROM cache file.  This holds a header, then the PCI id. & class
+ * keys which were searched for, then each ROM image found in the firmware
+ * volumes (each preceded by an entry header, & padded to a multiple of 8
+ * bytes), in the order in which they were found.
+ */
+#define ROM_CACHE	u"EFI\\biefirc\\romcache.bin"
+#define ROM_CACHE_MAGIC	MAGIC32('R', 'O', 'M', 'C')
+#define ROM_CACHE_VER	2U
+#define MAX_ROM_CACHE_SZ 0x1000000ULL
 
-typedef struct ht_node {
-	struct ht_node *next;
+typedef struct {
+	uint32_t magic, ver;
+	uint64_t fprint;	/* firmware fingerprint */
+	uint64_t data_hash;	/* FNV-1a hash of everything after header */
+	uint32_t total_sz;	/* total file size, including header */
+	uint32_t num_keys;	/* no. of keys searched for */
+	uint32_t num_rimgs;	/* no. of ROM images */
+	uint32_t reserved;
+} rc_hdr_t;
+
+typedef struct {
+	uint32_t rimg_sz, reserved;
+} rc_ent_t;
+
+#define RC_ALIGN(sz)	(((sz) + 7ULL) & ~7ULL)
+
+typedef struct {
 	uint32_t pci_id, class_if;
+} rimg_key_t;
+
+/* A cached option ROM image. */
+typedef struct {
 	void *rimg_copy;
 	uint32_t rimg_sz;
-} ht_node_t;
+	uint64_t hash;		/* FNV-1a hash of image contents */
+	bool own_p;		/* whether rimg_copy is its own pool block */
+	bool used_p;		/* whether fv_find_rimg(...) handed it out */
+} rimg_ent_t;
 
-static ht_node_t *ht[HASH_BUCKETS];
+/* A PCI id. & class, & the cached image for it. */
+typedef struct {
+	uint32_t pci_id, class_if;
+	uint32_t rimg_no;	/* 1 + index into rimgs[], or 0 if unused */
+} key_ent_t;
+
+/* Counts of FV files & sections looked at, for diagnostics. */
+typedef struct {
+	UINTN files, files_tried, sxns_probed, sxns_read;
+} fv_stats_t;
+
+/* Cached images, in the order found. */
+static rimg_ent_t *rimgs = NULL;
+static UINTN num_rimgs = 0, max_rimgs = 0;
+/* Keys for the cached images, in the order found. */
+static key_ent_t *keys = NULL;
+static UINTN num_keys = 0, max_keys = 0;
+/* Open-addressed hash table of keys, built once the scan is done. */
+static key_ent_t *tbl = NULL;
+static UINTN tbl_mask = 0;
+/* Option ROM cache file contents, if the images came from there. */
+static void *cache_buf = NULL;
+
+/* PCI ids. & classes for which we want option ROM images. */
+static rimg_key_t *wants = NULL;
+static UINTN num_wants = 0, max_wants = 0;
+static bool scanned_p = false;
 
-static unsigned fv_hash_bucket(uint32_t pci_id, uint32_t class_if)
+/* Buffers for reading raw sections. */
+static void *sxn_buf = NULL;
+static uint8_t probe_buf[HKIBYTE];
+
+static bool fv_wanted_p(uint32_t pci_id, uint32_t class_if)
 {
-	return (unsigned)(((uint64_t)pci_id << 32 | class_if) % HASH_BUCKETS);
+	UINTN i;
+	for (i = 0; i < num_wants; ++i)
+		if (wants[i].pci_id == pci_id && wants[i].class_if == class_if)
+			return true;
+	return false;
 }
 
-static void fv_add_hash_entry(uint32_t pci_id, uint32_t class_if,
-    void *rimg_copy, uint32_t sz)
+static uint32_t fv_rimg_class_if(const rimg_pcir_t *pcir)
 {
-	unsigned bucket = fv_hash_bucket(pci_id, class_if);
-	ht_node_t *node = AllocatePool(sizeof(ht_node_t));
-	if (!node)
-		error(u"no mem. to cache option ROM image!");
-	node->next = ht[bucket];
-	node->pci_id = pci_id;
-	node->class_if = class_if;
-	node->rimg_copy = rimg_copy;
-	node->rimg_sz = sz;
-	ht[bucket] = node;
+	return (uint32_t)pcir->class_if[2] << 24 |
+	       (uint32_t)pcir->class_if[1] << 16 |
+	       (uint32_t)pcir->class_if[0] <<  8;
 }
 
-static void fv_cache_rimg(const void *rimg, uint32_t sz,
+/* Say whether we want an option ROM image for any of its PCI ids. */
+static bool fv_rimg_wanted_p(const void *rimg, uint32_t sz,
     const rimg_pcir_t *pcir)
 {
-	uint32_t class_if = (uint32_t)pcir->class_if[2] << 24 |
-			    (uint32_t)pcir->class_if[1] << 16 |
-			    (uint32_t)pcir->class_if[0] <<  8;
+	uint32_t class_if = fv_rimg_class_if(pcir);
+	uint16_t vendor = pci_id_vendor(pcir->pci_id), dev;
+	const uint16_t *dev_ids;
+	if (fv_wanted_p(pcir->pci_id, class_if))
+		return true;
+	dev_ids = rimg_pcir_find_dev_id_list(pcir, (const char *)rimg + sz);
+	if (dev_ids) {
+		while ((dev = *dev_ids++) != 0)
+			if (fv_wanted_p(pci_make_id(vendor, dev), class_if))
+				return true;
+	}
+	return false;
+}
+
+/* Make room for more entries in a pool-allocated array. */
+static void *fv_grow(void *arr, UINTN *p_max, UINTN ent_sz)
+{
+	UINTN new_max = *p_max ? 2 * *p_max : 16;
+	arr = ReallocatePool(arr, *p_max * ent_sz, new_max * ent_sz);
+	if (!arr)
+		error(u"no mem. for option ROM index");
+	*p_max = new_max;
+	return arr;
+}
+
+static UINTN fv_add_rimg(void *rimg_copy, uint32_t sz, uint64_t hash,
+    bool own_p)
+{
+	rimg_ent_t *ent;
+	if (num_rimgs == max_rimgs)
+		rimgs = fv_grow(rimgs, &max_rimgs, sizeof(rimg_ent_t));
+	ent = &rimgs[num_rimgs];
+	ent->rimg_copy = rimg_copy;
+	ent->rimg_sz = sz;
+	ent->hash = hash;
+	ent->own_p = own_p;
+	ent->used_p = false;
+	return num_rimgs++;
+}
+
+/* Look for an already cached image with the same contents. */
+static UINTN fv_find_same_rimg(const void *rimg, uint32_t sz, uint64_t hash)
+{
+	UINTN idx;
+	for (idx = 0; idx < num_rimgs; ++idx) {
+		const rimg_ent_t *ent = &rimgs[idx];
+		if (ent->hash == hash && ent->rimg_sz == sz &&
+		    memcmp(ent->rimg_copy, rimg, sz) == 0)
+			break;
+	}
+	return idx;
+}
+
+static void fv_add_key(uint32_t pci_id, uint32_t class_if, UINTN rimg_idx)
+{
+	key_ent_t *key;
+	if (num_keys == max_keys)
+		keys = fv_grow(keys, &max_keys, sizeof(key_ent_t));
+	key = &keys[num_keys++];
+	key->pci_id = pci_id;
+	key->class_if = class_if;
+	key->rimg_no = (uint32_t)rimg_idx + 1;
+}
+
+/*
+ * Add keys for a cached option ROM image, for those of its PCI ids. which
+ * are wanted.
+ */
+static void fv_index_rimg(UINTN rimg_idx, const rimg_pcir_t *pcir)
+{
+	void *rimg_copy = rimgs[rimg_idx].rimg_copy;
+	uint32_t sz = rimgs[rimg_idx].rimg_sz;
+	uint32_t class_if = fv_rimg_class_if(pcir);
 	uint32_t pci_id_0 = pcir->pci_id, pci_id;
 	uint16_t vendor = pci_id_vendor(pci_id_0);
 	const uint16_t *dev_ids;
 	uint16_t dev;
-	const void *rimg_end = (const char *)rimg + sz;
-	void *rimg_copy = AllocatePool(sz);
-	if (!rimg_copy)
-		error(u"no mem. to cache ROM img.!");
-	memcpy(rimg_copy, rimg, sz);
+	const void *rimg_end = (const char *)rimg_copy + sz;
 	dev_ids = rimg_pcir_find_dev_id_list(pcir, rimg_end);
-	Print(u"      cache ROM img. @0x%lx~@0x%lx for %04x:%04x%s "
-		     "%02x %02x %02x\r\n",
+	say(V_TABLES, u"      cache ROM img. @0x%lx~@0x%lx for "
+			 "%04x:%04x%s %02x %02x %02x\r\n",
 	    rimg_copy, (char *)rimg_copy + sz - 1,
 	    (UINT32)vendor, (UINT32)pci_id_dev(pci_id_0),
-	    dev_ids ? u" etc." : u"",
-	    class_if >> 24, (class_if >> 16) & 0xffU, (class_if >> 8) & 0xffU);
-	fv_add_hash_entry(pci_id_0, class_if, rimg_copy, sz);
+	    dev_ids ? u" etc." : u"", class_if >> 24,
+	    (class_if >> 16) & 0xffU, (class_if >> 8) & 0xffU);
+	if (fv_wanted_p(pci_id_0, class_if))
+		fv_add_key(pci_id_0, class_if, rimg_idx);
 	if (dev_ids) {
 		while ((dev = *dev_ids++) != 0) {
 			pci_id = pci_make_id(vendor, dev);
-			if (pci_id != pci_id_0)
-				fv_add_hash_entry(pci_id, class_if,
-				    rimg_copy, sz);
+			if (pci_id != pci_id_0 &&
+			    fv_wanted_p(pci_id, class_if))
+				fv_add_key(pci_id, class_if, rimg_idx);
 		}
 	}
 }
 
+/*
+ * Cache a wanted option ROM image found in a firmware volume.  If an
+ * identical image is already cached, reuse that rather than copying.
+ */
+static void fv_cache_rimg(const void *rimg, uint32_t sz,
+    const rimg_pcir_t *pcir)
+{
+	uint64_t hash;
+	UINTN idx;
+	void *rimg_copy;
+	if (!fv_rimg_wanted_p(rimg, sz, pcir))
+		return;
+	hash = fnv1a_64(FNV1A_64_INIT, rimg, sz);
+	idx = fv_find_same_rimg(rimg, sz, hash);
+	if (idx == num_rimgs) {
+		rimg_copy = AllocatePool(sz);
+		if (!rimg_copy)
+			error(u"no mem. to cache ROM img.!");
+		memcpy(rimg_copy, rimg, sz);
+		fv_add_rimg(rimg_copy, sz, hash, true);
+	} else
+		rimg_copy = rimgs[idx].rimg_copy;
+	fv_index_rimg(idx, (const rimg_pcir_t *)
+	    ((char *)rimg_copy + ((const char *)pcir - (const char *)rimg)));
+}
+
+/* Return the hash table slot for a key, or the free slot where it goes. */
+static UINTN fv_key_slot(uint32_t pci_id, uint32_t class_if)
+{
+	uint64_t h = ((uint64_t)pci_id << 32 | class_if) *
+		     0x9e3779b97f4a7c15ULL;
+	UINTN slot = (UINTN)(h >> 32) & tbl_mask;
+	while (tbl[slot].rimg_no != 0 && (tbl[slot].pci_id != pci_id ||
+					  tbl[slot].class_if != class_if))
+		slot = (slot + 1) & tbl_mask;
+	return slot;
+}
+
+/*
+ * Build the hash table from the keys found, making it at least twice as
+ * large as the no. of keys.  Where a key occurs more than once, the image
+ * found last wins.
+ */
+static void fv_build_tbl(void)
+{
+	UINTN tbl_sz = 16, i;
+	while (tbl_sz < 2 * num_keys)
+		tbl_sz *= 2;
+	tbl = AllocateZeroPool(tbl_sz * sizeof(key_ent_t));
+	if (!tbl)
+		error(u"no mem. for option ROM index");
+	tbl_mask = tbl_sz - 1;
+	for (i = 0; i < num_keys; ++i)
+		tbl[fv_key_slot(keys[i].pci_id, keys[i].class_if)] = keys[i];
+	say(V_TABLES, u"  option ROM index: %lu img(s)., %lu key(s), "
+			 "%lu slots\r\n", num_rimgs, num_keys, tbl_sz);
+	if (keys)
+		FreePool(keys);
+	keys = NULL;
+	num_keys = max_keys = 0;
+}
+
 static void fv_gather_rimgs_for_one_sxn(const void *rom, UINTN rom_sz,
     const EFI_GUID *p_guid, UINTN instance)
 {
@@ -111,9 +309,10 @@ static void fv_gather_rimgs_for_one_sxn(const void *rom, UINTN rom_sz,
 	bool saw_a_pcir = false;
 	while ((pcir = rimg_find_pcir(rom_left, rom_left_sz)) != NULL) {
 		if (!saw_a_pcir) {
-			Output(u"    ");
-			print_guid(p_guid);
-			Print(u" raw sec. %lx is option ROM\r\n", instance);
+			say(V_TABLES, u"    ");
+			say_guid(V_TABLES, p_guid);
+			say(V_TABLES, u" raw sec. %lx is option ROM\r\n",
+			    instance);
 			saw_a_pcir = true;
 		}
 		this_sz = (uint32_t)pcir->rimg_sz_hkib * HKIBYTE;
@@ -138,32 +337,102 @@ static void fv_gather_rimgs_for_one_sxn(const void *rom, UINTN rom_sz,
 	}
 }
 
+/*
+ * Say whether the start of a raw section looks like it might be an option
+ * ROM image: it should have the 0x55 0xaa signature, & a PCIR structure
+ * offset which is within range --- & if the PCIR structure starts inside
+ * the probed area, it should have the right signature.
+ */
+static bool fv_probe_sxn(const void *probe, UINTN probe_sz)
+{
+	const rimg_hdr_t *hdr = probe;
+	uint16_t pcir_off;
+	if (probe_sz < sizeof(rimg_hdr_t) || hdr->sig != 0xaa55U)
+		return false;
+	pcir_off = hdr->pcir_off;
+	if (pcir_off < sizeof(rimg_hdr_t) || pcir_off % 4 != 0 ||
+	    pcir_off > MAX_OROM_SZ - PCIR_MIN_SZ)
+		return false;
+	if (pcir_off <= probe_sz - sizeof(uint32_t) &&
+	    ((const rimg_pcir_t *)((const char *)probe + pcir_off))->sig
+	    != PCIR_SIG_PCIR)
+		return false;
+	return true;
+}
+
 static void fv_gather_rimgs_for_one_file(EFI_FIRMWARE_VOLUME2_PROTOCOL *fv,
-    EFI_GUID *p_guid)
+    EFI_GUID *p_guid, fv_stats_t *stats)
 {
 	UINTN instance = 0;
-	void *sxn = AllocatePool(MAX_OROM_SZ);
 	do {
-		UINTN sxn_sz = MAX_OROM_SZ;
+		UINTN sxn_sz = HKIBYTE;
 		UINT32 auth;
-		EFI_STATUS status = fv->ReadSection(fv, p_guid,
-		    EFI_SECTION_RAW, instance, &sxn, &sxn_sz, &auth);
+		void *probe = probe_buf;
+		EFI_STATUS status;
+		/*
+		 * First read just the start of the section.  The call
+		 * gives EFI_WARN_BUFFER_TOO_SMALL if the section is longer.
+		 * (If the firmware instead refuses outright with
+		 * EFI_BUFFER_TOO_SMALL, just read the whole section.)
+		 */
+		status = fv->ReadSection(fv, p_guid, EFI_SECTION_RAW,
+		    instance, &probe, &sxn_sz, &auth);
+		if (status != EFI_BUFFER_TOO_SMALL) {
+			if (EFI_ERROR(status))
+				break;
+			++stats->sxns_probed;
+			if (sxn_sz > HKIBYTE)
+				sxn_sz = HKIBYTE;
+			if (!fv_probe_sxn(probe_buf, sxn_sz))
+				continue;
+			if (status != EFI_WARN_BUFFER_TOO_SMALL) {
+				fv_gather_rimgs_for_one_sxn(probe_buf, sxn_sz,
+				    p_guid, instance);
+				continue;
+			}
+		}
+		/* Looks promising; read the whole section. */
+		sxn_sz = MAX_OROM_SZ;
+		status = fv->ReadSection(fv, p_guid, EFI_SECTION_RAW,
+		    instance, &sxn_buf, &sxn_sz, &auth);
 		if (EFI_ERROR(status))
 			break;
+		++stats->sxns_read;
 		if (sxn_sz > MAX_OROM_SZ)
 			sxn_sz = MAX_OROM_SZ;
-		fv_gather_rimgs_for_one_sxn(sxn, sxn_sz, p_guid, instance);
+		fv_gather_rimgs_for_one_sxn(sxn_buf, sxn_sz, p_guid,
+		    instance);
 	} while (++instance != 0);
-	FreePool(sxn);
 }
 
-static void fv_gather_rimgs_for_one_fv(EFI_FIRMWARE_VOLUME2_PROTOCOL *fv)
+/*
+ * Say whether an FV file of the given type & size might hold legacy option
+ * ROM images in raw sections.  Such images are normally found in raw or
+ * free-form files, or in OEM-defined file types.
+ */
+static bool fv_candidate_file_p(EFI_FV_FILETYPE type, UINTN sz)
+{
+	if (sz < MIN_FV_FILE_SZ || sz > MAX_FV_FILE_SZ)
+		return false;
+	switch (type) {
+	    case EFI_FV_FILETYPE_RAW:
+	    case EFI_FV_FILETYPE_FREEFORM:
+		return true;
+	    default:
+		return type >= EFI_FV_FILETYPE_OEM_MIN &&
+		       type <= EFI_FV_FILETYPE_OEM_MAX;
+	}
+}
+
+static void fv_gather_rimgs_for_one_fv(EFI_FIRMWARE_VOLUME2_PROTOCOL *fv,
+    UINTN hidx)
 {
 	EFI_STATUS status;
 	EFI_FV_FILETYPE type;
 	EFI_GUID guid;
 	EFI_FV_FILE_ATTRIBUTES attrs;
 	UINTN sz;
+	fv_stats_t stats = { 0, 0, 0, 0 };
 	void *key = AllocateZeroPool(fv->KeySize);
 	if (!key)
 		error(u"not enough mem. for FV key");
@@ -172,32 +441,249 @@ static void fv_gather_rimgs_for_one_fv(EFI_FIRMWARE_VOLUME2_PROTOCOL *fv)
 		status = fv->GetNextFile(fv, key, &type, &guid, &attrs, &sz);
 		if (EFI_ERROR(status))
 			break;
-		switch (type) {
-		    case EFI_FV_FILETYPE_FFS_PAD:
-		    case EFI_FV_FILETYPE_FIRMWARE_VOLUME_IMAGE:
+		++stats.files;
+		if (!fv_candidate_file_p(type, sz))
 			continue;
-		    default:
-			;
-		}
-		fv_gather_rimgs_for_one_file(fv, &guid);
+		++stats.files_tried;
+		fv_gather_rimgs_for_one_file(fv, &guid, &stats);
 	}
 	FreePool(key);
+	say(V_TABLES, u"  FV %lu: %lu files, %lu tried, %lu sxns. probed, "
+			 "%lu read\r\n", hidx, stats.files, stats.files_tried,
+	    stats.sxns_probed, stats.sxns_read);
+}
+
+/*
+ * Locate the SMBIOS BIOS Information (type 0) structure, including its
+ * strings, & return its address & size.  Return NULL if there is none.
+ */
+static const void *fv_find_smbios_bios_info(UINTN *p_sz)
+{
+	const char *eps;
+	const uint8_t *p, *q, *end;
+	uint64_t tbl_addr = 0;
+	uint32_t tbl_sz = 0, tbl_addr_32;
+	uint16_t tbl_sz_16;
+	if (!EFI_ERROR(LibGetSystemConfigurationTable(&gSmbios3TableGuid,
+	    (void **)&eps)) && memcmp(eps, "_SM3_", 5) == 0) {
+		memcpy(&tbl_sz, eps + 0x0c, sizeof(tbl_sz));
+		memcpy(&tbl_addr, eps + 0x10, sizeof(tbl_addr));
+	} else if (!EFI_ERROR(LibGetSystemConfigurationTable(&gSmbiosTableGuid,
+	    (void **)&eps)) && memcmp(eps, "_SM_", 4) == 0) {
+		memcpy(&tbl_sz_16, eps + 0x16, sizeof(tbl_sz_16));
+		memcpy(&tbl_addr_32, eps + 0x18, sizeof(tbl_addr_32));
+		tbl_sz = tbl_sz_16;
+		tbl_addr = tbl_addr_32;
+	} else
+		return NULL;
+	p = (const uint8_t *)(UINTN)tbl_addr;
+	end = p + tbl_sz;
+	while (end - p >= 4 && p[1] >= 4 && p[1] <= end - p) {
+		/* The string set ends with two zero bytes. */
+		q = p + p[1];
+		while (end - q >= 2 && (q[0] || q[1]))
+			++q;
+		if (end - q < 2)
+			break;
+		q += 2;
+		if (p[0] == 0) {
+			*p_sz = (UINTN)(q - p);
+			return p;
+		}
+		if (p[0] == 127)
+			break;
+		p = q;
+	}
+	return NULL;
+}
+
+/*
+ * Compute a fingerprint for the firmware, from the firmware vendor &
+ * revision, the FVs' device paths --- which give their addresses & sizes
+ * --- & the SMBIOS BIOS version information.  If any of these change, the
+ * option ROM cache is considered stale.
+ */
+static uint64_t fv_fingerprint(EFI_HANDLE *handles, UINTN num_handles)
+{
+	uint64_t fprint = FNV1A_64_INIT;
+	UINTN hidx, sz;
+	const void *smb;
+	fprint = fnv1a_64(fprint, &ST->FirmwareRevision,
+	    sizeof(ST->FirmwareRevision));
+	if (ST->FirmwareVendor)
+		fprint = fnv1a_64(fprint, ST->FirmwareVendor,
+		    StrLen(ST->FirmwareVendor) * sizeof(CHAR16));
+	fprint = fnv1a_64(fprint, &num_handles, sizeof(num_handles));
+	for (hidx = 0; hidx < num_handles; ++hidx) {
+		EFI_DEVICE_PATH *dp = DevicePathFromHandle(handles[hidx]);
+		if (dp)
+			fprint = fnv1a_64(fprint, dp, DevicePathSize(dp));
+		else
+			fprint = fnv1a_64(fprint, &hidx, sizeof(hidx));
+	}
+	smb = fv_find_smbios_bios_info(&sz);
+	if (smb)
+		fprint = fnv1a_64(fprint, smb, sz);
+	return fprint;
+}
+
+/*
+ * Go through the ROM image entries in an option ROM cache file image.  If
+ * `index_p', also add the ROM images to the hash table.  Return true iff
+ * the entries are all well-formed.
+ */
+static bool fv_walk_rom_cache(char *buf, const rc_hdr_t *hdr, bool index_p)
+{
+	char *p = buf + sizeof(rc_hdr_t), *end = buf + hdr->total_sz;
+	uint32_t n, sz;
+	const rimg_pcir_t *pcir;
+	if ((UINTN)(end - p) / sizeof(rimg_key_t) < hdr->num_keys)
+		return false;
+	p += hdr->num_keys * sizeof(rimg_key_t);
+	for (n = 0; n < hdr->num_rimgs; ++n) {
+		if ((UINTN)(end - p) < sizeof(rc_ent_t))
+			return false;
+		sz = ((const rc_ent_t *)p)->rimg_sz;
+		p += sizeof(rc_ent_t);
+		if (RC_ALIGN(sz) > (UINTN)(end - p))
+			return false;
+		pcir = rimg_find_pcir(p, sz);
+		if (!pcir || pcir->type != PCIR_TYP_PCAT)
+			return false;
+		if (index_p && fv_rimg_wanted_p(p, sz, pcir))
+			fv_index_rimg(fv_add_rimg(p, sz,
+			    fnv1a_64(FNV1A_64_INIT, p, sz), false), pcir);
+		p += RC_ALIGN(sz);
+	}
+	return p == end;
+}
+
+/*
+ * Say whether an option ROM cache file image covers all the PCI ids. &
+ * classes we currently want.
+ */
+static bool fv_rom_cache_covers_wants_p(const char *buf,
+    const rc_hdr_t *hdr)
+{
+	const rimg_key_t *keys = (const rimg_key_t *)(buf + sizeof(rc_hdr_t));
+	UINTN i;
+	uint32_t j;
+	for (i = 0; i < num_wants; ++i) {
+		for (j = 0; j < hdr->num_keys; ++j)
+			if (keys[j].pci_id == wants[i].pci_id &&
+			    keys[j].class_if == wants[i].class_if)
+				break;
+		if (j == hdr->num_keys)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Try to fill the hash table from the option ROM cache file.  Return true
+ * if this worked, or false if there is no usable cache for the current
+ * firmware & PCI devices.  The file buffer is kept, as the hash table
+ * points into it.
+ */
+static bool fv_load_rom_cache(uint64_t fprint)
+{
+	EFI_FILE_PROTOCOL *vol = open_boot_vol();
+	UINTN sz = 0;
+	char *buf = read_whole_file(vol, ROM_CACHE, MAX_ROM_CACHE_SZ, &sz);
+	const rc_hdr_t *hdr = (const rc_hdr_t *)buf;
+	vol->Close(vol);
+	if (!buf)
+		return false;
+	if (sz < sizeof(rc_hdr_t) || hdr->magic != ROM_CACHE_MAGIC ||
+	    hdr->ver != ROM_CACHE_VER || hdr->fprint != fprint ||
+	    hdr->total_sz != sz ||
+	    fnv1a_64(FNV1A_64_INIT, buf + sizeof(rc_hdr_t),
+		     sz - sizeof(rc_hdr_t)) != hdr->data_hash ||
+	    !fv_walk_rom_cache(buf, hdr, false) ||
+	    !fv_rom_cache_covers_wants_p(buf, hdr)) {
+		say(V_INFO, u"option ROM cache stale or bad; rescanning\r\n");
+		FreePool(buf);
+		return false;
+	}
+	say(V_INFO, u"using option ROM cache: %u img(s).\r\n",
+	    hdr->num_rimgs);
+	cache_buf = buf;
+	fv_walk_rom_cache(buf, hdr, true);
+	return true;
+}
+
+/* Write out the ROM images found by a firmware volume scan to a cache. */
+static void fv_save_rom_cache(uint64_t fprint)
+{
+	EFI_FILE_PROTOCOL *vol;
+	uint64_t total_sz = sizeof(rc_hdr_t) + num_wants * sizeof(rimg_key_t);
+	UINTN idx;
+	rc_hdr_t *hdr;
+	char *buf, *p;
+	for (idx = 0; idx < num_rimgs; ++idx)
+		total_sz += sizeof(rc_ent_t) + RC_ALIGN(rimgs[idx].rimg_sz);
+	if (total_sz > MAX_ROM_CACHE_SZ) {
+		warn(u"option ROM imgs. too large to cache");
+		return;
+	}
+	buf = AllocateZeroPool(total_sz);
+	if (!buf) {
+		warn(u"no mem. to write option ROM cache");
+		return;
+	}
+	hdr = (rc_hdr_t *)buf;
+	p = buf + sizeof(rc_hdr_t);
+	memcpy(p, wants, num_wants * sizeof(rimg_key_t));
+	p += num_wants * sizeof(rimg_key_t);
+	for (idx = 0; idx < num_rimgs; ++idx) {
+		((rc_ent_t *)p)->rimg_sz = rimgs[idx].rimg_sz;
+		p += sizeof(rc_ent_t);
+		memcpy(p, rimgs[idx].rimg_copy, rimgs[idx].rimg_sz);
+		p += RC_ALIGN(rimgs[idx].rimg_sz);
+	}
+	hdr->magic = ROM_CACHE_MAGIC;
+	hdr->ver = ROM_CACHE_VER;
+	hdr->fprint = fprint;
+	hdr->total_sz = (uint32_t)total_sz;
+	hdr->num_keys = (uint32_t)num_wants;
+	hdr->num_rimgs = (uint32_t)num_rimgs;
+	hdr->data_hash = fnv1a_64(FNV1A_64_INIT, buf + sizeof(rc_hdr_t),
+	    total_sz - sizeof(rc_hdr_t));
+	vol = open_boot_vol();
+	if (write_whole_file(vol, ROM_CACHE, buf, total_sz))
+		say(V_INFO, u"wrote option ROM cache: %u img(s).\r\n",
+		    num_rimgs);
+	else
+		warn(u"cannot write option ROM cache");
+	vol->Close(vol);
+	FreePool(buf);
 }
 
-void fv_init(void)
+/*
+ * Look for option ROM images for the wanted PCI ids. & classes, either in
+ * the option ROM cache or in the firmware volumes.
+ */
+static void fv_scan(void)
 {
 	EFI_HANDLE *handles;
 	UINTN num_handles, hidx;
-	unsigned bucket;
+	uint64_t fprint;
 	EFI_STATUS status = LibLocateHandle(ByProtocol,
 	    &gEfiFirmwareVolume2ProtocolGuid, NULL, &num_handles, &handles);
 	if (EFI_ERROR(status) || !num_handles) {
-		Output(u"no EFI firmware volumes avail.?\r\n");
+		say(V_INFO, u"no EFI firmware volumes avail.?\r\n");
+		return;
+	}
+	say(V_INFO, u"EFI firmware volumes: %lu\r\n", num_handles);
+	fprint = fv_fingerprint(handles, num_handles);
+	say(V_TABLES, u"  firmware fingerprint: %016lx\r\n", fprint);
+	if (conf.rom_cache && fv_load_rom_cache(fprint)) {
+		FreePool(handles);
 		return;
 	}
-	Print(u"EFI firmware volumes: %lu\r\n", num_handles);
-	for (bucket = 0; bucket < HASH_BUCKETS; ++bucket)
-		ht[bucket] = NULL;
+	sxn_buf = AllocatePool(MAX_OROM_SZ);
+	if (!sxn_buf)
+		error(u"no mem. for FV sec. buffer");
 	for (hidx = 0; hidx < num_handles; ++hidx) {
 		EFI_FIRMWARE_VOLUME2_PROTOCOL *fv;
 		EFI_HANDLE handle = handles[hidx];
@@ -205,28 +691,85 @@ void fv_init(void)
 		    &gEfiFirmwareVolume2ProtocolGuid, (void **)&fv);
 		if (EFI_ERROR(status))
 			continue;
-		Print(u"  FV %lu\r\n", hidx);
-		fv_gather_rimgs_for_one_fv(fv);
+		fv_gather_rimgs_for_one_fv(fv, hidx);
 	}
+	FreePool(sxn_buf);
+	sxn_buf = NULL;
 	FreePool(handles);
+	if (conf.rom_cache)
+		fv_save_rom_cache(fprint);
+}
+
+/*
+ * Say that we want an option ROM image from the firmware volumes for a PCI
+ * device.  All such wants should be given before the first call to
+ * fv_find_rimg(, , , ), which then scans the FVs for just these.
+ */
+void fv_want_rimg(uint32_t pci_id, uint32_t class_if)
+{
+	if (fv_wanted_p(pci_id, class_if))
+		return;
+	if (num_wants == max_wants)
+		wants = fv_grow(wants, &max_wants, sizeof(rimg_key_t));
+	wants[num_wants].pci_id = pci_id;
+	wants[num_wants].class_if = class_if;
+	++num_wants;
 }
 
 bool fv_find_rimg(uint32_t pci_id, uint32_t class_if,
     void **p_rimg_copy, uint32_t *p_sz)
 {
-	unsigned bucket = fv_hash_bucket(pci_id, class_if);
-	ht_node_t *node = ht[bucket];
-	while (node) {
-		if (node->pci_id == pci_id && node->class_if == class_if) {
-			*p_rimg_copy = node->rimg_copy;
-			*p_sz = node->rimg_sz;
-			return true;
-		}
-		node = node->next;
+	unsigned tl;
+	key_ent_t *key;
+	rimg_ent_t *ent;
+	if (!scanned_p) {
+		fv_want_rimg(pci_id, class_if);
+		tl = tl_begin(TL_FV, (uint32_t)num_wants);
+		fv_scan();
+		fv_build_tbl();
+		tl_end(tl);
+		scanned_p = true;
 	}
-	return false;
+	if (!tbl)
+		return false;
+	key = &tbl[fv_key_slot(pci_id, class_if)];
+	if (!key->rimg_no)
+		return false;
+	ent = &rimgs[key->rimg_no - 1];
+	ent->used_p = true;
+	*p_rimg_copy = ent->rimg_copy;
+	*p_sz = ent->rimg_sz;
+	return true;
 }
 
+/*
+ * Free all the option ROM images we cached, except those handed out by
+ * fv_find_rimg(, , , ), & free the index.
+ */
 void fv_fini(void)
 {
+	UINTN idx;
+	bool cache_buf_used_p = false;
+	for (idx = 0; idx < num_rimgs; ++idx) {
+		rimg_ent_t *ent = &rimgs[idx];
+		if (ent->used_p) {
+			if (!ent->own_p)
+				cache_buf_used_p = true;
+		} else if (ent->own_p)
+			FreePool(ent->rimg_copy);
+	}
+	if (cache_buf && !cache_buf_used_p)
+		FreePool(cache_buf);
+	cache_buf = NULL;
+	if (rimgs)
+		FreePool(rimgs);
+	rimgs = NULL;
+	num_rimgs = max_rimgs = 0;
+	if (tbl)
+		FreePool(tbl);
+	tbl = NULL;
+	if (wants)
+		FreePool(wants);
+	wants = NULL;
+	num_wants = max_wants = 0;
 }
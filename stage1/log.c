@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2021 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Routines for keeping a boot log.
+ *
+ * Log messages go into an in-memory ring buffer, in UTF-8.  Messages at or
+ * below the configured verbosity level are also queued up for the UEFI
+ * console, & written out in batches, rather than one Print(...) call per
+ * table row --- console output can be very slow on some machines.
+ *
+ * log_fini() finally writes the log to a file on the boot volume (if so
+ * configured), & hands it to stage 2 as a boot parameter.
+ */
+
+#include <stdarg.h>
+#include <string.h>
+#include "stage1/stage1.h"
+
+#define LOG_SZ		0x4000U	/* size of log ring buffer */
+#define CON_BUF_LEN	0x400U	/* size of console output queue, in
+				   CHAR16s; must be > MAX_MSG_LEN */
+#define MAX_MSG_LEN	0x100U	/* max. length of one log message */
+
+static char log_ring[LOG_SZ];
+static uint32_t log_total = 0;	/* total no. of bytes ever logged */
+static CHAR16 con_buf[CON_BUF_LEN];
+static UINTN con_len = 0;
+
+/* Add a byte to the log ring buffer. */
+static void log_put_byte(uint8_t b)
+{
+	log_ring[log_total % LOG_SZ] = (char)b;
+	++log_total;
+}
+
+/* Add a string to the log ring buffer, converting it to UTF-8. */
+static void log_put_str(const CHAR16 *str)
+{
+	CHAR16 c;
+	while ((c = *str++) != 0) {
+		if (c < 0x80U)
+			log_put_byte(c);
+		else if (c < 0x800U) {
+			log_put_byte(0xc0U | c >> 6);
+			log_put_byte(0x80U | (c & 0x3fU));
+		} else {
+			log_put_byte(0xe0U | c >> 12);
+			log_put_byte(0x80U | (c >> 6 & 0x3fU));
+			log_put_byte(0x80U | (c & 0x3fU));
+		}
+	}
+}
+
+/* Write out any console output that is queued up. */
+void log_flush(void)
+{
+	if (!con_len)
+		return;
+	con_buf[con_len] = 0;
+	Output(con_buf);
+	con_len = 0;
+}
+
+/* Queue up a string for output to the console. */
+static void log_con_str(const CHAR16 *str, UINTN len)
+{
+	if (con_len + len >= CON_BUF_LEN)
+		log_flush();
+	memcpy(con_buf + con_len, str, len * sizeof(CHAR16));
+	con_len += len;
+}
+
+/*
+ * Log a message.  Also output it to the console, if the configured
+ * verbosity level is at least `level'.
+ */
+void say(unsigned level, IN CONST CHAR16 *fmt, ...)
+{
+	CHAR16 msg[MAX_MSG_LEN];
+	UINTN len;
+	va_list ap;
+	va_start(ap, fmt);
+	len = VSPrint(msg, sizeof msg, fmt, ap);
+	va_end(ap);
+	log_put_str(msg);
+	if (conf_verbose(level))
+		log_con_str(msg, len);
+}
+
+/*
+ * Log a message, without outputting it to the console.  The caller is
+ * responsible for telling the user about it some other way.
+ */
+void log_only(IN CONST CHAR16 *fmt, ...)
+{
+	CHAR16 msg[MAX_MSG_LEN];
+	va_list ap;
+	va_start(ap, fmt);
+	VSPrint(msg, sizeof msg, fmt, ap);
+	va_end(ap);
+	log_put_str(msg);
+}
+
+/*
+ * Copy the text in the log ring buffer to `buf', which should have space
+ * for at least LOG_SZ bytes.  Return the no. of bytes copied.
+ */
+static uint32_t log_copy_out(char *buf)
+{
+	uint32_t start, len;
+	if (log_total <= LOG_SZ) {
+		memcpy(buf, log_ring, log_total);
+		return log_total;
+	}
+	start = log_total % LOG_SZ;
+	len = LOG_SZ - start;
+	memcpy(buf, log_ring + start, len);
+	memcpy(buf + len, log_ring, start);
+	return LOG_SZ;
+}
+
+/* Write the log text to the configured log file. */
+static void log_write_file(const char *text, uint32_t text_sz)
+{
+	EFI_FILE_PROTOCOL *vol = open_boot_vol();
+	if (!write_whole_file(vol, conf.log_path, text, text_sz))
+		warn(u"cannot write log file");
+	vol->Close(vol);
+}
+
+/*
+ * Write out any remaining console output, write the log to a file if so
+ * configured, & add a boot parameter for the log.  This must be called
+ * before bmem_fini(...).
+ */
+void log_fini(void)
+{
+	uint32_t text_sz = log_total < LOG_SZ ? log_total : LOG_SZ;
+	bdat_log_t *bd;
+	log_flush();
+	bd = bparm_add(BP_LOGB, sizeof(bdat_log_t) + text_sz);
+	bd->lost_sz = log_total - text_sz;
+	bd->text_sz = log_copy_out(bd->text);
+	if (conf.log_path)
+		log_write_file(bd->text, bd->text_sz);
+}
@@ -34,56 +34,59 @@
 #   include "mp.h"
 #endif
 
-extern EFI_HANDLE LibImageHandle;
-extern EFI_GUID gEfiLoadedImageProtocolGuid, gEfiGlobalVariableGuid;
+extern EFI_GUID gEfiGlobalVariableGuid;
 
 static EFI_GUID Acpi20TableGuid =
 		    { 0x8868e871, 0xe4f1, 0x11d3,
 		      { 0xbc, 0x22, 0x00, 0x80, 0xc7, 0x3c, 0x88, 0x81 } };
 static BOOLEAN secure_boot_p = FALSE;
-static EFI_HANDLE boot_media_handle;
 static uint16_t temp_ebda_seg = 0;
+static BOOLEAN stage2_64_p = FALSE;
 
 static void init(void)
 {
+	unsigned tl;
+	/*
+	 * Read the configuration file first, so that it can say how verbose
+	 * we should be.  Any pool memory used for this is freed again before
+	 * bmem_init() goes grabbing base memory.
+	 */
+	tl = tl_begin(TL_CONF, 0);
+	conf_init();
+	tl_end(tl);
+	tl = tl_begin(TL_BMEM, 0);
 	bmem_init();
-	fv_init();
+	tl_end(tl);
+	/*
+	 * Open the stage 2 file now, so that (if possible) it can be read
+	 * in the background while we scan PCI devices (& perhaps firmware
+	 * volumes).
+	 */
+	tl = tl_begin(TL_OPEN, 0);
+	s2file_open();
+	tl_end(tl);
 }
 
 static void process_efi_conf_tables(void)
 {
 	UINTN i, sct_cnt = ST->NumberOfTableEntries;
 	acpi_xsdp_t *rsdp = NULL;
-	Output(u"EFI sys. conf. tables:");
+	say(V_TABLES, u"EFI sys. conf. tables:");
 	for (i = 0; i < sct_cnt; ++i) {
 		const EFI_CONFIGURATION_TABLE *cft =
 		    &ST->ConfigurationTable[i];
 		const EFI_GUID *vguid = &cft->VendorGuid;
-		if (i % 2 == 0)
-			Output(u"\r\n");
-		Output(u"  ");
-		print_guid(vguid);
+		say(V_TABLES, i % 2 == 0 ? u"\r\n  " : u"  ");
+		say_guid(V_TABLES, vguid);
 		if (memcmp(vguid, &Acpi20TableGuid, sizeof(EFI_GUID)) == 0)
 			rsdp = cft->VendorTable;
 	}
-	Output(u"\r\n");
+	say(V_TABLES, u"\r\n");
 	if (!rsdp)
 		error(u"no ACPI 2+ RSDP");
 	acpi_init(rsdp);
 }
 
-static void find_boot_media(void)
-{
-	EFI_STATUS status;
-	EFI_LOADED_IMAGE_PROTOCOL *li;
-	status = BS->HandleProtocol(LibImageHandle,
-	    &gEfiLoadedImageProtocolGuid, (void **)&li);
-	if (EFI_ERROR(status))
-		error_with_status(u"cannot get EFI_LOADED_IMAGE_PROTOCOL",
-		    status);
-	boot_media_handle = li->DeviceHandle;
-}
-
 static void test_if_secure_boot(void)
 {
 	UINT8 data = 0;
@@ -92,7 +95,7 @@ static void test_if_secure_boot(void)
 	    &gEfiGlobalVariableGuid, NULL, &data_sz, &data);
 	if (!EFI_ERROR(status) && data)
 		secure_boot_p = TRUE;
-	Print(u"secure boot: %s\r\n", secure_boot_p ? u"yes" : u"no");
+	say(V_INFO, u"secure boot: %s\r\n", secure_boot_p ? u"yes" : u"no");
 }
 
 static Elf32_Addr alloc_trampoline(void)
@@ -103,134 +106,148 @@ static Elf32_Addr alloc_trampoline(void)
 	if (EFI_ERROR(status))
 		error_with_status(u"cannot get mem. for trampoline & stk.",
 		    status);
-	Print(u"made space for trampoline & stk. @0x%lx\r\n", addr);
+	say(V_INFO, u"made space for trampoline & stk. @0x%lx\r\n", addr);
 	return (Elf32_Addr)addr;
 }
 
-#define STAGE2		u"EFI\\biefirc\\stage2.sys"
-#define STAGE2_ALT	u"biefist2.sys"
-#define STAGE2_ALT_ALT	u"kernel.sys"
-
-static void dump_stage2_info(EFI_FILE_PROTOCOL *prog, CONST CHAR16 *name)
+/*
+ * Work out the page aligned start address, & the no. of pages, of the
+ * memory for a loadable segment.
+ */
+static UINTN stage2_seg_pages(const Elf32_Phdr *phdr,
+    EFI_PHYSICAL_ADDRESS *p_paddr)
 {
-	EFI_FILE_INFO *info = LibFileInfo(prog);
-	if (!info)
-		error(u"cannot get info on stage 2");
-	Print(u"stage2: %s  size: 0x%lx  attrs.: 0x%lx\r\n",
-	    name, info->FileSize, info->Attribute);
-	FreePool(info);
+	EFI_PHYSICAL_ADDRESS paddr = phdr->p_paddr,
+			     slack = paddr % EFI_PAGE_SIZE;
+	*p_paddr = paddr - slack;
+	return ((UINT64)phdr->p_memsz + slack + EFI_PAGE_SIZE - 1)
+	       / EFI_PAGE_SIZE;
 }
 
-static void read_stage2(EFI_FILE_PROTOCOL *prog, EFI_FILE_PROTOCOL *vol,
-			UINTN size, void *buf)
-{
-	UINTN read_size = size;
-	EFI_STATUS status;
-	if (!size)
-		return;
-	status = prog->Read(prog, &read_size, buf);
-	if (EFI_ERROR(status)) {
-		prog->Close(prog);
-		vol->Close(vol);
-		error_with_status(u"cannot read stage 2", status);
-	}
-	if (read_size != size) {
-		prog->Close(prog);
-		vol->Close(vol);
-		error_with_status(u"short read from stage 2", status);
-	}
-}
-
-static void seek_stage2(EFI_FILE_PROTOCOL *prog, EFI_FILE_PROTOCOL *vol,
-			UINT64 pos)
+/*
+ * Free the memory which load_stage2() allocated for the loadable segments
+ * among the first `ph_cnt' program headers.
+ */
+static void free_stage2_mem(const Elf32_Phdr *phdrs, UINT32 ph_cnt)
 {
-	EFI_STATUS status = prog->SetPosition(prog, pos);
-	if (EFI_ERROR(status)) {
-		prog->Close(prog);
-		vol->Close(vol);
-		error_with_status(u"cannot seek into stage 2", status);
+	const Elf32_Phdr *phdr = phdrs;
+	EFI_PHYSICAL_ADDRESS paddr;
+	UINTN pages;
+	while (ph_cnt-- != 0) {
+		if (phdr->p_type == PT_LOAD) {
+			pages = stage2_seg_pages(phdr, &paddr);
+			BS->FreePages(paddr, pages);
+		}
+		++phdr;
 	}
 }
 
-static void free_stage2_mem(const Elf32_Phdr *phdrs, UINT32 ph_cnt)
+/*
+ * Read an x86-64 ELF file's program headers, & convert them to 32-bit
+ * ones.  The x86-64 stage 2 must still lie wholly below the 4 GiB mark.
+ */
+static bool load_phdrs_64(UINT64 ph_off, UINT32 ph_cnt, Elf32_Phdr *phdrs)
 {
-	const Elf32_Phdr *phdr = phdrs;
 	while (ph_cnt-- != 0) {
-		EFI_PHYSICAL_ADDRESS paddr = phdr->p_paddr;
-		UINTN pages =
-		  ((UINT64)phdrs->p_memsz + EFI_PAGE_SIZE - 1) / EFI_PAGE_SIZE;
-		BS->FreePages(paddr, pages);
-		++phdr;
+		Elf64_Phdr phdr64;
+		s2file_read(ph_off, sizeof phdr64, &phdr64);
+		if (phdr64.p_offset >= 0x100000000ULL ||
+		    phdr64.p_paddr + phdr64.p_memsz > 0x100000000ULL ||
+		    phdr64.p_vaddr + phdr64.p_memsz > 0x100000000ULL ||
+		    phdr64.p_filesz > phdr64.p_memsz)
+			return false;
+		phdrs->p_type = phdr64.p_type;
+		phdrs->p_offset = (Elf32_Off)phdr64.p_offset;
+		phdrs->p_vaddr = (Elf32_Addr)phdr64.p_vaddr;
+		phdrs->p_paddr = (Elf32_Addr)phdr64.p_paddr;
+		phdrs->p_filesz = (Elf32_Word)phdr64.p_filesz;
+		phdrs->p_memsz = (Elf32_Word)phdr64.p_memsz;
+		phdrs->p_flags = phdr64.p_flags;
+		phdrs->p_align = (Elf32_Word)phdr64.p_align;
+		ph_off += sizeof phdr64;
+		++phdrs;
 	}
+	return true;
 }
 
+/*
+ * Load the stage 2 ELF file.  This may be either an x86-32 file, or (see
+ * NOTES.asciidoc) an x86-64 one; stage2_64_p says which.
+ */
 static Elf32_Addr load_stage2(void)
 {
 	enum { MAX_PHDRS = 16 };
-	EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *fs;
-	CHAR16 *name = STAGE2;
-	EFI_FILE_PROTOCOL *vol, *prog;
 	EFI_STATUS status;
-	Elf32_Ehdr ehdr;
+	union {
+		Elf32_Ehdr e32;
+		Elf64_Ehdr e64;
+	} ehdr;
 	Elf32_Phdr phdrs[MAX_PHDRS], *phdr;
 	UINT32 x1, x2, ph_cnt, ph_idx, entry;
-	status = BS->HandleProtocol(boot_media_handle,
-	    &gEfiSimpleFileSystemProtocolGuid, (void **)&fs);
-	if (EFI_ERROR(status))
-		error_with_status(u"cannot get "
-		    "EFI_SIMPLE_FILE_SYSTEM_PROTOCOL", status);
-	status = fs->OpenVolume(fs, &vol);
-	if (EFI_ERROR(status))
-		error_with_status(u"cannot get EFI_FILE_PROTOCOL", status);
-	status = vol->Open(vol, &prog, name, EFI_FILE_MODE_READ, 0);
-	if (EFI_ERROR(status)) {
-		name = STAGE2_ALT;
-		status = vol->Open(vol, &prog, name, EFI_FILE_MODE_READ, 0);
-	}
-	if (EFI_ERROR(status)) {
-		name = STAGE2_ALT_ALT;
-		status = vol->Open(vol, &prog, name, EFI_FILE_MODE_READ, 0);
-	}
-	if (EFI_ERROR(status)) {
-		vol->Close(vol);
-		error_with_status(u"cannot open stage 2", status);
-	}
-	dump_stage2_info(prog, name);
-	read_stage2(prog, vol, sizeof ehdr, &ehdr);
-	if (ehdr.e_ident[EI_MAG0] != ELFMAG0 ||
-	    ehdr.e_ident[EI_MAG1] != ELFMAG1 ||
-	    ehdr.e_ident[EI_MAG2] != ELFMAG2 ||
-	    ehdr.e_ident[EI_MAG3] != ELFMAG3) {
-		Output(u"  not ELF file\r\n");
+	UINT64 ph_off, entry64;
+	/* The stage 2 file should already be open (see init()). */
+	s2file_read(0, sizeof ehdr, &ehdr);
+	if (ehdr.e32.e_ident[EI_MAG0] != ELFMAG0 ||
+	    ehdr.e32.e_ident[EI_MAG1] != ELFMAG1 ||
+	    ehdr.e32.e_ident[EI_MAG2] != ELFMAG2 ||
+	    ehdr.e32.e_ident[EI_MAG3] != ELFMAG3) {
+		say(V_QUIET, u"  not ELF file\r\n");
 		goto bad_elf;
 	}
-	x1 = ehdr.e_ident[EI_VERSION];
-	x2 = ehdr.e_version;
-	Print(u"  ELF ver.: %u / %u\r\n", x1, x2);
+	stage2_64_p = ehdr.e32.e_ident[EI_CLASS] == ELFCLASS64;
+	x1 = ehdr.e32.e_ident[EI_VERSION];
+	x2 = stage2_64_p ? ehdr.e64.e_version : ehdr.e32.e_version;
+	say(V_TABLES, u"  ELF ver.: %u / %u\r\n", x1, x2);
 	if (x1 != EV_CURRENT || x2 != EV_CURRENT)
 		goto bad_elf;
-	x1 = ehdr.e_ehsize;
-	x2 = ehdr.e_phentsize;
-	ph_cnt = ehdr.e_phnum;
-	Print(u"  ehdr sz.: 0x%x  phdr sz.: 0x%x  phdr cnt.: %u\r\n",
+	if (stage2_64_p) {
+		x1 = ehdr.e64.e_ehsize;
+		x2 = ehdr.e64.e_phentsize;
+		ph_cnt = ehdr.e64.e_phnum;
+	} else {
+		x1 = ehdr.e32.e_ehsize;
+		x2 = ehdr.e32.e_phentsize;
+		ph_cnt = ehdr.e32.e_phnum;
+	}
+	say(V_TABLES, u"  ehdr sz.: 0x%x  phdr sz.: 0x%x  phdr cnt.: %u\r\n",
 	    x1, x2, ph_cnt);
-	if (x1 < sizeof(ehdr) || x2 != sizeof(*phdr))
+	if (stage2_64_p ? x1 < sizeof(ehdr.e64) || x2 != sizeof(Elf64_Phdr)
+			: x1 < sizeof(ehdr.e32) || x2 != sizeof(*phdr))
 		goto bad_elf;
 	if (ph_cnt > MAX_PHDRS) {
-		Output(u"  too many phdrs.\r\n");
+		say(V_QUIET, u"  too many phdrs.\r\n");
 		goto bad_elf;
 	}
-	x1 = ehdr.e_machine;
-	entry = ehdr.e_entry;
-	Print(u"  machine: 0x%x  entry: @0x%x\r\n", x1, entry);
-	if (x1 != EM_386) {
-		Output(u"  not x86-32 ELF\r\n");
-		goto bad_elf;
+	if (stage2_64_p) {
+		x1 = ehdr.e64.e_machine;
+		entry64 = ehdr.e64.e_entry;
+		ph_off = ehdr.e64.e_phoff;
+	} else {
+		x1 = ehdr.e32.e_machine;
+		entry64 = ehdr.e32.e_entry;
+		ph_off = ehdr.e32.e_phoff;
+	}
+	say(V_TABLES, u"  machine: 0x%x  entry: @0x%lx\r\n", x1, entry64);
+	if (stage2_64_p) {
+		if (x1 != EM_X86_64) {
+			say(V_QUIET, u"  not x86-64 ELF\r\n");
+			goto bad_elf;
+		}
+		if (entry64 >= 0x100000000ULL ||
+		    !load_phdrs_64(ph_off, ph_cnt, phdrs)) {
+			say(V_QUIET, u"  x86-64 ELF not below 4 GiB\r\n");
+			goto bad_elf;
+		}
+	} else {
+		if (x1 != EM_386) {
+			say(V_QUIET, u"  not x86-32 ELF\r\n");
+			goto bad_elf;
+		}
+		s2file_read(ph_off, ph_cnt * sizeof(*phdr), phdrs);
 	}
-	seek_stage2(prog, vol, ehdr.e_phoff);
-	read_stage2(prog, vol, ph_cnt * sizeof(*phdr), phdrs);
-	Output(u"  phdr# file off.  phy.addr.  virt.addr. type       "
-		  "file sz.   mem. sz.\r\n");
+	entry = (UINT32)entry64;
+	say(V_TABLES, u"  phdr# file off.  phy.addr.  virt.addr. type       "
+			 "file sz.   mem. sz.\r\n");
 	for (ph_idx = 0; ph_idx < ph_cnt; ++ph_idx) {
 		phdr = &phdrs[ph_idx];
 		Elf32_Word type = phdr->p_type;
@@ -240,42 +257,38 @@ static Elf32_Addr load_stage2(void)
 		Elf32_Word filesz = phdr->p_filesz, memsz = phdr->p_memsz;
 		UINTN pages;
 		phdr = &phdrs[ph_idx];
-		Print(u"  %5u 0x%08x 0x%08lx 0x%08x 0x%08x 0x%08x 0x%08x\r\n",
+		say(V_TABLES, u"  %5u 0x%08x 0x%08lx 0x%08x 0x%08x 0x%08x "
+				 "0x%08x\r\n",
 		    ph_idx, off, paddr, phdr->p_vaddr, type, filesz, memsz);
 		if (type != PT_LOAD)
 			continue;
 		if (filesz > memsz) {
 			free_stage2_mem(phdrs, ph_idx);
-			Output(u"  seg. file sz. > seg. mem. sz.!\r\n");
+			say(V_QUIET, u"  seg. file sz. > seg. mem. sz.!\r\n");
 			goto bad_elf;
 		}
 		if (slack) {
 			off -= slack;
-			paddr -= slack;
 			if (filesz)
 				filesz += slack;
 			memsz += slack;
 		}
-		pages = ((UINT64)memsz + EFI_PAGE_SIZE - 1) / EFI_PAGE_SIZE;
+		pages = stage2_seg_pages(phdr, &paddr);
 		status = BS->AllocatePages(AllocateAddress,
 		    EfiRuntimeServicesData, pages, &paddr);
 		if (EFI_ERROR(status)) {
 			free_stage2_mem(phdrs, ph_idx);
+			s2file_close();
 			error_with_status(u"cannot get mem. for ELF seg.",
 			    status);
 		}
-		if (filesz) {
-			seek_stage2(prog, vol, off);
-			read_stage2(prog, vol, filesz, (void *)paddr);
-		}
+		s2file_read(off, filesz, (void *)paddr);
 		memset((char *)paddr + filesz, 0, memsz - filesz);
 	}
-	prog->Close(prog);
-	vol->Close(vol);
+	s2file_close();
 	return entry;
 bad_elf:
-	prog->Close(prog);
-	vol->Close(vol);
+	s2file_close();
 	error(u"bad stage2");
 	return 0;
 }
@@ -349,7 +362,7 @@ static void fake_mp_table(void)
 	u->s.ebda_kib = 1;
 	memset(u->s.ebda_reserved, 0, 15);
 	/* Fill up the MP floating pointer structure. */
-	Print(u"placing MP tables @0x%x\r\n", (uintptr_t)u);
+	say(V_INFO, u"placing MP tables @0x%x\r\n", (uintptr_t)u);
 	u->s.flt.sig = MAGIC32('_', 'M', 'P', '_');
 	u->s.flt.mp_conf_addr = (uint32_t)(uintptr_t)&u->s.conf;
 	u->s.flt.len = sizeof(u->s.flt);
@@ -376,7 +389,7 @@ static void fake_mp_table(void)
 	u->s.conf.ext_tbl_len = 0;
 	u->s.conf.ext_tbl_cksum = u->s.conf.reserved = 0;
 	/* While at it... */
-	Print(u"LAPIC: @0x%lx\r\n", lapic_addr);
+	say(V_INFO, u"LAPIC: @0x%lx\r\n", lapic_addr);
 	/* Fill up the entry for this processor. */
 	u->s.cpu.type = MP_CPU;
 	u->s.cpu.lapic_id = (uint8_t)lapic[0x20 / 4];
@@ -435,6 +448,63 @@ static void wait_for_one_second(void)
 	} while (now_ns < then_ns + 1000000000ULL);
 }
 
+/* See if a key was pressed, & if so, swallow the keystroke. */
+static bool key_pressed(void)
+{
+	EFI_INPUT_KEY key;
+	if (BS->CheckEvent(ST->ConIn->WaitForKey) != EFI_SUCCESS)
+		return false;
+	ST->ConIn->ReadKeyStroke(ST->ConIn, &key);
+	return true;
+}
+
+/*
+ * Wait for the configured number of seconds before exiting UEFI, to give
+ * the user a chance to read the output.  If so configured, a keypress will
+ * end the wait early.
+ *
+ * This creates & destroys a UEFI event, so it must happen before we take
+ * the final memory map.
+ */
+static void handover_delay(void)
+{
+	EFI_EVENT evs[2];
+	UINTN num_evs = 1, which;
+	EFI_STATUS status;
+	unsigned secs = conf.delay_secs, tl;
+	if (!secs)
+		return;
+	tl = tl_begin(TL_WAIT, secs);
+	say(V_INFO, u"waiting %u s.%s\r\n", secs, conf.skip_delay_on_key ?
+	    u" (press a key to skip)" : u"");
+	log_flush();
+	status = BS->CreateEvent(EVT_TIMER, 0, NULL, NULL, &evs[0]);
+	if (!EFI_ERROR(status)) {
+		status = BS->SetTimer(evs[0], TimerRelative,
+		    10000000ULL * secs);
+		if (!EFI_ERROR(status)) {
+			if (conf.skip_delay_on_key)
+				evs[num_evs++] = ST->ConIn->WaitForKey;
+			status = BS->WaitForEvent(num_evs, evs, &which);
+			if (!EFI_ERROR(status) && which == 1)
+				key_pressed();
+		}
+		BS->CloseEvent(evs[0]);
+		if (!EFI_ERROR(status)) {
+			tl_end(tl);
+			return;
+		}
+	}
+	/* If timer events do not work, fall back on polling the RTC. */
+	wait_for_time_change();
+	while (secs-- != 0) {
+		if (conf.skip_delay_on_key && key_pressed())
+			break;
+		wait_for_one_second();
+	}
+	tl_end(tl);
+}
+
 static unsigned prepare_to_hand_over(EFI_HANDLE image_handle)
 {
 	enum { EfiPersistentMemory = EfiPalCode + 1 };
@@ -445,8 +515,19 @@ static unsigned prepare_to_hand_over(EFI_HANDLE image_handle)
 	EFI_STATUS status;
 	/* Wrap up firmware volume handling. */
 	fv_fini();
-	/* Say we are about to exit UEFI. */
-	Output(u"exit UEFI\r\n");
+	/* Wait a bit if so configured. */
+	handover_delay();
+	/*
+	 * Move the boot timeline into the boot parameters.  Do this before
+	 * getting the final memory map, as it calls BS->Stall(...).
+	 */
+	tl_fini();
+	/*
+	 * Say we are about to exit UEFI.  Then wrap up the boot log, & add
+	 * it to the boot parameters.
+	 */
+	say(V_INFO, u"exit UEFI\r\n");
+	log_fini();
 	/*
 	 * Add information about blocks of extended memory (above the 1 MiB
 	 * mark) to the boot parameters.
@@ -484,20 +565,17 @@ static unsigned prepare_to_hand_over(EFI_HANDLE image_handle)
 	 * bootloader about base memory availability at boot time & run
 	 * time.
 	 *
-	 * We can only do this after adding the boot parameters for the map
-	 * of extended memory, because these latter parameters will
-	 * themselves be allocated in base memory (via bmem.c).
+	 * We can only do this after adding all the other boot parameters,
+	 * because bmem_fini(...) packs them into base memory (via bmem.c).
 	 */
-	bd = bparm_add(BP_BMEM, sizeof(bdat_bmem_t));
+	bparm_add(BP_BMEM, sizeof(bdat_bmem_t));
 	bmem_fini(descs, num_ents, desc_sz,
 	    &boottime_bmem_bot, &runtime_bmem_top);
+	/* The boot parameters are now sealed, & may have moved. */
+	tl_resync();
+	bd = bparm_find(BP_BMEM, NULL);
 	bd->boottime_bmem_bot_seg = addr_to_rm_seg(boottime_bmem_bot);
 	bd->runtime_bmem_top_seg = addr_to_rm_seg(runtime_bmem_top);
-	/* Wait for about 3 seconds. */
-	wait_for_time_change();
-	wait_for_one_second();
-	wait_for_one_second();
-	wait_for_one_second();
 	/* Really exit boot services... */
 	status = BS->ExitBootServices(image_handle, map_key);
 	if (EFI_ERROR(status))
@@ -508,20 +586,32 @@ static unsigned prepare_to_hand_over(EFI_HANDLE image_handle)
 EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 {
 	Elf32_Addr trampoline, entry;
-	unsigned base_kib;
+	unsigned base_kib, tl;
 	InitializeLib(image_handle, system_table);
-	Output(u".:. biefircate " VERSION " .:.\r\n");
+	say(V_QUIET, u".:. biefircate " VERSION " .:.\r\n");
 	init();
+	tl = tl_begin(TL_ACPI, 0);
 	process_efi_conf_tables();
-	find_boot_media();
 	test_if_secure_boot();
+	tl_end(tl);
+	tl = tl_begin(TL_PCI, 0);
 	process_pci();
+	tl_end(tl);
 	trampoline = alloc_trampoline();
+	tl = tl_begin(TL_LOAD, 0);
 	entry = load_stage2();
+	tl_end(tl);
 #ifdef XV6_COMPAT
 	fake_mp_table();
 #endif
+	tl = tl_begin(TL_EXIT, 0);
 	base_kib = prepare_to_hand_over(image_handle);
-	run_stage2(entry, trampoline, base_kib, temp_ebda_seg, bparm_get());
+	tl_end(tl);
+	if (stage2_64_p)
+		run_stage2_64(entry, trampoline, base_kib, temp_ebda_seg,
+		    bparm_get());
+	else
+		run_stage2(entry, trampoline, base_kib, temp_ebda_seg,
+		    bparm_get());
 	return 0;
 }
@@ -40,10 +40,10 @@ static bool enable_legacy_vga(EFI_PCI_IO_PROTOCOL *io, UINT32 class_if,
 	*p_enables = 0;
 	switch (class_if & 0xffff0000UL) {
 	    case 0x03000000:  /* VGA */
-		Output(u" VGA");
+		say(V_TABLES, u" VGA");
 		break;
 	    case 0x03010000:  /* XGA */
-		Output(u" XGA");
+		say(V_TABLES, u" XGA");
 		break;
 	    default:
 		return false;
@@ -133,7 +133,11 @@ const uint16_t *rimg_pcir_find_dev_id_list(const rimg_pcir_t *pcir,
 	return (const uint16_t *)dev_ids;
 }
 
-static uint64_t rimg_find(const void *rimg)
+/*
+ * See if there is a valid legacy option ROM image at `rimg'.  If so, return
+ * its size; otherwise return 0.
+ */
+uint64_t rimg_find(const void *rimg)
 {
 	const rimg_hdr_t *hdr = rimg;
 	uint8_t rimg_sz_hkib;
@@ -149,13 +153,29 @@ static uint64_t rimg_find(const void *rimg)
 	return rimg_sz;
 }
 
+static bool vga_class_p(uint32_t class_if)
+{
+	switch (class_if & 0xffff0000UL) {
+	    case 0x03000000:  /* VGA */
+	    case 0x03010000:  /* XGA */
+		return true;
+	    default:
+		return false;
+	}
+}
+
+/*
+ * Place the option ROM image `rimg' where it will run, preferably in shadow
+ * RAM in the upper memory area, or otherwise in base memory.
+ */
 static void get_rimg(bdat_pci_dev_t *bd, const void *rimg, uint32_t sz,
     const rimg_pcir_t *pcir)
 {
 	void *rimg_copy, *rimg_rt;
-	bd->rimg_sz = sz;
+	bool vga = vga_class_p(bd->class_if);
+	bd->rimg_sz = bd->rimg_rt_sz = sz;
 	if (!pcir) {
-		Print(u"    ROM img.: @0x%lx~@0x%lx (no PCIR!)\r\n",
+		say(V_TABLES, u"    ROM img.: @0x%lx~@0x%lx (no PCIR!)\r\n",
 		    rimg, (char *)rimg + sz - 1);
 		bd->rimg_seg = bd->rimg_rt_seg = ptr_to_rm_seg(rimg);
 	} else if (pcir->pcir_rev >= 3) {
@@ -164,49 +184,82 @@ static void get_rimg(bdat_pci_dev_t *bd, const void *rimg, uint32_t sz,
 			if ((uintptr_t)rimg <= BMEM_MAX_ADDR - sz &&
 			    (uintptr_t)rimg % HKIBYTE == 0)
 			{
-				Print(u"    ROM img.: @0x%lx~@0x%lx\r\n",
+				say(V_TABLES,
+				    u"    ROM img.: @0x%lx~@0x%lx\r\n",
 				    rimg, (char *)rimg + sz - 1);
 				bd->rimg_seg = ptr_to_rm_seg(rimg);
 				bd->rimg_sz = sz;
 			} else {
 				rimg_copy = bmem_alloc_boottime(sz, HKIBYTE);
 				memcpy(rimg_copy, rimg, sz);
-				Print(u"    ROM img.: @0x%lx~@0x%lx "
+				say(V_TABLES, u"    ROM img.: @0x%lx~@0x%lx "
 					   "(copied from @0x%lx)",
 				    rimg_copy, (char *)rimg_copy + sz - 1,
 				    rimg);
 				bd->rimg_seg = ptr_to_rm_seg(rimg_copy);
 			}
-			/* FIXME: should run time addr. be 2 KiB aligned? */
-			rimg_rt = bmem_alloc(rt_sz, HKIBYTE);
-			Print(u"  run time: @0x%lx\r\n", rimg_rt);
-			bd->rimg_rt_seg = ptr_to_rm_seg(rimg_rt);
+			/*
+			 * FIXME: should run time addr. be 2 KiB aligned?
+			 *
+			 * If there is no room in shadow RAM, let stage 2 find
+			 * room in base memory when it runs the ROM, so that it
+			 * can reuse what earlier ROMs gave back.
+			 */
+			rimg_rt = shdw_alloc(rt_sz, vga);
+			if (rimg_rt) {
+				say(V_TABLES, u"  run time: @0x%lx\r\n",
+				    rimg_rt);
+				bd->rimg_rt_seg = ptr_to_rm_seg(rimg_rt);
+			} else {
+				say(V_TABLES, u"  run time: base mem.\r\n");
+				bd->rimg_rt_seg = 0;
+			}
+			bd->rimg_rt_sz = rt_sz;
 			return;
 		}
 		/* or else fall through */
 	}
-	rimg_copy = bmem_alloc(sz, 2 * KIBYTE);
+	rimg_copy = shdw_alloc(sz, vga);
+	if (!rimg_copy)
+		rimg_copy = bmem_alloc(sz, 2 * KIBYTE);
 	memcpy(rimg_copy, rimg, sz);
-	Print(u"    ROM img.: @0x%lx~@0x%lx (copied from @0x%lx)\r\n",
+	say(V_TABLES, u"    ROM img.: @0x%lx~@0x%lx "
+			 "(copied from @0x%lx)\r\n",
 	    rimg_copy, (char *)rimg_copy + sz - 1, rimg);
 	bd->rimg_seg = bd->rimg_rt_seg = ptr_to_rm_seg(rimg_copy);
 }
 
+/*
+ * Forget a device's ROM image after all, & give back any base memory we
+ * copied it to.  (Shadow RAM is not given back.)
+ */
+static void drop_rimg(bdat_pci_dev_t *bd)
+{
+	bmem_free((void *)((uintptr_t)bd->rimg_seg * PARA_SIZE), bd->rimg_sz);
+	if (bd->rimg_rt_seg && bd->rimg_rt_seg != bd->rimg_seg)
+		bmem_free((void *)((uintptr_t)bd->rimg_rt_seg * PARA_SIZE),
+		    bd->rimg_rt_sz);
+	bd->rimg_seg = bd->rimg_rt_seg = 0;
+	bd->rimg_sz = bd->rimg_rt_sz = 0;
+	bd->rimg_policy = RIMG_SKIP;
+}
+
 static void get_rimg_from_pci_io(bdat_pci_dev_t *bd, EFI_PCI_IO_PROTOCOL *io)
 {
 	void *rimg = io->RomImage;
 	uint64_t rsz = io->RomSize;
 	uint32_t isz;
 	const rimg_pcir_t *pcir;
-	bd->rimg_seg = bd->rimg_rt_seg = bd->rimg_sz = 0;
+	bd->rimg_seg = bd->rimg_rt_seg = 0;
+	bd->rimg_sz = bd->rimg_rt_sz = 0;
 	if (!rsz || !rimg)
 		return;
 	pcir = rimg_find_pcir(rimg, rsz);
 	if (!pcir)
 		return;
 	if (pcir->type != PCIR_TYP_PCAT) {
-		Print(u"    ROM img. via EFI_PCI_IO_PROTOCOL not "
-			   "PC-AT compatible\r\n");
+		say(V_TABLES, u"    ROM img. via EFI_PCI_IO_PROTOCOL not "
+				 "PC-AT compatible\r\n");
 		return;
 	}
 	isz = (uint64_t)pcir->rimg_sz_hkib * HKIBYTE;
@@ -217,7 +270,8 @@ static void get_rimg_from_fvs(bdat_pci_dev_t *bd)
 {
 	void *rimg;
 	uint32_t sz;
-	bd->rimg_seg = bd->rimg_rt_seg = bd->rimg_sz = 0;
+	bd->rimg_seg = bd->rimg_rt_seg = 0;
+	bd->rimg_sz = bd->rimg_rt_sz = 0;
 	if (fv_find_rimg(bd->pci_id, bd->class_if, &rimg, &sz)) {
 		const rimg_pcir_t *pcir = rimg_find_pcir(rimg, sz);
 		if (pcir)
@@ -243,16 +297,167 @@ static void get_rimg_special_case(bdat_pci_dev_t *bd)
 	}
 }
 
+/* ACPI QWORD address space descriptor, as from GetBarAttributes(...). */
+typedef struct __attribute__((packed)) {
+	uint8_t tag;			/* ACPI_QWORD_DESC */
+	uint16_t len;
+	uint8_t res_type, gen_flags, type_flags;
+	uint64_t gran, min, max, xlat_off, addr_len;
+} acpi_qword_desc_t;
+
+#define ACPI_QWORD_DESC	0x8a
+
+/* Ask UEFI for the size of BAR number `idx'.  Return 0 if unknown. */
+static uint64_t get_bar_sz(EFI_PCI_IO_PROTOCOL *io, unsigned idx)
+{
+	void *res;
+	const acpi_qword_desc_t *desc;
+	uint64_t sz = 0;
+	EFI_STATUS status = io->GetBarAttributes(io, (UINT8)idx, NULL, &res);
+	if (EFI_ERROR(status) || !res)
+		return 0;
+	desc = res;
+	if (desc->tag == ACPI_QWORD_DESC)
+		sz = desc->addr_len;
+	FreePool(res);
+	return sz;
+}
+
+/*
+ * Add a "PCIX" boot parameter for a PCI function, given its configuration
+ * space header in `pci_conf': decode its BARs & find its capabilities.
+ */
+static bdat_pci_ext_t *add_pci_ext(EFI_PCI_IO_PROTOCOL *io, uint32_t locn,
+				   const UINT32 *pci_conf)
+{
+	const uint8_t *conf8 = (const uint8_t *)pci_conf;
+	bdat_pci_ext_t *bx = bparm_add(BP_PCIX, sizeof(bdat_pci_ext_t));
+	unsigned idx, num_bars, cap_ptr_off, cap, tries = 48;
+	bx->pci_locn = locn;
+	bx->pci_id = pci_conf[0];
+	bx->class_if = pci_conf[2] & 0xffffff00U;
+	bx->hdr_type = conf8[PCI_CONF_HDR_TYPE] & PCI_HDR_TYPE_MASK;
+	switch (bx->hdr_type) {
+	    case 0:
+		num_bars = 6;
+		cap_ptr_off = PCI_CONF_CAP_PTR;
+		bx->subsys_id = pci_conf[PCI_CONF_SUBSYS_ID / sizeof(UINT32)];
+		break;
+	    case 1:
+		num_bars = 2;
+		cap_ptr_off = PCI_CONF_CAP_PTR;
+		break;
+	    case 2:
+		num_bars = 0;
+		cap_ptr_off = PCI_CONF_CB_CAP_PTR;
+		break;
+	    default:
+		return bx;
+	}
+	bx->int_line = conf8[PCI_CONF_INT_LINE];
+	bx->int_pin = conf8[PCI_CONF_INT_PIN];
+	for (idx = 0; idx < num_bars; ++idx) {
+		UINT32 bar = pci_conf[PCI_CONF_BAR0 / sizeof(UINT32) + idx];
+		bdat_pci_bar_t *b = &bx->bars[idx];
+		if (!bar)
+			continue;
+		b->flags = PCIX_BAR_USED;
+		switch (bar & 0x00000007U) {
+		    case 0x00000000U:
+			/* 32-bit address in memory space */
+			b->base = bar & 0xfffffff0U;
+			break;
+		    case 0x00000004U:
+			/* 64-bit address in memory space */
+			if (idx + 1 >= num_bars)
+				error(u"bogus 64-bit PCI BAR");
+			b->base = (uint64_t)pci_conf[PCI_CONF_BAR0 /
+						     sizeof(UINT32) + idx + 1]
+				  << 32 | (bar & 0xfffffff0U);
+			b->flags |= PCIX_BAR_64;
+			break;
+		    case 0x00000001U:
+		    case 0x00000003U:
+		    case 0x00000005U:
+		    case 0x00000007U:
+			/* address in I/O space */
+			b->base = bar & 0xfffffffcU;
+			b->flags |= PCIX_BAR_IO;
+			break;
+		    default:
+			error(u"unhandled 16-bit PCI BAR");
+		}
+		if ((bar & 0x00000009U) == 0x00000008U)
+			b->flags |= PCIX_BAR_PF;
+		b->sz = get_bar_sz(io, idx);
+		if ((b->flags & PCIX_BAR_64) != 0)
+			++idx;
+	}
+	if ((conf8[PCI_CONF_STATUS] & PCI_STATUS_CAP_LIST) == 0)
+		return bx;
+	cap = conf8[cap_ptr_off] & 0xfcU;
+	while (cap >= 0x40 && tries-- != 0) {
+		uint8_t *p_cap;
+		switch (conf8[cap]) {
+		    case PCI_CAP_ID_PM:
+			p_cap = &bx->cap_pm;	break;
+		    case PCI_CAP_ID_MSI:
+			p_cap = &bx->cap_msi;	break;
+		    case PCI_CAP_ID_PCIE:
+			p_cap = &bx->cap_pcie;	break;
+		    case PCI_CAP_ID_MSIX:
+			p_cap = &bx->cap_msix;	break;
+		    default:
+			p_cap = NULL;
+		}
+		if (p_cap && !*p_cap)
+			*p_cap = (uint8_t)cap;
+		cap = conf8[cap + 1] & 0xfcU;
+	}
+	return bx;
+}
+
+static void say_pci_ext(const bdat_pci_ext_t *bx)
+{
+	unsigned idx;
+	bool got_bar = false;
+	for (idx = 0; idx < 6; ++idx) {
+		const bdat_pci_bar_t *b = &bx->bars[idx];
+		if ((b->flags & PCIX_BAR_USED) == 0)
+			continue;
+		if (!got_bar) {
+			got_bar = true;
+			say(V_TABLES, u"    BAR:");
+		}
+		if ((b->flags & PCIX_BAR_IO) != 0)
+			say(V_TABLES, u" {\u2191""0x%lx+0x%lx}",
+			    b->base, b->sz);
+		else
+			say(V_TABLES, u" {@0x%lx+0x%lx%s}", b->base, b->sz,
+			    (b->flags & PCIX_BAR_PF) != 0 ? u" pf" : u"");
+	}
+	if (got_bar)
+		say(V_TABLES, u"\r\n");
+	if (bx->int_pin || bx->cap_msi || bx->cap_msix || bx->cap_pcie)
+		say(V_TABLES, u"    INT%c# IRQ %u  caps.: PM 0x%x  MSI 0x%x  "
+				 "MSI-X 0x%x  PCIe 0x%x\r\n",
+		    bx->int_pin ? u'A' - 1 + bx->int_pin : u'-',
+		    (UINT32)bx->int_line, (UINT32)bx->cap_pm,
+		    (UINT32)bx->cap_msi, (UINT32)bx->cap_msix,
+		    (UINT32)bx->cap_pcie);
+}
+
 static bdat_pci_dev_t *process_one_pci_io(EFI_PCI_IO_PROTOCOL *io,
-					  bool try_enable_vga)
+					  bool try_enable_vga,
+					  bdat_pci_dev_t **p_bd,
+					  bool *p_need_rimg)
 {
 	UINTN seg, bus, dev, fn;
 	UINT64 attrs, supports, enables;
-	UINT32 pci_conf[6];  /* buffer for PCI id. etc., & for BARs */
-	UINT32 pci_id, class_if;
-	bool got_bar = false;
-	unsigned idx;
+	UINT32 pci_conf[PCI_CONF_SZ / sizeof(UINT32)];
+	UINT32 pci_id, class_if, locn;
 	bdat_pci_dev_t *bd, *vga = NULL;
+	bdat_pci_ext_t *bx;
 	EFI_STATUS status = io->GetLocation(io, &seg, &bus, &dev, &fn);
 	if (EFI_ERROR(status))
 		error_with_status(u"cannot get PCI ctrlr. locn.", status);
@@ -263,13 +468,15 @@ static bdat_pci_dev_t *process_one_pci_io(EFI_PCI_IO_PROTOCOL *io,
 	    0, &supports);
 	if (EFI_ERROR(status))
 		error_with_status(u"cannot get PCI ctrlr. attrs.", status);
-	status = io->Pci.Read(io, EfiPciIoWidthUint32, 0, 4, pci_conf);
+	status = io->Pci.Read(io, EfiPciIoWidthUint32, 0,
+	    PCI_CONF_SZ / sizeof(UINT32), pci_conf);
 	if (EFI_ERROR(status))
 		error_with_status(u"cannot read PCI conf. sp.", status);
 	pci_id = pci_conf[0];
 	class_if = pci_conf[2] & 0xffffff00U;
-	Print(u"  %04x:%02x:%02x.%x %04x:%04x %02x %02x %02x 0x%06lx%c "
-		 "0x%06lx%c 0x%06lx%c",
+	locn = seg << 16 | bus << 8 | dev << 3 | fn;
+	say(V_TABLES, u"  %04x:%02x:%02x.%x %04x:%04x %02x %02x %02x "
+			 "0x%06lx%c 0x%06lx%c 0x%06lx%c",
 	    seg, bus, dev, fn,
 	    (UINT32)pci_id_vendor(pci_id), (UINT32)pci_id_dev(pci_id),
 	    class_if >> 24, (class_if >> 16) & 0xffU,
@@ -280,16 +487,21 @@ static bdat_pci_dev_t *process_one_pci_io(EFI_PCI_IO_PROTOCOL *io,
 	    supports & ~0xffffffULL ? u'+' : u' ',
 	    attrs & 0xffffffULL,
 	    attrs & ~0xffffffULL ? u'+' : u' ');
+	/* Describe every function in detail for the OS. */
+	bx = add_pci_ext(io, locn, pci_conf);
 	/* Skip further processing if this is not a general device. */
-	if ((pci_conf[3] >> 8 & 0xff) != 0) {
-		Output(u"\r\n");
-		return false;
+	if (bx->hdr_type != 0) {
+		say(V_TABLES, u"\r\n");
+		say_pci_ext(bx);
+		return NULL;
 	}
 	/* Add a boot parameter for this PCI device. */
 	bd = bparm_add(BP_PCID, sizeof(bdat_pci_dev_t));
-	bd->pci_locn = seg << 16 | bus << 8 | dev << 3 | fn;
+	bd->pci_locn = locn;
 	bd->pci_id = pci_id;
 	bd->class_if = class_if;
+	bd->rimg_policy = (uint8_t)conf_rom_policy(pci_id, class_if);
+	*p_bd = bd;
 	/*
 	 * If this is a VGA or XGA display controller, try to enable the
 	 * legacy memory & I/O port locations for the controller.  Also
@@ -299,82 +511,77 @@ static bdat_pci_dev_t *process_one_pci_io(EFI_PCI_IO_PROTOCOL *io,
 	    enable_legacy_vga(io, class_if, attrs, supports, &enables)) {
 		vga = bd;
 		attrs |= enables;
-		Print(u" -> 0x%lx%c", attrs & 0xffffffULL,
+		say(V_TABLES, u" -> 0x%lx%c", attrs & 0xffffffULL,
 		    attrs & ~0xffffffULL ? u'+' : u' ');
 	}
-	Output(u"\r\n");
-	get_rimg_from_pci_io(bd, io);
-	if (!bd->rimg_seg) {
-		get_rimg_from_fvs(bd);
-		if (!bd->rimg_seg)
-			get_rimg_special_case(bd);
+	say(V_TABLES, u"\r\n");
+	/* Stage 2 needs the VGA BIOS, whatever the configuration says. */
+	if (vga && bd->rimg_policy != RIMG_EAGER) {
+		warn(u"ignoring rom = ... rule for VGA/XGA device");
+		bd->rimg_policy = RIMG_EAGER;
 	}
-	/* Enumerate all BAR values. */
-	status = io->Pci.Read(io, EfiPciIoWidthUint32, 4 * sizeof(UINT32),
-	    6, pci_conf);
-	if (EFI_ERROR(status))
-		error_with_status(u"cannot read PCI conf. sp.", status);
-	idx = 0U - 1;
-	while (++idx < 6) {
-		UINT32 bar = pci_conf[idx];
-		UINT64 addr;
-		if (!bar)
-			continue;
-		if (!got_bar) {
-			got_bar = true;
-			Output(u"    BAR:");
-		}
-		switch (bar & 0x00000007U) {
-		    case 0x00000000U:
-			/* 32-bit address in memory space */
-			Print(u" {@0x%x%s}", bar & 0xfffffff0U,
-			    bar & 0x00000008U ? u" pf" : u"");
-				break;
-		    case 0x00000004U:
-			/* 64-bit address in memory space */
-			if (idx == 9)
-				error(u"bogus 64-bit PCI BAR");
-			++idx;
-			addr = pci_conf[idx];
-			addr <<= 32;
-			addr |= bar & 0xfffffff0U;
-			Print(u" {@0x%lx%s}", addr,
-			    bar & 0x00000008U ? u" pf" : u"");
-			break;
-		    case 0x00000001U:
-		    case 0x00000003U:
-		    case 0x00000005U:
-		    case 0x00000007U:
-			/* address in I/O space */
-			Print(u" {\u2191""0x%x}", bar & 0xfffffffcU);
-			break;
-		    default:
-			error(u"unhandled 16-bit PCI BAR");
+	if (bd->rimg_policy != RIMG_EAGER)
+		say(V_TABLES, u"    ROM init.: %s\r\n",
+		    bd->rimg_policy == RIMG_DEFER ? u"deferred" : u"skipped");
+	/*
+	 * Do not bother to find or copy out a ROM image which will never be
+	 * run.  And only let ROMs to be run during boot decide whether we
+	 * need to look in the firmware volumes.
+	 */
+	if (bd->rimg_policy != RIMG_SKIP) {
+		get_rimg_from_pci_io(bd, io);
+		if (!bd->rimg_seg && bd->rimg_policy == RIMG_EAGER) {
+			fv_want_rimg(bd->pci_id, bd->class_if);
+			*p_need_rimg = true;
 		}
 	}
-	if (got_bar)
-		Output(u"\r\n");
+	say_pci_ext(bx);
 	return vga;
 }
 
 /*
  * Go through all the PCI devices as reported by UEFI.  Try to see if any
  * devices have legacy option ROM images associated with them, & copy the
- * ROM images out to base memory.  Add boot parameters for the PCI devices
- * & their ROM images.
+ * ROM images out to shadow RAM or base memory.  Add boot parameters for
+ * the PCI devices & their ROM images.
+ *
+ * ROM images are first sought via EFI_PCI_IO_PROTOCOL.  Only if some
+ * devices still lack ROM images do we look in the firmware volumes, & then
+ * only for those devices' PCI ids. & classes.
  */
 void process_pci(void)
 {
 	EFI_HANDLE *handles;
 	UINTN num_handles, idx;
-	bdat_pci_dev_t *vga = NULL;
+	bdat_pci_dev_t *vga = NULL, *bd, **bds;
+	bool need_rimg = false;
 	EFI_STATUS status = LibLocateHandle(ByProtocol,
 	    &gEfiPciIoProtocolGuid, NULL, &num_handles, &handles);
 	if (EFI_ERROR(status) || !num_handles)
 	        error_with_status(u"no PCI devices found", status);
-	Print(u"PCI devices: %lu\r\n"
-	       "  locn.        PCI id.   class+IF ROM sz.   "
-		 "supports  attrs.\r\n", num_handles);
+	say(V_INFO, u"PCI devices: %lu\r\n", num_handles);
+	bds = AllocateZeroPool(num_handles * sizeof(bdat_pci_dev_t *));
+	if (!bds)
+		error(u"no mem. for PCI device list");
+	/*
+	 * Find the host bridge at 0000:00:00.0, & try to unlock shadow RAM
+	 * for the ROM images.
+	 */
+	for (idx = 0; idx < num_handles; ++idx) {
+		EFI_PCI_IO_PROTOCOL *io;
+		UINTN seg, bus, dev, fn;
+		status = BS->HandleProtocol(handles[idx],
+		    &gEfiPciIoProtocolGuid, (void **)&io);
+		if (EFI_ERROR(status))
+			continue;
+		status = io->GetLocation(io, &seg, &bus, &dev, &fn);
+		if (!EFI_ERROR(status) && !seg && !bus && !dev && !fn) {
+			shdw_init(io);
+			break;
+		}
+	}
+	say(V_TABLES, u"  locn.        PCI id.   class+IF ROM sz.   "
+			 "supports  attrs.\r\n");
 	for (idx = 0; idx < num_handles; ++idx) {
 		EFI_HANDLE handle = handles[idx];
 		EFI_PCI_IO_PROTOCOL *io;
@@ -384,11 +591,50 @@ void process_pci(void)
 			error_with_status(u"cannot get EFI_PCI_IO_PROTOCOL",
 			    status);
 		if (!vga)
-			vga = process_one_pci_io(io, true);
+			vga = process_one_pci_io(io, true, &bds[idx],
+			    &need_rimg);
 		else
-			process_one_pci_io(io, false);
+			process_one_pci_io(io, false, &bds[idx], &need_rimg);
 	}
 	FreePool(handles);
+	/*
+	 * Look for any remaining ROM images elsewhere.  If we must go
+	 * through the firmware volumes anyway, also look for the ROMs of
+	 * devices whose ROMs are deferred.
+	 */
+	if (need_rimg) {
+		for (idx = 0; idx < num_handles; ++idx) {
+			bd = bds[idx];
+			if (bd && !bd->rimg_seg &&
+			    bd->rimg_policy == RIMG_DEFER)
+				fv_want_rimg(bd->pci_id, bd->class_if);
+		}
+		for (idx = 0; idx < num_handles; ++idx) {
+			bd = bds[idx];
+			if (!bd || bd->rimg_seg ||
+			    bd->rimg_policy == RIMG_SKIP)
+				continue;
+			say(V_TABLES, u"  %04x:%02x:%02x.%x\r\n",
+			    bd->pci_locn >> 16, (bd->pci_locn >> 8) & 0xffU,
+			    (bd->pci_locn >> 3) & 0x1fU, bd->pci_locn & 7U);
+			get_rimg_from_fvs(bd);
+			if (!bd->rimg_seg)
+				get_rimg_special_case(bd);
+		}
+	}
+	/*
+	 * Only the VGA/XGA controller whose legacy resources we enabled gets
+	 * its ROM run.  The ROMs of any other display controllers met before
+	 * it would only fight it for int 0x10, so drop them.
+	 */
+	for (idx = 0; vga && idx < num_handles; ++idx) {
+		bd = bds[idx];
+		if (bd && bd != vga && bd->rimg_seg &&
+		    vga_class_p(bd->class_if))
+			drop_rimg(bd);
+	}
+	FreePool(bds);
+	shdw_fini();
 	if (!vga)
 		error(u"no usable VGA/XGA controller?");
 	if (!vga->rimg_seg)
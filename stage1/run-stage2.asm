@@ -111,3 +111,27 @@ Lpm32_gdt_end:
 
 LE:					; <<< end of trampoline to copy >>>
 					; must be 8-byte aligned w.r.t. LB
+
+	bits	64
+
+	global	run_stage2_64
+run_stage2_64:
+	; on entry, same as for run_stage2, except that stage 2 is an x86-64
+	; program to be entered in long mode; it gets the firmware's
+	; identity mapped page tables, & should quickly set up its own
+	cli
+	mov	ebp, [rsp+8+0x20]	; get boot parameters
+	lea	esp, [edx+0x1000]	; switch to new stack
+	mov	ebx, ecx		; save ELF64 entry point
+	xor	edi, edi		; clear the real mode interrupt
+	mov	ecx, 0x0600/8		; vector table & BIOS data area
+	xor	eax, eax
+	rep stosq
+	mov	[0x0413], r8w		; set base mem. size in BIOS data area
+	mov	[0x040e], r9w		; also set EBDA segment
+	mov	dx, 0x03cc		; frob VGA miscellaneous output reg.
+	in	al, dx
+	or	al, 0b00000001
+	mov	dl, 0xc2
+	out	dx, al
+	jmp	rbx			; jump to stage 2 entry point
@@ -0,0 +1,474 @@
+/*
+ * Copyright (c) 2021 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Routines for reading the stage 2 program file.
+ *
+ * If the firmware's file protocol supports revision 2 asynchronous I/O,
+ * s2file_open() starts reading the whole file into memory in the
+ * background, so that the disk I/O can overlap with firmware volume
+ * scanning & PCI enumeration.  s2file_read(, , ) then waits for this read
+ * to complete, & serves data from the in-memory copy.
+ *
+ * Otherwise, s2file_read(, , ) falls back on plain synchronous seeks &
+ * reads.
+ *
+ * The stage 2 file may also be compressed in the LZ4 frame format, in
+ * which case s2file_read(, , ) decompresses it as it goes.  The file's
+ * leading magic number says whether it is compressed.  Decompression
+ * proceeds one LZ4 block at a time; reads that go backwards are served
+ * from the current block, or from a small cache of the file's start (for
+ * the ELF headers), or else by restarting decompression from the top.
+ *
+ * (Block & content checksums in the LZ4 frame are not verified; the ELF
+ * loader's own checks will have to do.)
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include "stage1/stage1.h"
+
+static EFI_FILE_PROTOCOL *vol = NULL, *prog = NULL;
+static CONST CHAR16 *prog_name = NULL;
+static UINT64 prog_sz = 0;
+/* Variables for an asynchronous whole-file read. */
+static bool async_p = false, async_done_p = false;
+static EFI_FILE_IO_TOKEN token;
+static char *prog_buf = NULL;
+
+/* LZ4 frame format definitions. */
+#define LZ4F_MAGIC	0x184d2204UL	/* frame magic number */
+#define LZ4F_FLG_VER_MASK 0xc0U		/* FLG byte: version no. */
+#define LZ4F_FLG_VER	0x40U
+#define LZ4F_FLG_B_INDEP 0x20U		/* FLG: blocks independent */
+#define LZ4F_FLG_B_CKSUM 0x10U		/* FLG: block checksums */
+#define LZ4F_FLG_C_SIZE	0x08U		/* FLG: content size present */
+#define LZ4F_FLG_DICT_ID 0x01U		/* FLG: dictionary id. */
+#define LZ4F_BLK_UNCOMP	0x80000000UL	/* block is not compressed */
+#define LZ4_HIST_SZ	0x10000U	/* max. distance of LZ4 match */
+#define HEAD_CACHE_SZ	0x1000U		/* size of cache for file start */
+
+/* Variables for decompressing an LZ4-compressed stage 2 file. */
+static bool fmt_known_p = false, lz4_p = false, lz4_indep_p,
+	    lz4_blk_cksum_p, lz4_eof_p;
+static UINT64 lz4_data_pos, lz4_raw_pos, lz4_dec_pos;
+static uint32_t lz4_blk_max_sz, lz4_dec_len, lz4_hist_len, head_len = 0;
+static char *lz4_dec_buf = NULL, *lz4_cblk_buf = NULL;
+static char head_cache[HEAD_CACHE_SZ];
+
+/* Clean up, & bail out with an error message. */
+__attribute__((noreturn)) static void s2file_error(IN CONST CHAR16 *msg,
+						   EFI_STATUS status)
+{
+	s2file_close();
+	error_with_status(msg, status);
+}
+
+/* Try to start an asynchronous read of the whole stage 2 file. */
+static void s2file_start_async_read(void)
+{
+	EFI_STATUS status;
+	if (prog->Revision < EFI_FILE_PROTOCOL_REVISION2 || !prog_sz ||
+	    prog_sz != (UINTN)prog_sz)
+		return;
+	prog_buf = AllocatePool(prog_sz);
+	if (!prog_buf)
+		return;
+	status = BS->CreateEvent(0, TPL_CALLBACK, NULL, NULL, &token.Event);
+	if (EFI_ERROR(status)) {
+		FreePool(prog_buf);
+		prog_buf = NULL;
+		return;
+	}
+	token.Status = EFI_SUCCESS;
+	token.BufferSize = prog_sz;
+	token.Buffer = prog_buf;
+	status = prog->ReadEx(prog, &token);
+	if (EFI_ERROR(status)) {
+		/*
+		 * The firmware may well not implement ReadEx(, ), or may
+		 * not implement it for this file system.  Fall back on
+		 * synchronous reads.
+		 */
+		BS->CloseEvent(token.Event);
+		FreePool(prog_buf);
+		prog_buf = NULL;
+		return;
+	}
+	async_p = true;
+}
+
+/*
+ * Open the stage 2 file, trying each configured path name in turn, & start
+ * reading it if possible.
+ */
+void s2file_open(void)
+{
+	EFI_STATUS status = EFI_NOT_FOUND;
+	EFI_FILE_INFO *info;
+	unsigned path_idx;
+	vol = open_boot_vol();
+	for (path_idx = 0; path_idx < conf.num_stage2_paths; ++path_idx) {
+		prog_name = conf.stage2_paths[path_idx];
+		status = vol->Open(vol, &prog, (CHAR16 *)prog_name,
+		    EFI_FILE_MODE_READ, 0);
+		if (!EFI_ERROR(status))
+			break;
+		prog = NULL;
+	}
+	if (EFI_ERROR(status))
+		s2file_error(u"cannot open stage 2", status);
+	info = LibFileInfo(prog);
+	if (!info)
+		s2file_error(u"cannot get info on stage 2", EFI_NOT_FOUND);
+	prog_sz = info->FileSize;
+	say(V_INFO, u"stage2: %s  size: 0x%lx  attrs.: 0x%lx\r\n",
+	    prog_name, prog_sz, info->Attribute);
+	FreePool(info);
+	s2file_start_async_read();
+}
+
+/* Wait for any asynchronous read to complete, & check its results. */
+static void s2file_wait(void)
+{
+	UINTN which;
+	EFI_STATUS status;
+	if (async_done_p)
+		return;
+	status = BS->WaitForEvent(1, &token.Event, &which);
+	if (EFI_ERROR(status))
+		s2file_error(u"cannot wait for stage 2 read", status);
+	async_done_p = true;
+	status = token.Status;
+	if (EFI_ERROR(status))
+		s2file_error(u"cannot read stage 2", status);
+	if (token.BufferSize != prog_sz)
+		s2file_error(u"short read from stage 2", EFI_END_OF_FILE);
+}
+
+/* Read `size' bytes at offset `pos' in the raw stage 2 file into `buf'. */
+static void s2file_raw_read(UINT64 pos, UINTN size, void *buf)
+{
+	UINTN read_size = size;
+	EFI_STATUS status;
+	if (!size)
+		return;
+	if (async_p) {
+		s2file_wait();
+		if (pos > prog_sz || size > prog_sz - pos)
+			s2file_error(u"short read from stage 2",
+			    EFI_END_OF_FILE);
+		memcpy(buf, prog_buf + pos, size);
+		return;
+	}
+	status = prog->SetPosition(prog, pos);
+	if (EFI_ERROR(status))
+		s2file_error(u"cannot seek into stage 2", status);
+	status = prog->Read(prog, &read_size, buf);
+	if (EFI_ERROR(status))
+		s2file_error(u"cannot read stage 2", status);
+	if (read_size != size)
+		s2file_error(u"short read from stage 2", status);
+}
+
+/* Complain about bad LZ4 compressed data. */
+__attribute__((noreturn)) static void lz4_error(void)
+{
+	s2file_error(u"bad LZ4 data in stage 2", EFI_VOLUME_CORRUPTED);
+}
+
+/* Read a little-endian 32-bit number from the raw stage 2 file. */
+static uint32_t s2file_raw_read_32(UINT64 pos)
+{
+	uint8_t b[4];
+	s2file_raw_read(pos, sizeof b, b);
+	return (uint32_t)b[0]	    | (uint32_t)b[1] <<  8 |
+	       (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24;
+}
+
+/*
+ * See whether the stage 2 file is LZ4 compressed.  If it is, parse the LZ4
+ * frame header, & get ready to decompress.
+ */
+static void s2file_check_fmt(void)
+{
+	uint8_t desc[2];
+	UINT64 pos = 4;
+	fmt_known_p = true;
+	if (prog_sz < 4 + sizeof desc + 1 + 4 ||
+	    s2file_raw_read_32(0) != LZ4F_MAGIC)
+		return;
+	s2file_raw_read(pos, sizeof desc, desc);
+	if ((desc[0] & LZ4F_FLG_VER_MASK) != LZ4F_FLG_VER ||
+	    (desc[0] & LZ4F_FLG_DICT_ID) != 0)
+		s2file_error(u"unsupported LZ4 frame in stage 2",
+		    EFI_UNSUPPORTED);
+	lz4_indep_p = (desc[0] & LZ4F_FLG_B_INDEP) != 0;
+	lz4_blk_cksum_p = (desc[0] & LZ4F_FLG_B_CKSUM) != 0;
+	switch (desc[1] & 0x70U) {
+	    case 0x40U:
+		lz4_blk_max_sz = 0x10000UL;	break;
+	    case 0x50U:
+		lz4_blk_max_sz = 0x40000UL;	break;
+	    case 0x60U:
+		lz4_blk_max_sz = 0x100000UL;	break;
+	    case 0x70U:
+		lz4_blk_max_sz = 0x400000UL;	break;
+	    default:
+		lz4_error();
+	}
+	pos += sizeof desc;
+	if ((desc[0] & LZ4F_FLG_C_SIZE) != 0)
+		pos += 8;
+	/* Skip the header checksum byte. */
+	lz4_data_pos = pos + 1;
+	lz4_dec_buf = AllocatePool(LZ4_HIST_SZ + lz4_blk_max_sz);
+	lz4_cblk_buf = AllocatePool(lz4_blk_max_sz);
+	if (!lz4_dec_buf || !lz4_cblk_buf)
+		s2file_error(u"no mem. to decompress stage 2",
+		    EFI_OUT_OF_RESOURCES);
+	say(V_TABLES, u"  LZ4 compressed  max. blk. sz.: 0x%x\r\n",
+	    lz4_blk_max_sz);
+	lz4_p = true;
+	lz4_raw_pos = lz4_data_pos;
+	lz4_dec_pos = 0;
+	lz4_dec_len = lz4_hist_len = 0;
+	lz4_eof_p = false;
+}
+
+/*
+ * Decompress one LZ4 block of `in_sz' bytes at `in', to `out'.  Matches may
+ * refer back to up to `hist_len' bytes of earlier output lying just below
+ * `out'.  Return the decompressed size.
+ */
+static uint32_t lz4_dec_blk(const uint8_t *in, uint32_t in_sz, uint8_t *out,
+    uint32_t out_max, uint32_t hist_len)
+{
+	const uint8_t *ip = in, *in_end = in + in_sz;
+	uint8_t *op = out, *out_end = out + out_max;
+	for (;;) {
+		unsigned tok;
+		uint32_t len, off, b;
+		const uint8_t *match;
+		if (ip == in_end)
+			lz4_error();
+		tok = *ip++;
+		/* Copy literals. */
+		len = tok >> 4;
+		if (len == 15) {
+			do {
+				if (ip == in_end)
+					lz4_error();
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		if (len > (uint32_t)(in_end - ip) ||
+		    len > (uint32_t)(out_end - op))
+			lz4_error();
+		memcpy(op, ip, len);
+		ip += len;
+		op += len;
+		/* The last sequence in a block has only literals. */
+		if (ip == in_end)
+			break;
+		/* Copy a match. */
+		if (in_end - ip < 2)
+			lz4_error();
+		off = (uint32_t)ip[0] | (uint32_t)ip[1] << 8;
+		ip += 2;
+		if (!off || off > (uint32_t)(op - out) + hist_len)
+			lz4_error();
+		len = tok & 0x0fU;
+		if (len == 15) {
+			do {
+				if (ip == in_end)
+					lz4_error();
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		len += 4;
+		if (len > (uint32_t)(out_end - op))
+			lz4_error();
+		/* The match may overlap the output, so copy byte by byte. */
+		match = op - off;
+		while (len-- != 0)
+			*op++ = *match++;
+	}
+	return (uint32_t)(op - out);
+}
+
+/* Go back to the start of the LZ4 compressed data. */
+static void lz4_rewind(void)
+{
+	lz4_raw_pos = lz4_data_pos;
+	lz4_dec_pos = 0;
+	lz4_dec_len = lz4_hist_len = 0;
+	lz4_eof_p = false;
+}
+
+/* Decompress the next LZ4 block. */
+static void lz4_next_blk(void)
+{
+	uint32_t hdr, blk_sz, new_hist_len;
+	char *out = lz4_dec_buf + LZ4_HIST_SZ;
+	/*
+	 * If blocks depend on earlier blocks, keep the last 64 KiB of
+	 * output, just below where the new block will go.
+	 */
+	if (lz4_indep_p)
+		lz4_hist_len = 0;
+	else {
+		new_hist_len = lz4_hist_len + lz4_dec_len;
+		if (new_hist_len > LZ4_HIST_SZ)
+			new_hist_len = LZ4_HIST_SZ;
+		CopyMem(out - new_hist_len, out + lz4_dec_len - new_hist_len,
+		    new_hist_len);
+		lz4_hist_len = new_hist_len;
+	}
+	lz4_dec_pos += lz4_dec_len;
+	lz4_dec_len = 0;
+	/* Read the block header. */
+	hdr = s2file_raw_read_32(lz4_raw_pos);
+	lz4_raw_pos += 4;
+	if (!hdr) {
+		lz4_eof_p = true;
+		return;
+	}
+	blk_sz = hdr & ~LZ4F_BLK_UNCOMP;
+	if (blk_sz > lz4_blk_max_sz)
+		lz4_error();
+	/* Read & (if needed) decompress the block. */
+	if ((hdr & LZ4F_BLK_UNCOMP) != 0) {
+		s2file_raw_read(lz4_raw_pos, blk_sz, out);
+		lz4_dec_len = blk_sz;
+	} else {
+		s2file_raw_read(lz4_raw_pos, blk_sz, lz4_cblk_buf);
+		lz4_dec_len = lz4_dec_blk((const uint8_t *)lz4_cblk_buf,
+		    blk_sz, (uint8_t *)out, lz4_blk_max_sz, lz4_hist_len);
+	}
+	lz4_raw_pos += blk_sz;
+	if (lz4_blk_cksum_p)
+		lz4_raw_pos += 4;
+	/* Remember the start of the file. */
+	if (lz4_dec_pos == head_len && head_len < HEAD_CACHE_SZ) {
+		uint32_t n = HEAD_CACHE_SZ - head_len;
+		if (n > lz4_dec_len)
+			n = lz4_dec_len;
+		memcpy(head_cache + head_len, out, n);
+		head_len += n;
+	}
+}
+
+/* Read from an LZ4 compressed stage 2 file. */
+static void lz4_read(UINT64 pos, UINTN size, char *buf)
+{
+	while (size) {
+		UINT64 n;
+		if (pos >= lz4_dec_pos && pos - lz4_dec_pos < lz4_dec_len) {
+			n = lz4_dec_pos + lz4_dec_len - pos;
+			if (n > size)
+				n = size;
+			memcpy(buf, lz4_dec_buf + LZ4_HIST_SZ +
+			    (pos - lz4_dec_pos), n);
+		} else if (pos < head_len) {
+			n = head_len - pos;
+			if (n > size)
+				n = size;
+			memcpy(buf, head_cache + pos, n);
+		} else {
+			if (pos < lz4_dec_pos)
+				lz4_rewind();
+			else if (lz4_eof_p)
+				s2file_error(u"short read from stage 2",
+				    EFI_END_OF_FILE);
+			lz4_next_blk();
+			continue;
+		}
+		pos += n;
+		buf += n;
+		size -= n;
+	}
+}
+
+/*
+ * Read `size' bytes at offset `pos' in the (decompressed) stage 2 file
+ * into `buf'.
+ */
+void s2file_read(UINT64 pos, UINTN size, void *buf)
+{
+	if (!size)
+		return;
+	if (!fmt_known_p)
+		s2file_check_fmt();
+	if (lz4_p)
+		lz4_read(pos, size, buf);
+	else
+		s2file_raw_read(pos, size, buf);
+}
+
+/* Close the stage 2 file, & free up any resources used for reading it. */
+void s2file_close(void)
+{
+	if (async_p) {
+		/*
+		 * If the read is still going on, we must wait for it to end
+		 * before we can free the buffer.
+		 */
+		if (!async_done_p) {
+			UINTN which;
+			async_done_p = true;
+			BS->WaitForEvent(1, &token.Event, &which);
+		}
+		BS->CloseEvent(token.Event);
+		async_p = false;
+	}
+	if (prog_buf) {
+		FreePool(prog_buf);
+		prog_buf = NULL;
+	}
+	if (lz4_dec_buf) {
+		FreePool(lz4_dec_buf);
+		lz4_dec_buf = NULL;
+	}
+	if (lz4_cblk_buf) {
+		FreePool(lz4_cblk_buf);
+		lz4_cblk_buf = NULL;
+	}
+	lz4_p = false;
+	if (prog) {
+		prog->Close(prog);
+		prog = NULL;
+	}
+	if (vol) {
+		vol->Close(vol);
+		vol = NULL;
+	}
+}
@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2021 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include "stage1/stage1.h"
+#include "pci.h"
+
+/*
+ * Shadow RAM for option ROM images.
+ *
+ * Rather than copying legacy option ROM images into base memory below
+ * 640 KiB --- which lowers the memory size reported by int 0x12 --- we
+ * try to place them in the upper memory area at 0xc0000--0xeffff, as a
+ * real BIOS does.  This needs the host bridge's Programmable Attribute Map
+ * (PAM) registers to map RAM there & make it writable.  Stage 2 makes the
+ * area read-only again (via the "SHDW" boot parameter) once it has run the
+ * ROMs' init. code.
+ *
+ * Each PAM register covers 32 KiB, as two 16 KiB chunks: bits 1:0 for the
+ * lower chunk, bits 5:4 for the upper.  We only use chunks which the UEFI
+ * memory map says nothing about, & which do not hold any ROM images
+ * already.  VGA ROM images are placed from the bottom of the area upwards
+ * (so that the VGA BIOS ends up at 0xc0000 if possible), & other ROM
+ * images from the top downwards.
+ */
+
+#define SHDW_START	0xc0000U
+#define SHDW_END	0xf0000U
+#define SHDW_CHUNK	(16 * KIBYTE)
+#define NUM_CHUNKS	((SHDW_END - SHDW_START) / SHDW_CHUNK)
+#define NUM_PAMS	(NUM_CHUNKS / 2)
+#define SHDW_ALIGN	(2 * KIBYTE)
+
+/* PAM register bits for one 16 KiB chunk. */
+#define PAM_RE		0x1U	/* reads go to RAM */
+#define PAM_WE		0x2U	/* writes go to RAM */
+
+typedef struct {
+	uint32_t pci_id;	/* host bridge PCI id. */
+	uint8_t pam_off;	/* conf. sp. offset of PAM for 0xc0000-- */
+	CONST CHAR16 *name;
+} shdw_chipset_t;
+
+static const shdw_chipset_t shdw_chipsets[] = {
+	{ 0x12378086U, 0x5a, u"i440FX" },	/* 82441FX PMC */
+	{ 0x29c08086U, 0x91, u"Q35" }		/* 82G33 DRAM ctrlr. */
+};
+
+static EFI_PCI_IO_PROTOCOL *shdw_io = NULL;
+static uint32_t shdw_locn;
+static uint8_t shdw_pam_off, shdw_pam_orig[NUM_PAMS];
+/* Shadow RAM area we unlocked, & the part of it still free. */
+static uint32_t shdw_win_lo, shdw_win_hi, shdw_bot, shdw_top;
+
+static unsigned shdw_chunk(uintptr_t addr)
+{
+	return (addr - SHDW_START) / SHDW_CHUNK;
+}
+
+/* Mark as unusable any chunks which UEFI knows about. */
+static void shdw_check_mem_map(bool *usable)
+{
+	EFI_MEMORY_DESCRIPTOR *desc, *descs;
+	UINTN num_ents, map_key, desc_sz, ent_iter;
+	unsigned chunk;
+	descs = get_mem_map(&num_ents, &map_key, &desc_sz);
+	FOR_EACH_MEM_DESC(desc, descs, desc_sz, num_ents, ent_iter) {
+		EFI_PHYSICAL_ADDRESS start = desc->PhysicalStart, end;
+		end = start + desc->NumberOfPages * EFI_PAGE_SIZE;
+		if (end <= SHDW_START || start >= SHDW_END)
+			continue;
+		if (start < SHDW_START)
+			start = SHDW_START;
+		if (end > SHDW_END)
+			end = SHDW_END;
+		for (chunk = shdw_chunk(start); chunk <= shdw_chunk(end - 1);
+		     ++chunk)
+			usable[chunk] = false;
+	}
+	FreePool(descs);
+}
+
+/* Mark as unusable any chunks holding existing ROM images. */
+static void shdw_check_rimgs(bool *usable)
+{
+	uintptr_t addr = SHDW_START;
+	unsigned chunk;
+	while (addr < SHDW_END) {
+		uint64_t sz = rimg_find((const void *)addr);
+		if (!sz) {
+			addr += SHDW_ALIGN;
+			continue;
+		}
+		say(V_TABLES, u"  ROM img. @0x%lx~@0x%lx\r\n",
+		    (UINT64)addr, (UINT64)(addr + sz - 1));
+		for (chunk = shdw_chunk(addr);
+		     chunk < NUM_CHUNKS && chunk <= shdw_chunk(addr + sz - 1);
+		     ++chunk)
+			usable[chunk] = false;
+		addr += (sz + SHDW_ALIGN - 1) & -SHDW_ALIGN;
+	}
+}
+
+/* Check that each chunk in the given range really reads back as RAM. */
+static bool shdw_test_ram(uint32_t lo, uint32_t hi)
+{
+	uint32_t addr;
+	for (addr = lo; addr < hi; addr += SHDW_CHUNK) {
+		volatile uint32_t *p = (volatile uint32_t *)(uintptr_t)addr;
+		uint32_t old = *p, test = 0x55aa33ccU ^ addr;
+		*p = test;
+		if (*p != test)
+			return false;
+		*p = old;
+	}
+	return true;
+}
+
+/*
+ * Try to set up shadow RAM for option ROM images, given the
+ * EFI_PCI_IO_PROTOCOL instance for the host bridge at 0000:00:00.0.
+ */
+void shdw_init(EFI_PCI_IO_PROTOCOL *io)
+{
+	UINTN seg, bus, dev, fn;
+	UINT32 pci_id;
+	uint8_t pam[NUM_PAMS];
+	bool usable[NUM_CHUNKS];
+	unsigned idx, chunk, run = 0, best_start = 0, best_len = 0;
+	const shdw_chipset_t *cs = NULL;
+	EFI_STATUS status = io->GetLocation(io, &seg, &bus, &dev, &fn);
+	if (EFI_ERROR(status))
+		return;
+	status = io->Pci.Read(io, EfiPciIoWidthUint32, 0, 1, &pci_id);
+	if (EFI_ERROR(status))
+		return;
+	for (idx = 0; idx < sizeof(shdw_chipsets) / sizeof(shdw_chipsets[0]);
+	     ++idx)
+		if (shdw_chipsets[idx].pci_id == pci_id)
+			cs = &shdw_chipsets[idx];
+	if (!cs) {
+		say(V_TABLES, u"ROM shadow RAM: host bridge %04x:%04x "
+				 "unsupported\r\n",
+		    (UINT32)pci_id_vendor(pci_id), (UINT32)pci_id_dev(pci_id));
+		return;
+	}
+	status = io->Pci.Read(io, EfiPciIoWidthUint8, cs->pam_off, NUM_PAMS,
+	    pam);
+	if (EFI_ERROR(status))
+		return;
+	say(V_TABLES, u"ROM shadow RAM: %s, PAM1~6: %02x %02x %02x %02x "
+			 "%02x %02x\r\n", cs->name, (UINT32)pam[0],
+	    (UINT32)pam[1], (UINT32)pam[2], (UINT32)pam[3], (UINT32)pam[4],
+	    (UINT32)pam[5]);
+	/* Find the longest run of chunks we can use. */
+	for (chunk = 0; chunk < NUM_CHUNKS; ++chunk)
+		usable[chunk] = true;
+	shdw_check_mem_map(usable);
+	shdw_check_rimgs(usable);
+	for (chunk = 0; chunk < NUM_CHUNKS; ++chunk) {
+		if (!usable[chunk]) {
+			run = 0;
+			continue;
+		}
+		if (++run > best_len) {
+			best_start = chunk + 1 - run;
+			best_len = run;
+		}
+	}
+	if (!best_len) {
+		say(V_TABLES, u"  no room\r\n");
+		return;
+	}
+	/* Map RAM into the run, for reading & writing. */
+	memcpy(shdw_pam_orig, pam, NUM_PAMS);
+	for (chunk = best_start; chunk < best_start + best_len; ++chunk)
+		pam[chunk / 2] |= (PAM_RE | PAM_WE) << (chunk % 2 * 4);
+	status = io->Pci.Write(io, EfiPciIoWidthUint8, cs->pam_off, NUM_PAMS,
+	    pam);
+	if (EFI_ERROR(status)) {
+		warn(u"cannot unlock ROM shadow RAM");
+		return;
+	}
+	shdw_win_lo = shdw_bot = SHDW_START + best_start * SHDW_CHUNK;
+	shdw_win_hi = shdw_top = shdw_win_lo + best_len * SHDW_CHUNK;
+	if (!shdw_test_ram(shdw_win_lo, shdw_win_hi)) {
+		io->Pci.Write(io, EfiPciIoWidthUint8, cs->pam_off, NUM_PAMS,
+		    shdw_pam_orig);
+		warn(u"no ROM shadow RAM @0x%lx~@0x%lx",
+		    (UINT64)shdw_win_lo, (UINT64)shdw_win_hi - 1);
+		return;
+	}
+	say(V_TABLES, u"  unlocked @0x%lx~@0x%lx\r\n",
+	    (UINT64)shdw_win_lo, (UINT64)shdw_win_hi - 1);
+	shdw_io = io;
+	shdw_locn = seg << 16 | bus << 8 | dev << 3 | fn;
+	shdw_pam_off = cs->pam_off;
+}
+
+/*
+ * Allocate `size' bytes of shadow RAM for an option ROM image, 2 KiB
+ * aligned, from the bottom of the area if `low' is true, or from the top
+ * otherwise.  Return NULL if there is no shadow RAM or not enough of it.
+ */
+void *shdw_alloc(UINTN size, bool low)
+{
+	if (!shdw_io || size > shdw_top - shdw_bot)
+		return NULL;
+	size = (size + SHDW_ALIGN - 1) & -SHDW_ALIGN;
+	if (size > shdw_top - shdw_bot)
+		return NULL;
+	if (low) {
+		shdw_bot += size;
+		return (void *)(uintptr_t)(shdw_bot - size);
+	}
+	shdw_top -= size;
+	return (void *)(uintptr_t)shdw_top;
+}
+
+/*
+ * Wrap up shadow RAM handling.  If we did use shadow RAM, add a boot
+ * parameter telling stage 2 where it is, & how to lock it; otherwise, put
+ * the PAM registers back as they were.
+ */
+void shdw_fini(void)
+{
+	bdat_shdw_t *bd;
+	uint32_t used;
+	if (!shdw_io)
+		return;
+	used = (shdw_bot - shdw_win_lo) + (shdw_win_hi - shdw_top);
+	say(V_INFO, u"ROM shadow RAM: %u KiB used\r\n", used / KIBYTE);
+	if (!used) {
+		shdw_io->Pci.Write(shdw_io, EfiPciIoWidthUint8, shdw_pam_off,
+		    NUM_PAMS, shdw_pam_orig);
+		shdw_io = NULL;
+		return;
+	}
+	bd = bparm_add(BP_SHDW, sizeof(bdat_shdw_t));
+	bd->pci_locn = shdw_locn;
+	bd->pam_off = shdw_pam_off;
+	bd->start = shdw_win_lo;
+	bd->end = shdw_win_hi;
+	bparm_add_mem_range(shdw_win_lo, shdw_win_hi - shdw_win_lo,
+	    E820_RESERVED, 1U, 0);
+}
@@ -50,6 +50,7 @@ extern void acpi_init(acpi_xsdp_t *);
 extern void bmem_init(void);
 extern void *bmem_alloc(UINTN, UINTN);
 extern void *bmem_alloc_boottime(UINTN, UINTN);
+extern void bmem_free(void *, UINTN);
 extern void bmem_fini(EFI_MEMORY_DESCRIPTOR *, UINTN, UINTN,
     uint32_t *, uint32_t *);
 
@@ -58,27 +59,108 @@ extern void bmem_fini(EFI_MEMORY_DESCRIPTOR *, UINTN, UINTN,
 extern void *bparm_add(uint32_t, uint32_t);
 extern bdat_mem_range_t *bparm_add_mem_range(uint64_t, uint64_t,
     uint32_t, uint32_t, uint64_t);
-extern bparm_t *bparm_get(void);
+extern void bparm_seal(void);
+extern void *bparm_find(uint32_t, uint32_t *);
+extern bparm_tbl_t *bparm_get(void);
+
+/* conf.c functions & variables. */
+
+#define MAX_STAGE2_PATHS	8U
+#define MAX_ROM_RULES		16U
+
+/* Verbosity levels. */
+#define V_QUIET		0U	/* errors & warnings only */
+#define V_INFO		1U	/* also progress information */
+#define V_TABLES	2U	/* also detailed tables */
+
+/*
+ * Rule saying when to run the option ROMs for PCI devices with a given
+ * PCI id., or with a given class (& maybe subclass).
+ */
+typedef struct {
+	bool class_p;		/* whether to match class_if, not pci_id */
+	uint32_t mask, val;	/* match if (id. or class) & mask == val */
+	unsigned policy;	/* RIMG_... */
+} conf_rom_rule_t;
+
+typedef struct {
+	/* Seconds to wait before exiting UEFI. */
+	unsigned delay_secs;
+	/* Whether a keypress will end the above wait early. */
+	bool skip_delay_on_key;
+	/* Verbosity level. */
+	unsigned verbosity;
+	/* Path names to try to load stage 2 from, in order. */
+	unsigned num_stage2_paths;
+	CONST CHAR16 *stage2_paths[MAX_STAGE2_PATHS];
+	/* Path name to write the boot log to, or NULL. */
+	CONST CHAR16 *log_path;
+	/* Whether to keep a cache of option ROM images on the boot volume. */
+	bool rom_cache;
+	/* Option ROM policy rules, in order. */
+	unsigned num_rom_rules;
+	conf_rom_rule_t rom_rules[MAX_ROM_RULES];
+} conf_t;
+
+extern conf_t conf;
+extern void conf_init(void);
+extern unsigned conf_rom_policy(uint32_t, uint32_t);
 
 /* fv.c functions. */
 
-extern void fv_init(void);
+extern void fv_want_rimg(uint32_t, uint32_t);
 extern bool fv_find_rimg(uint32_t, uint32_t, void **, uint32_t *);
 extern void fv_fini(void);
 
+/* log.c functions. */
+
+extern void say(unsigned, IN CONST CHAR16 *, ...);
+extern void log_only(IN CONST CHAR16 *, ...);
+extern void log_flush(void);
+extern void log_fini(void);
+
+/* s2file.c functions. */
+
+extern void s2file_open(void);
+extern void s2file_read(UINT64, UINTN, void *);
+extern void s2file_close(void);
+
+/* shdw.c functions. */
+
+extern void shdw_init(EFI_PCI_IO_PROTOCOL *);
+extern void *shdw_alloc(UINTN, bool);
+extern void shdw_fini(void);
+
+/* timeline.c functions. */
+
+#define TL_NONE		(~0U)	/* dummy handle from tl_begin(, ) */
+
+extern unsigned tl_begin(uint32_t, uint32_t);
+extern void tl_end(unsigned);
+extern void tl_fini(void);
+extern void tl_resync(void);
+
 /* util.c functions. */
 
 extern __attribute__((noreturn)) void error_with_status(IN CONST CHAR16 *,
 							EFI_STATUS);
 extern __attribute__((noreturn)) void error(IN CONST CHAR16 *);
-extern void warn(IN CONST CHAR16 *);
-extern void print_guid(const EFI_GUID *);
+extern void warn(IN CONST CHAR16 *, ...);
+extern void say_guid(unsigned, const EFI_GUID *);
 extern EFI_MEMORY_DESCRIPTOR *get_mem_map(UINTN *, UINTN *, UINTN *);
+extern EFI_FILE_PROTOCOL *open_boot_vol(void);
+extern void *read_whole_file(EFI_FILE_PROTOCOL *, IN CONST CHAR16 *,
+    UINTN, UINTN *);
+extern bool write_whole_file(EFI_FILE_PROTOCOL *, IN CONST CHAR16 *,
+    const void *, UINTN);
+#define FNV1A_64_INIT	0xcbf29ce484222325ULL
+extern uint64_t fnv1a_64(uint64_t, const void *, size_t);
 extern uint8_t compute_cksum(const void *, size_t);
 extern void update_cksum(uint8_t *, size_t, uint8_t *);
 
 /* pci.h functions. */
 
+extern uint64_t rimg_find(const void *);
 extern const rimg_pcir_t *rimg_find_pcir(const void *, uint64_t);
 const uint16_t *rimg_pcir_find_dev_id_list(const rimg_pcir_t *, const void *);
 extern void process_pci(void);
@@ -87,7 +169,10 @@ extern void process_pci(void);
 
 extern void run_stage2(Elf32_Addr entry, Elf32_Addr trampoline,
 		       unsigned base_kib, uint16_t temp_ebda_seg,
-		       bparm_t *bparm);
+		       bparm_tbl_t *bparm);
+extern void run_stage2_64(Elf32_Addr entry, Elf32_Addr trampoline,
+			  unsigned base_kib, uint16_t temp_ebda_seg,
+			  bparm_tbl_t *bparm);
 
 /* Macros, inline functions, & other definitions. */
 
@@ -118,6 +203,12 @@ static inline void bvec_clear(void *bvec, UINT32 idx)
 	    : : "p" (bvec), "r" (idx) : "cc", "memory");
 }
 
+/* Say whether we should output messages at the given verbosity level. */
+static inline bool conf_verbose(unsigned level)
+{
+	return conf.verbosity >= level;
+}
+
 /*
  * Convert a paragraph-aligned real mode linear address to a real mode
  * segment value.
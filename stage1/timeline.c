@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2021 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Routines for recording a timeline of boot phases, with time stamp
+ * counter (TSC) readings.  The timeline is passed to stage 2 as a boot
+ * parameter, & stage 2 can add its own entries to it.
+ *
+ * Until tl_fini() is called, entries go into a static buffer.  tl_fini()
+ * then copies them to the boot parameter, & any later entries are written
+ * directly there.  tl_resync() follows the boot parameter when it moves.
+ */
+
+#include <string.h>
+#include "stage1/stage1.h"
+
+#define MAX_TL1_ENTS	32U	/* max. no. of entries for stage 1 */
+#define TL2_SPARE_ENTS	64U	/* no. of spare entries for stage 2 */
+
+static bdat_tl_ent_t tl1_ents[MAX_TL1_ENTS];
+static bdat_tl_ent_t *tl_ents = tl1_ents;
+static bdat_timeline_t *tl_bd = NULL;
+static uint32_t tl_num_ents = 0, tl_max_ents = MAX_TL1_ENTS;
+
+/*
+ * Start timing a boot phase.  Return a handle to pass to tl_end(...) when
+ * the phase finishes.
+ */
+unsigned tl_begin(uint32_t tag, uint32_t arg)
+{
+	bdat_tl_ent_t *ent;
+	unsigned idx = tl_num_ents;
+	if (idx >= tl_max_ents)
+		return TL_NONE;
+	ent = &tl_ents[idx];
+	ent->tag = tag;
+	ent->arg = arg;
+	ent->tsc_end = 0;
+	ent->tsc_start = rdtsc();
+	tl_num_ents = idx + 1;
+	if (tl_bd)
+		tl_bd->num_ents = tl_num_ents;
+	return idx;
+}
+
+/* Finish timing a boot phase. */
+void tl_end(unsigned idx)
+{
+	uint64_t tsc = rdtsc();
+	if (idx < tl_num_ents)
+		tl_ents[idx].tsc_end = tsc;
+}
+
+/* Gauge the rate at which the time stamp counter ticks. */
+static uint32_t tl_tsc_khz(void)
+{
+	uint64_t tsc0, tsc1;
+	tsc0 = rdtsc();
+	if (EFI_ERROR(BS->Stall(1000)))
+		return 0;
+	tsc1 = rdtsc();
+	if (tsc1 - tsc0 > UINT32_MAX)
+		return 0;
+	return (uint32_t)(tsc1 - tsc0);
+}
+
+/*
+ * Add a boot parameter for the timeline, & move the timeline entries so
+ * far into it.  This must be called before bmem_fini(...).
+ */
+void tl_fini(void)
+{
+	uint32_t max_ents = tl_num_ents + TL2_SPARE_ENTS;
+	bdat_timeline_t *bd = bparm_add(BP_TIML, sizeof(bdat_timeline_t) +
+					max_ents * sizeof(bdat_tl_ent_t));
+	bd->tsc_khz = tl_tsc_khz();
+	bd->num_ents = tl_num_ents;
+	bd->max_ents = max_ents;
+	memcpy(bd->ents, tl_ents, tl_num_ents * sizeof(bdat_tl_ent_t));
+	tl_ents = bd->ents;
+	tl_max_ents = max_ents;
+	tl_bd = bd;
+}
+
+/*
+ * Find the timeline again after bparm_seal() moves the boot parameters,
+ * so that later entries go to the right place.
+ */
+void tl_resync(void)
+{
+	bdat_timeline_t *bd = bparm_find(BP_TIML, NULL);
+	if (!bd)
+		return;
+	tl_ents = bd->ents;
+	tl_bd = bd;
+}
@@ -29,6 +29,7 @@
 
 #include <string.h>
 #include "stage1/stage1.h"
+#include "cksum.h"
 
 int memcmp(const void *s1, const void *s2, size_t n)
 {
@@ -43,6 +44,22 @@ int memcmp(const void *s1, const void *s2, size_t n)
 	return 0;
 }
 
+int strcmp(const char *s1, const char *s2)
+{
+	const unsigned char *p1 = (const unsigned char *)s1,
+			    *p2 = (const unsigned char *)s2;
+	unsigned char c1, c2;
+	do {
+		c1 = *p1++;
+		c2 = *p2++;
+		if (c1 < c2)
+			return -1;
+		else if (c1 > c2)
+			return +1;
+	} while (c1);
+	return 0;
+}
+
 __attribute__((noreturn)) static void wait_and_exit(void)
 {
 	Output(u"press a key to exit\r\n");
@@ -54,24 +71,35 @@ __attribute__((noreturn)) static void wait_and_exit(void)
 __attribute__((noreturn)) void
 error_with_status(IN CONST CHAR16 *msg, EFI_STATUS status)
 {
+	log_only(u"error: %s: %d\r\n", msg, (INT32)status);
+	log_flush();
 	Print(u"%Eerror: %s: %d%N\r\n", msg, (INT32)status);
 	wait_and_exit();
 }
 
 __attribute__((noreturn)) void error(IN CONST CHAR16 *msg)
 {
+	log_only(u"error: %s\r\n", msg);
+	log_flush();
 	Print(u"%Eerror: %s%N\r\n", msg);
 	wait_and_exit();
 }
 
-void warn(IN CONST CHAR16 *msg)
+void warn(IN CONST CHAR16 *fmt, ...)
 {
+	CHAR16 msg[0x100];
+	va_list ap;
+	va_start(ap, fmt);
+	VSPrint(msg, sizeof msg, fmt, ap);
+	va_end(ap);
+	log_only(u"warning: %s\r\n", msg);
+	log_flush();
 	Print(u"%Hwarning: %s%N\r\n", msg);
 }
 
-void print_guid(const EFI_GUID *p_guid)
+void say_guid(unsigned level, const EFI_GUID *p_guid)
 {
-	Print(u"%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+	say(level, u"%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x",
 	    p_guid->Data1, (UINT32)p_guid->Data2, (UINT32)p_guid->Data3,
 	    (UINT32)p_guid->Data4[0], (UINT32)p_guid->Data4[1],
 	    (UINT32)p_guid->Data4[2], (UINT32)p_guid->Data4[3],
@@ -90,13 +118,116 @@ EFI_MEMORY_DESCRIPTOR *get_mem_map(UINTN *p_num_ents, UINTN *p_map_key,
 	return descs;
 }
 
-uint8_t compute_cksum(const void *buf, size_t n)
+/* Open the root directory of the volume we were loaded from. */
+EFI_FILE_PROTOCOL *open_boot_vol(void)
+{
+	extern EFI_HANDLE LibImageHandle;
+	extern EFI_GUID gEfiLoadedImageProtocolGuid;
+	EFI_STATUS status;
+	EFI_LOADED_IMAGE_PROTOCOL *li;
+	EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *fs;
+	EFI_FILE_PROTOCOL *vol;
+	status = BS->HandleProtocol(LibImageHandle,
+	    &gEfiLoadedImageProtocolGuid, (void **)&li);
+	if (EFI_ERROR(status))
+		error_with_status(u"cannot get EFI_LOADED_IMAGE_PROTOCOL",
+		    status);
+	status = BS->HandleProtocol(li->DeviceHandle,
+	    &gEfiSimpleFileSystemProtocolGuid, (void **)&fs);
+	if (EFI_ERROR(status))
+		error_with_status(u"cannot get "
+		    "EFI_SIMPLE_FILE_SYSTEM_PROTOCOL", status);
+	status = fs->OpenVolume(fs, &vol);
+	if (EFI_ERROR(status))
+		error_with_status(u"cannot get EFI_FILE_PROTOCOL", status);
+	return vol;
+}
+
+/*
+ * Read a whole (smallish) file into a newly allocated pool buffer, & add a
+ * terminating zero byte after the file contents.  Return NULL if the file
+ * does not exist or is over `max_sz' bytes long.  The caller should
+ * FreePool(...) the buffer when done.
+ */
+void *read_whole_file(EFI_FILE_PROTOCOL *vol, IN CONST CHAR16 *name,
+    UINTN max_sz, UINTN *p_sz)
+{
+	EFI_FILE_PROTOCOL *file;
+	EFI_FILE_INFO *info;
+	EFI_STATUS status;
+	UINTN sz, read_sz;
+	char *buf;
+	status = vol->Open(vol, &file, (CHAR16 *)name, EFI_FILE_MODE_READ, 0);
+	if (EFI_ERROR(status))
+		return NULL;
+	info = LibFileInfo(file);
+	if (!info) {
+		file->Close(file);
+		return NULL;
+	}
+	sz = info->FileSize;
+	FreePool(info);
+	if (sz > max_sz) {
+		file->Close(file);
+		warn(u"%s too large; ignoring", name);
+		return NULL;
+	}
+	buf = AllocatePool(sz + 1);
+	if (!buf)
+		error(u"no mem. to read file!");
+	read_sz = sz;
+	status = file->Read(file, &read_sz, buf);
+	file->Close(file);
+	if (EFI_ERROR(status) || read_sz != sz) {
+		FreePool(buf);
+		warn(u"cannot read %s; ignoring", name);
+		return NULL;
+	}
+	buf[sz] = 0;
+	if (p_sz)
+		*p_sz = sz;
+	return buf;
+}
+
+/*
+ * Write `sz' bytes at `buf' out to a file, replacing any old file of the
+ * same name.  Return true if all went well.
+ */
+bool write_whole_file(EFI_FILE_PROTOCOL *vol, IN CONST CHAR16 *name,
+    const void *buf, UINTN sz)
+{
+	EFI_FILE_PROTOCOL *file;
+	EFI_STATUS status;
+	UINTN write_sz = sz;
+	/* Delete any old file first, so that it is not left over-long. */
+	status = vol->Open(vol, &file, (CHAR16 *)name,
+	    EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
+	if (!EFI_ERROR(status))
+		file->Delete(file);
+	status = vol->Open(vol, &file, (CHAR16 *)name,
+	    EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE,
+	    0);
+	if (EFI_ERROR(status))
+		return false;
+	status = file->Write(file, &write_sz, (void *)buf);
+	file->Close(file);
+	return !EFI_ERROR(status) && write_sz == sz;
+}
+
+/* Fold `n' bytes at `buf' into a running 64-bit FNV-1a hash value. */
+uint64_t fnv1a_64(uint64_t hash, const void *buf, size_t n)
 {
 	const uint8_t *p = (const uint8_t *)buf;
-	uint8_t cksum = 0;
-	while (n-- != 0)
-		cksum -= *p++;
-	return cksum;
+	while (n-- != 0) {
+		hash ^= *p++;
+		hash *= 0x00000100000001b3ULL;
+	}
+	return hash;
+}
+
+uint8_t compute_cksum(const void *buf, size_t n)
+{
+	return (uint8_t)-cksum_sum_bytes(buf, n);
 }
 
 void update_cksum(uint8_t *buf, size_t n, uint8_t *p_cksum)
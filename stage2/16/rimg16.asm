@@ -0,0 +1,109 @@
+; Copyright (c) 2021 TK Chia
+;
+; Redistribution and use in source and binary forms, with or without
+; modification, are permitted provided that the following conditions are
+; met:
+;
+;   * Redistributions of source code must retain the above copyright
+;     notice, this list of conditions and the following disclaimer.
+;   * Redistributions in binary form must reproduce the above copyright
+;     notice, this list of conditions and the following disclaimer in the
+;     documentation and/or other materials provided with the distribution.
+;   * Neither the name of the developer(s) nor the names of its
+;     contributors may be used to endorse or promote products derived from
+;     this software without specific prior written permission.
+;
+; THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+; IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+; TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+; PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+; HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+; SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+; TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+; PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+; LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+; NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+; SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+%include "stage2/stage2.inc"
+
+	bits	16
+
+	section	.text
+
+	extern	u8_to_hex
+
+; Thunk for calling an option ROM's init. code at [rimg_wd_callee], with
+; interrupts enabled so that the watchdog (below) can run.  On entry eax,
+; ebx, ecx, & edx hold the parameters to pass to the ROM.
+	global	rimg_call16
+rimg_call16:
+	push	ds
+	sti
+	call	far word [rimg_wd_callee]
+	cli
+	pop	ds
+	mov	word [rimg_wd_ticks], 0	; disarm the watchdog
+	retf
+
+; Handler for int 0x1c (user timer tick).  While [rimg_wd_ticks] is non-
+; zero, count it down; if it reaches zero, the option ROM being run has
+; hung, so say so & halt.
+	global	isr16_0x1c
+isr16_0x1c:
+	push	ds
+	push	ax
+	xor	ax, ax
+	mov	ds, ax
+	mov	ds, [bda.ebda]
+	cmp	word [rimg_wd_ticks], 0
+	jz	.done
+	dec	word [rimg_wd_ticks]
+	jz	.hung
+.done:
+	pop	ax
+	pop	ds
+	iret
+.hung:
+	mov	al, [rimg_wd_locn+1]	; plug in the PCI bus, device, &
+	call	u8_to_hex		; function no.
+	mov	[msg_hung.bus], ax
+	mov	al, [rimg_wd_locn]
+	shr	al, 3
+	call	u8_to_hex
+	mov	[msg_hung.dev], ax
+	mov	al, [rimg_wd_locn]
+	and	al, 7
+	add	al, '0'
+	mov	[msg_hung.fn], al
+	mov	ax, 0xb800		; write the message straight to the
+	mov	es, ax			; top line of the text screen --- the
+	xor	di, di			; ROM may be stuck inside int 0x10
+	mov	si, msg_hung
+	mov	cx, msg_hung.end-msg_hung
+	mov	ah, 0x4f
+	cld
+.show:	lodsb
+	stosw
+	loop	.show
+	cli
+.halt:	hlt
+	jmp	.halt
+
+	section	.data
+
+	global	rimg_wd_callee, rimg_wd_ticks, rimg_wd_locn
+	align	4
+rimg_wd_callee:				; option ROM entry point
+	dd	0
+rimg_wd_ticks:				; timer ticks left before the
+	dw	0			; watchdog fires; 0 if disarmed
+rimg_wd_locn:				; PCI bus & device/function no.
+	dw	0
+
+msg_hung:
+	db	"stage2 panic: option ROM for PCI "
+.bus:	db	"00:"
+.dev:	db	"00."
+.fn:	db	"0 never returned"
+.end:
@@ -104,7 +104,7 @@ irq%2:
 NUM_VECS16 equ	($-vecs16)/2
 %endmacro
 
-	extern	irq0, isr16_0x1a
+	extern	irq0, isr16_0x1a, isr16_0x1c
 
 	ISR_UNIMPL 0x00
 	ISR_IRET 0x01
@@ -134,7 +134,7 @@ NUM_VECS16 equ	($-vecs16)/2
 	ISR_UNIMPL 0x19
 	ISR_IMPL 0x1a
 	ISR_IRET 0x1b
-	ISR_IRET 0x1c
+	ISR_IMPL 0x1c
 	ISR_END
 
 	section	.text
@@ -195,6 +195,7 @@ isr16_unimpl:
 
 ; Convert an 8-bit binary value in al, to its hexadecimal representation in
 ; ASCII in al:ah.
+	global	u8_to_hex
 u8_to_hex:
 	mov	ah, al
 	shr	al, 4
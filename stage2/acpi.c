@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2021 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "acpi.h"
+#include "common.h"
+#include "stage2/stage2.h"
+
+/*
+ * ACPI system description tables stay mapped into virtual memory for as
+ * long as stage 2 runs.  Each table is reached through a window: a long
+ * lived mapping of the whole ACPI reclaimable or ACPI NVS memory range
+ * holding it, or --- if the table lies elsewhere --- of just the table.
+ * Firmware usually packs its tables into one or two such ranges, so a few
+ * windows cover them all.
+ *
+ * acpi_init(.) then indexes the tables by signature, in a small hash table,
+ * so that looking up a table later needs no page table changes.
+ */
+#define ACPI_MAX_WINS	16U		/* max. no. of windows */
+#define ACPI_WIN_MAX	0x1000000ULL	/* max. size of an ACPI memory range
+					   to map in one go */
+
+typedef struct {
+	uint64_t start, end;		/* physical address range */
+	char *va;			/* virtual address of start */
+} acpi_win_t;
+
+typedef struct {
+	uint32_t sig;			/* signature; 0 if slot unused */
+	acpi_header_t *tab;		/* mapped table */
+} acpi_idx_ent_t;
+
+static acpi_win_t wins[ACPI_MAX_WINS];
+static unsigned num_wins = 0;
+static acpi_idx_ent_t *idx = NULL;
+static uint32_t idx_mask = 0;
+
+/* Find a window covering the `sz' bytes at `pa', or return NULL if none. */
+static acpi_win_t *acpi_find_win(uint64_t pa, size_t sz)
+{
+	acpi_win_t *win;
+	unsigned i;
+	for (i = 0; i < num_wins; ++i) {
+		win = &wins[i];
+		if (pa >= win->start && pa + sz <= win->end)
+			return win;
+	}
+	return NULL;
+}
+
+/*
+ * Open a new window over the `sz' bytes of ACPI data at `pa'.  If the data
+ * are in an ACPI memory range of a sane size, map the whole range;
+ * otherwise map just the data.
+ */
+static acpi_win_t *acpi_new_win(uint64_t pa, size_t sz)
+{
+	uint64_t start = pa, end = pa + sz;
+	const mem_range_t *mr = mem_range_at(pa);
+	acpi_win_t *win;
+	if (num_wins == ACPI_MAX_WINS)
+		hlt();
+	if (mr && (mr->e820_type == E820_ACPI || mr->e820_type == E820_NVS) &&
+	    mr->len <= ACPI_WIN_MAX && end <= mr->start + mr->len) {
+		start = mr->start;
+		end = mr->start + mr->len;
+	}
+	win = &wins[num_wins++];
+	win->start = start;
+	win->end = end;
+	win->va = mem_va_map(start, (size_t)(end - start), 0);
+	return win;
+}
+
+/*
+ * Make a window which was just opened reach up to `end', by mapping it
+ * anew.  Nothing else should be pointing into the window yet.
+ */
+static void acpi_grow_win(acpi_win_t *win, uint64_t end)
+{
+	mem_va_unmap(win->va, (size_t)(win->end - win->start));
+	win->end = end;
+	win->va = mem_va_map(win->start, (size_t)(end - win->start), 0);
+}
+
+static void *acpi_win_va(const acpi_win_t *win, uint64_t pa)
+{
+	return win->va + (size_t)(pa - win->start);
+}
+
+/* Return a virtual address for `sz' bytes of ACPI data at `pa'. */
+static void *acpi_map(uint64_t pa, size_t sz)
+{
+	acpi_win_t *win = acpi_find_win(pa, sz);
+	if (!win)
+		win = acpi_new_win(pa, sz);
+	return acpi_win_va(win, pa);
+}
+
+/*
+ * Map an entire ACPI system description table.  If no window covers its
+ * header yet, open one over the header, & grow it to fit the table.  If a
+ * window covers the header but not the whole table, open a window for the
+ * table.
+ */
+static acpi_header_t *acpi_map_tab(uint64_t pa)
+{
+	acpi_win_t *win = acpi_find_win(pa, sizeof(acpi_header_t));
+	uint32_t len;
+	if (win) {
+		len = ((acpi_header_t *)acpi_win_va(win, pa))->length;
+		if (len > win->end - pa)
+			win = acpi_new_win(pa, len);
+	} else {
+		win = acpi_new_win(pa, sizeof(acpi_header_t));
+		len = ((acpi_header_t *)acpi_win_va(win, pa))->length;
+		if (len > win->end - pa)
+			acpi_grow_win(win, pa + len);
+	}
+	return acpi_win_va(win, pa);
+}
+
+static uint32_t acpi_sig32(const char *sig)
+{
+	uint32_t v;
+	memcpy(&v, sig, sizeof v);
+	return v;
+}
+
+static uint32_t acpi_hash(uint32_t sig)
+{
+	return (sig * 0x9e3779b1UL) >> 16;
+}
+
+static void acpi_idx_add(acpi_header_t *tab)
+{
+	uint32_t sig = acpi_sig32(tab->signature), i = acpi_hash(sig);
+	while (idx[i & idx_mask].sig)
+		++i;
+	idx[i & idx_mask].sig = sig;
+	idx[i & idx_mask].tab = tab;
+}
+
+/*
+ * Map the ACPI tables listed in the XSDT, & index them by signature.  Also
+ * index the DSDT, which the FADT points to.  Return the no. of tables
+ * indexed.
+ */
+unsigned acpi_init(const bparm_tbl_t *bparms)
+{
+	static const char expect_rsdp_sig[8] = "RSD PTR ";
+	bdat_rsdp_t *bd_rsdp;
+	acpi_xsdp_t *rsdp;
+	acpi_xsdt_t *xsdt;
+	size_t num_tabs, i;
+	uint32_t idx_sz;
+	unsigned n = 0;
+	/* Find the ACPI RSDP from the boot parameters, & the XSDT from it. */
+	bd_rsdp = bparm_tbl_find(bparms, BP_RSDP, NULL);
+	if (!bd_rsdp)
+		hlt();
+	rsdp = acpi_map(ptr64_to_pa(bd_rsdp->rsdp_phy_addr), bd_rsdp->rsdp_sz);
+	if (memcmp(rsdp->signature, expect_rsdp_sig, 8) != 0)
+		hlt();
+	xsdt = (acpi_xsdt_t *)acpi_map_tab(rsdp->xsdt);
+	num_tabs = (xsdt->header.length - sizeof(acpi_header_t))
+		   / sizeof(uint64_t);
+	/*
+	 * Size the index to at most half full, counting the XSDT & the DSDT
+	 * too.
+	 */
+	idx_sz = 4;
+	while (idx_sz < 2 * (num_tabs + 2))
+		idx_sz *= 2;
+	idx = mem_slab_alloc(idx_sz * sizeof(acpi_idx_ent_t));
+	idx_mask = idx_sz - 1;
+	for (i = 0; i < idx_sz; ++i)
+		idx[i].sig = 0;
+	acpi_idx_add(&xsdt->header);
+	++n;
+	for (i = 0; i < num_tabs; ++i) {
+		acpi_header_t *tab = acpi_map_tab(xsdt->tables[i]);
+		acpi_idx_add(tab);
+		++n;
+		if (memcmp(tab->signature, "FACP", 4) == 0 &&
+		    ((acpi_fadt_t *)tab)->dsdt) {
+			acpi_idx_add(acpi_map_tab(((acpi_fadt_t *)tab)->dsdt));
+			++n;
+		}
+	}
+	return n;
+}
+
+/*
+ * Find the `which'th ACPI table (counting from 0) with the signature `sig'
+ * --- e.g. "APIC", "FACP", "HPET", "MCFG", or "SSDT".  Return its virtual
+ * address, or NULL if there is no such table.
+ */
+void *acpi_find(const char *sig, unsigned which)
+{
+	uint32_t sig32 = acpi_sig32(sig), i = acpi_hash(sig32);
+	if (!idx)
+		return NULL;
+	for (; idx[i & idx_mask].sig; ++i) {
+		if (idx[i & idx_mask].sig == sig32 && which-- == 0)
+			return idx[i & idx_mask].tab;
+	}
+	return NULL;
+}
@@ -0,0 +1,62 @@
+; Copyright (c) 2021 TK Chia
+;
+; Redistribution and use in source and binary forms, with or without
+; modification, are permitted provided that the following conditions are
+; met:
+;
+;   * Redistributions of source code must retain the above copyright
+;     notice, this list of conditions and the following disclaimer.
+;   * Redistributions in binary form must reproduce the above copyright
+;     notice, this list of conditions and the following disclaimer in the
+;     documentation and/or other materials provided with the distribution.
+;   * Neither the name of the developer(s) nor the names of its
+;     contributors may be used to endorse or promote products derived from
+;     this software without specific prior written permission.
+;
+; THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+; IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+; TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+; PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+; HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+; SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+; TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+; PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+; LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+; NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+; SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+; clib.asm ported to the SysV x86-64 calling convention.
+
+%include "stage2/stage2.inc"
+
+	bits	64
+
+	section	.text
+
+	global	memcpy
+	global	memmove
+memcpy:
+memmove:
+	mov	rax, rdi
+	mov	rcx, rdx
+	cmp	rdi, rsi
+	ja	.backward
+	je	.done
+	shr	rcx, 3
+	rep movsq
+.finish:
+	mov	ecx, edx
+	and	ecx, byte 7
+	rep movsb
+	cld
+.done:
+	ret
+.backward:
+	lea	rdi, [rdi+rcx-8]
+	lea	rsi, [rsi+rcx-8]
+	shr	rcx, 3
+	std
+	rep movsq
+	add	rdi, byte 7
+	add	rsi, byte 7
+	jmp	short .finish
@@ -94,35 +94,6 @@ typedef volatile struct __attribute__((packed)) {
 /* Field values for I/O APIC redirection table entries. */
 #define IOAPIC_RTLO_MASKED 0x00010000U	/* whether interrupt is masked */
 
-/*
- * Map an entire ACPI system description table from physical memory into
- * virtual memory.
- */
-static acpi_table_union_t *acpi_map_tab(ptr64_t tab64)
-{
-	size_t sz;
-	acpi_table_union_t *tab;
-	tab = mem_va_map(tab64, sizeof(acpi_table_union_t), 0);
-	sz = tab->header.length;
-	if (sz > sizeof(acpi_table_union_t)) {
-		mem_va_unmap(tab, sizeof(acpi_table_union_t));
-		tab = mem_va_map(tab64, sz, 0);
-	}
-	return tab;
-}
-
-/*
- * Unmap an ACPI system description table previously mapped with
- * acpi_map_tab(.).
- */
-static void acpi_unmap_tab(acpi_table_union_t *tab)
-{
-	size_t sz = tab->header.length;
-	if (sz < sizeof(acpi_table_union_t))
-		sz = sizeof(acpi_table_union_t);
-	mem_va_unmap(tab, sz);
-}
-
 static void acpi_process_madt(acpi_madt_t *madt)
 {
 	char *madt_end, *ic;
@@ -161,46 +132,18 @@ static void acpi_process_madt(acpi_madt_t *madt)
 	}
 }
 
-static void acpi_process_xsdt(acpi_xsdt_t *xsdt)
-{
-	static const char madt_sig[4] = "APIC";
-	size_t xsdt_sz, num_tabs, i;
-	xsdt_sz = xsdt->header.length;
-	num_tabs = (xsdt_sz - sizeof(acpi_header_t)) / sizeof(uint64_t);
-	for (i = 0; i < num_tabs; ++i) {
-		acpi_table_union_t *tab = acpi_map_tab(xsdt->tables[i]);
-		if (memcmp(tab->header.signature, madt_sig, 4) == 0)
-			acpi_process_madt(&tab->madt);
-		acpi_unmap_tab(tab);
-	}
-}
-
-static void acpi_process_rsdp(acpi_xsdp_t *rsdp)
+void irq_init(void)
 {
-	const char expect_rsdp_sig[8] = "RSD PTR ";
-	acpi_table_union_t *xsdt;
-	if (memcmp(rsdp->signature, expect_rsdp_sig, 8) != 0)
-		hlt();
-	xsdt = acpi_map_tab(rsdp->xsdt);
-	acpi_process_xsdt(&xsdt->xsdt);
-	acpi_unmap_tab(xsdt);
-}
-
-void irq_init(bparm_t *bparms)
-{
-	/* Find the ACPI RSDP from the boot parameters. */
-	bdat_rsdp_t *bd_rsdp;
-	acpi_xsdp_t *rsdp;
-	uint32_t rsdp_sz;
-	bparm_t *bp = bparms;
-	while (bp->type != BP_RSDP)
-		bp = bp->next;
-	bd_rsdp = &bp->u->rsdp;
-	rsdp_sz = bd_rsdp->rsdp_sz;
-	rsdp = mem_va_map(bd_rsdp->rsdp_phy_addr, rsdp_sz, 0);
-	/* Process the RSDP to disable APIC interrupts. */
-	acpi_process_rsdp(rsdp);
-	mem_va_unmap(rsdp, rsdp_sz);
+	acpi_madt_t *madt;
+	unsigned i;
+	/*
+	 * Process the MADT(s) to disable APIC interrupts.  Batch up the TLB
+	 * invalidations for the I/O APIC mappings & unmappings.
+	 */
+	mem_va_begin();
+	for (i = 0; (madt = acpi_find("APIC", i)) != NULL; ++i)
+		acpi_process_madt(madt);
+	mem_va_commit();
 	/*
 	 * Bring up the legacy 8259 interrupt controllers.
 	 *
@@ -33,47 +33,44 @@
 #include <string.h>
 #include "stage2/stage2.h"
 
-static void rimg_init(bparm_t *bparms, bool init_vga)
-{
-	bparm_t *bp;
-	for (bp = bparms; bp; bp = bp->next) {
-		uint16_t rimg_seg;
-		bdat_pci_dev_t *pd;
-		bool do_init;
-		if (bp->type != BP_PCID)
-			continue;
-		pd = &bp->u->pci_dev;
-		switch (pd->class_if & 0xffff0000UL) {
-		    case 0x03000000:  /* VGA */
-		    case 0x03010000:  /* XGA */
-			do_init = init_vga;
-			break;
-		    default:
-			do_init = !init_vga;
-		}
-		if (!do_init)
-			continue;
-		rimg_seg = pd->rimg_seg;
-		if (!rimg_seg)
-			continue;
-		rm16_call(pd->pci_locn, 0, 0, pd->rimg_rt_seg,
-		    MK_FP16(rimg_seg, 0x0003));
-	}
-}
-
 static void hello(void)
 {
 	extern void hello16(void);
 	rm16_call(0, 0, 0, 0, MK_FP16(rm16_cs, (uint16_t)(uintptr_t)hello16));
 }
 
-void stage2_main(bparm_t *bparms, void *rm16_load, size_t rm16_sz)
+void stage2_main(bparm_tbl_t *bparms, void *rm16_load, size_t rm16_sz)
 {
-	mem_init(bparms);
+	unsigned tl;
+	tl_init(bparms);
+	tl = tl_begin(TL_MEM, 0);
+	bparms = mem_init(bparms);
+	tl_init(bparms);
+	tl_end(tl);
+	tl = tl_begin(TL_RM16, 0);
 	rm16_init();
-	irq_init(bparms);
-	rimg_init(bparms, true);
+	tl_end(tl);
+	tl = tl_begin(TL_ATAB, 0);
+	tl_set_arg(tl, acpi_init(bparms));
+	tl_end(tl);
+	tl = tl_begin(TL_IRQ, 0);
+	irq_init();
+	tl_set_arg(tl, mem_va_flushes_avoided());
+	tl_end(tl);
+	shdw_init(bparms);
+	tl = tl_begin(TL_VROM, 0);
+	tl_set_arg(tl, rimg_init(bparms, true));
+	tl_end(tl);
+	tl = tl_begin(TL_OROM, 0);
+	tl_set_arg(tl, rimg_init(bparms, false));
+	tl_end(tl);
+	/*
+	 * The ROMs to be run during boot are done: lock their shadow RAM, &
+	 * free up stage 1's boot-time data, save for what any deferred ROMs
+	 * still need.
+	 */
+	shdw_lock();
+	rimg_fini();
 	hello();
-	rimg_init(bparms, false);
 	hlt();
 }
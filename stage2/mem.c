@@ -36,124 +36,362 @@
 #define EFI_MEMORY_WT	(1ULL <<  2)
 #define EFI_MEMORY_WB	(1ULL <<  3)
 
+#ifndef __x86_64__
 /* Structure for a range of (unused) 32-bit virtual addresses. */
 typedef struct {
 	uint32_t start, len;
 } va_range_t;
+#endif
 
-static unsigned num_mem_ranges = 0, max_mem_ranges = 0,
-		num_unused_va_ranges = 0, max_unused_va_ranges = 0;
-static mem_range_t *mem_ranges;
+/*
+ * The physical memory map is kept as a skip list of memory ranges, sorted
+ * by starting address, so that looking up, splitting, & merging ranges
+ * each take O(log n) expected time.  The bottom level is also linked
+ * backwards, so that we can walk the map in either direction.
+ *
+ * List nodes come from a pool.  Whenever the pool runs low, mem_alloc(, , )
+ * & mem_free(, ) top it up with another page of nodes before touching the
+ * map, so the map has no fixed capacity.
+ */
+#define MEM_SL_LVLS	8U	/* max. no. of skip list levels */
+#define MEM_POOL_LOW	4U	/* top up node pool when down to this */
+
+/*
+ * Pages for our own use --- page tables, skip list nodes, & slabs of small
+ * objects --- are handed out from arenas, each reserved in one go, rather
+ * than carved out of the memory map one page at a time.  Freed pages go on
+ * a free list for reuse.
+ *
+ * Small objects (up to MEM_SLAB_MAX bytes) come from slabs, one page per
+ * slab, with one free list per power-of-2 size class.  An object is
+ * aligned to its size class.
+ */
+#define MEM_ARENA_PAGES	16U	/* no. of pages in each new arena */
+#define MEM_SLAB_MIN	16U	/* smallest slab object size */
+#define MEM_SLAB_CLASSES 8U	/* no. of slab size classes */
+#define MEM_SLAB_MAX	(MEM_SLAB_MIN << (MEM_SLAB_CLASSES - 1))
+
+/*
+ * After mem_va_map(, , ) or mem_va_unmap(, ), invalidate the TLB entries
+ * for at most this many pages one by one with invlpg; beyond this, just
+ * flush the whole TLB.
+ */
+#define MEM_INVLPG_MAX	32U
+
+typedef struct mem_free_obj {
+	struct mem_free_obj *next;
+} mem_free_obj_t;
+
+typedef struct mem_node {
+	mem_range_t mr;
+	struct mem_node *prev;	/* previous node at level 0, or &mem_head */
+	struct mem_node *next[MEM_SL_LVLS];
+} mem_node_t;
+
+static unsigned num_mem_ranges = 0, num_free_nodes = 0;
+/* Skip list head; mem_head.next[0] is the lowest memory range. */
+static mem_node_t mem_head;
+static mem_node_t *free_nodes = NULL;
+static bool topping_up = false;
+static uint32_t sl_seed = 0x2545f491UL;
+/* Unused part of the current page arena, & free pages. */
+static uintptr_t arena_next = 0, arena_end = 0;
+static mem_free_obj_t *free_pages = NULL;
+static mem_free_obj_t *free_objs[MEM_SLAB_CLASSES];
+#ifndef __x86_64__
+static unsigned num_unused_va_ranges = 0, max_unused_va_ranges = 0;
 static va_range_t *unused_va_ranges;
 static uint64_t *pdpt = NULL;
+#else
+/*
+ * Top-level paging structure (PML4), end of the direct map of physical
+ * memory, & PAE PDPT for use by rm16_call(...) (see va_init()).
+ */
+static uint64_t *pml4 = NULL, *pae_pdpt = NULL;
+static uint64_t va_top = 0;
+uint32_t mem_cr3_pae = 0;
+#endif
+/*
+ * Nesting depth of mem_va_begin() ... mem_va_commit() batches, the span
+ * of virtual addresses unmapped in the current batch, whose TLB entries
+ * are yet to be invalidated (empty if va_pend_end == 0), & the no. of
+ * unmappings in this span.
+ */
+static unsigned va_batch_depth = 0;
+static uint64_t va_pend_start = 0, va_pend_end = 0;
+static unsigned va_pend_cnt = 0;
+/*
+ * PTs which are no longer in use, but which the processor may still walk
+ * until the TLB is next invalidated.
+ */
+static mem_free_obj_t *pend_pts = NULL;
+/* No. of full TLB flushes avoided. */
+static unsigned num_flushes_avoided = 0;
+/*
+ * End of the base memory area at address 0 holding stage 1's boot-time
+ * data.  This stays reserved until mem_reclaim_boottime() is called.
+ */
+static uint32_t boottime_bmem_bot = 0;
 
-static void shellsort(mem_range_t *mrs, unsigned nmr)
+/* Allocate one page from the page arena, reserving a new arena if needed. */
+static void *pg_alloc(void)
 {
-	/* See Sedgewick 1996 (https://www.cs.princeton.edu/~rs/shell/). */
-	unsigned h = 1, i, j;
-	if (nmr < 2)
+	mem_free_obj_t *pg = free_pages;
+	if (pg) {
+		free_pages = pg->next;
+		return pg;
+	}
+	if (arena_next == arena_end) {
+		arena_next = (uintptr_t)mem_alloc(MEM_ARENA_PAGES * PAGE_SIZE,
+						  PAGE_SIZE, 0);
+		arena_end = arena_next + MEM_ARENA_PAGES * PAGE_SIZE;
+	}
+	arena_next += PAGE_SIZE;
+	return (void *)(arena_next - PAGE_SIZE);
+}
+
+/* Return a page obtained from pg_alloc() to the page arena. */
+static void pg_free(void *p)
+{
+	mem_free_obj_t *pg = p;
+	pg->next = free_pages;
+	free_pages = pg;
+}
+
+/*
+ * Drop a PT which is no longer in use.  It only goes back to the page
+ * arena once the TLB has been invalidated (see va_inval(, )).
+ */
+static void pt_free(uint64_t *pt)
+{
+	mem_free_obj_t *pg = (mem_free_obj_t *)pt;
+	pg->next = pend_pts;
+	pend_pts = pg;
+}
+
+/* Return the PTs dropped by pt_free(.) to the page arena. */
+static void pt_release(void)
+{
+	mem_free_obj_t *pg;
+	while ((pg = pend_pts) != NULL) {
+		pend_pts = pg->next;
+		pg_free(pg);
+	}
+}
+
+static void pool_add(mem_node_t *nodes, unsigned n)
+{
+	while (n-- != 0) {
+		nodes[n].next[0] = free_nodes;
+		free_nodes = &nodes[n];
+		++num_free_nodes;
+	}
+}
+
+static mem_node_t *node_alloc(void)
+{
+	mem_node_t *node = free_nodes;
+	if (!node)
+		hlt();
+	free_nodes = node->next[0];
+	--num_free_nodes;
+	return node;
+}
+
+static void node_free(mem_node_t *node)
+{
+	node->next[0] = free_nodes;
+	free_nodes = node;
+	++num_free_nodes;
+}
+
+/*
+ * Make sure there are enough free nodes for one allocation or free.  This
+ * should only be called when no map update is under way.
+ */
+static void pool_top_up(void)
+{
+	if (num_free_nodes >= MEM_POOL_LOW || topping_up)
 		return;
-	while (h < nmr)
-		h *= 2;
-	--h;
-	do {
-		for (i = h; i < nmr; ++i) {
-			mem_range_t v = mrs[i];
-			j = i;
-			while (j >= h && mrs[j - h].start > v.start) {
-				mrs[j] = mrs[j - h];
-				j -= h;
-			}
-			mrs[j] = v;
-		}
-		h >>= 1;
-	} while (h);
+	topping_up = true;
+	pool_add(pg_alloc(), PAGE_SIZE / sizeof(mem_node_t));
+	topping_up = false;
 }
 
-static mem_range_t *find_highest_range_below(uint64_t max_addr)
+/* Pick a random level count for a new node: 1 + geometric (p = 1/4). */
+static unsigned sl_rand_lvls(void)
 {
-	unsigned left = 0, right = num_mem_ranges;
-	mem_range_t *mr;
-	while (left < right - 1) {
-		unsigned mid = (left + right) / 2;
-		mr = &mem_ranges[mid];
-		if (mr->start + mr->len - 1 > max_addr - 1)
-			right = mid;
-		else
-			left = mid;
+	uint32_t x = sl_seed;
+	unsigned lvls = 1;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	sl_seed = x;
+	while (lvls < MEM_SL_LVLS && (x & 3) == 0) {
+		++lvls;
+		x >>= 2;
 	}
-	mr = &mem_ranges[left];
-	while (mr->start + mr->len - 1 > max_addr - 1) {
-		if (!left)
-			hlt();
-		--mr;
-		--left;
+	return lvls;
+}
+
+/*
+ * Find the last node whose range starts below `start', or &mem_head if
+ * none.  If `update' is not NULL, also note the last such node at each
+ * level.
+ */
+static mem_node_t *sl_find_before(uint64_t start, mem_node_t **update)
+{
+	mem_node_t *x = &mem_head;
+	unsigned lvl = MEM_SL_LVLS;
+	while (lvl-- != 0) {
+		while (x->next[lvl] && x->next[lvl]->mr.start < start)
+			x = x->next[lvl];
+		if (update)
+			update[lvl] = x;
 	}
-	return mr;
+	return x;
 }
 
-static void split_range(mem_range_t *mr, uint64_t split_point,
+static void sl_insert(mem_node_t *node)
+{
+	mem_node_t *update[MEM_SL_LVLS];
+	unsigned lvls = sl_rand_lvls(), lvl;
+	sl_find_before(node->mr.start, update);
+	for (lvl = 0; lvl < MEM_SL_LVLS; ++lvl) {
+		if (lvl < lvls) {
+			node->next[lvl] = update[lvl]->next[lvl];
+			update[lvl]->next[lvl] = node;
+		} else
+			node->next[lvl] = NULL;
+	}
+	node->prev = update[0];
+	if (node->next[0])
+		node->next[0]->prev = node;
+	++num_mem_ranges;
+}
+
+static void sl_remove(mem_node_t *node)
+{
+	mem_node_t *update[MEM_SL_LVLS], *x;
+	unsigned lvl;
+	sl_find_before(node->mr.start, update);
+	for (lvl = 0; lvl < MEM_SL_LVLS; ++lvl) {
+		/* Step past any other ranges with the same start. */
+		x = update[lvl];
+		while (x->next[lvl] && x->next[lvl] != node &&
+		       x->next[lvl]->mr.start == node->mr.start)
+			x = x->next[lvl];
+		if (x->next[lvl] == node)
+			x->next[lvl] = node->next[lvl];
+	}
+	if (node->next[0])
+		node->next[0]->prev = node->prev;
+	--num_mem_ranges;
+}
+
+static mem_node_t *first_range(void)
+{
+	return mem_head.next[0];
+}
+
+/* Return the range before `node', or NULL if none. */
+static mem_node_t *prev_range(mem_node_t *node)
+{
+	return node->prev == &mem_head ? NULL : node->prev;
+}
+
+static mem_node_t *find_highest_range_below(uint64_t max_addr)
+{
+	mem_node_t *x = &mem_head, *y;
+	unsigned lvl = MEM_SL_LVLS;
+	while (lvl-- != 0) {
+		while ((y = x->next[lvl]) != NULL &&
+		       y->mr.start + y->mr.len - 1 <= max_addr - 1)
+			x = y;
+	}
+	if (x == &mem_head)
+		hlt();
+	return x;
+}
+
+static void split_range(mem_node_t *node, uint64_t split_point,
     uint32_t e820_type_below, uint32_t e820_type_above)
 {
+	mem_range_t *mr = &node->mr;
 	if (mr->start == split_point)
 		mr->e820_type = e820_type_above;
 	else if (mr->start + mr->len == split_point)
 		mr->e820_type = e820_type_below;
 	else {
-		mem_range_t *mr2;
-		if (num_mem_ranges >= max_mem_ranges)
-			hlt();
-		mr2 = &mem_ranges[num_mem_ranges];
-		++num_mem_ranges;
-		/* Ugh.  Hopefully we will not need to do this too often. */
-		while (mr2 != mr) {
-			*mr2 = mr2[-1];
-			--mr2;
-		}
-		++mr2;
+		mem_node_t *node2 = node_alloc();
+		mem_range_t *mr2 = &node2->mr;
+		*mr2 = *mr;
 		mr->len = split_point - mr->start;
 		mr2->len -= mr->len;
 		mr2->start = split_point;
 		mr->e820_type = e820_type_below;
 		mr2->e820_type = e820_type_above;
+		sl_insert(node2);
 	}
 }
 
-static void mem_map_init(bparm_t *bparms)
+/*
+ * If the range at `node' & the range after it are adjacent & of the same
+ * kind, merge them into one.
+ */
+static void merge_ranges(mem_node_t *node)
+{
+	mem_node_t *node2 = node->next[0];
+	mem_range_t *mr = &node->mr, *mr2;
+	if (!node2)
+		return;
+	mr2 = &node2->mr;
+	if (mr->start + mr->len != mr2->start ||
+	    mr->e820_type != mr2->e820_type ||
+	    mr->e820_ext_attr != mr2->e820_ext_attr ||
+	    mr->uefi_attr != mr2->uefi_attr)
+		return;
+	mr->len += mr2->len;
+	sl_remove(node2);
+	node_free(node2);
+}
+
+static void mem_map_init(const bparm_tbl_t *bparms)
 {
-	unsigned nmr, mmr;
+	unsigned mmr;
+	uint32_t num_bdmrs, i;
 	size_t e820_need_space;
-	bparm_t *bp;
-	bdat_mem_range_t *bdmr, *bdmr_chosen = NULL;
-	mem_range_t *mrs, *mr;
+	bdat_mem_range_t *bdmrs, *bdmr, *bdmr_chosen = NULL;
+	bdat_bmem_t *bdbm;
+	mem_node_t *nodes, *node;
+	mem_range_t *mr;
 	/*
 	 * Copy the memory map passed in the stage 1 boot parameters to
 	 * extended memory.  First find the number of memory address ranges
-	 * given in the boot parameters, & the amount of space needed to
-	 * record these ranges.
+	 * given in the boot parameters, & the amount of space needed for an
+	 * initial pool of nodes to record these ranges.
 	 *
-	 * Also allocate some extra space for the memory map beyond the
-	 * current number of entries, to allow for some memory blocks to be
-	 * split into two later.
+	 * Also allocate some extra nodes beyond the current number of
+	 * entries, to allow for some memory blocks to be split into two
+	 * later.
 	 */
+	bdmrs = bparm_tbl_find(bparms, BP_MRNG, &num_bdmrs);
 	mmr = 1;
-	for (bp = bparms; bp; bp = bp->next)
-		if (bp->type == BP_MRNG && bp->u->mem_range.len != 0)
+	for (i = 0; i < num_bdmrs; ++i)
+		if (bdmrs[i].len != 0)
 			++mmr;
 	mmr = (3 * mmr + 1) / 2;
 	if (mmr < 16)
 		mmr = 16;
-	e820_need_space = mmr * sizeof(mem_range_t);
+	e820_need_space = mmr * sizeof(mem_node_t) + _Alignof(mem_node_t) - 1;
 	/*
-	 * Find an area of memory that can store the entire memory map & is
-	 * below the 4 GiB mark.  Try to store the memory map as high in
-	 * extended memory as possible.
+	 * Find an area of memory that can store the node pool & is below
+	 * the 4 GiB mark.  Try to store it as high in extended memory as
+	 * possible.
 	 */
-	for (bp = bparms; bp; bp = bp->next) {
+	for (i = 0; i < num_bdmrs; ++i) {
 		uint64_t start, len;
-		if (bp->type != BP_MRNG)
-			continue;
-		bdmr = &bp->u->mem_range;
+		bdmr = &bdmrs[i];
 		start = bdmr->start;
 		len = bdmr->len;
 		if (bdmr->e820_type != E820_RAM ||
@@ -166,44 +404,131 @@ static void mem_map_init(bparm_t *bparms)
 	}
 	if (!bdmr_chosen)
 		hlt();
-	/* Carve out memory for the memory map. */
-	mrs = (mem_range_t *)(uintptr_t)
-		  (bdmr_chosen->start + bdmr_chosen->len - e820_need_space);
+	/* Carve out memory for the node pool. */
+	nodes = (mem_node_t *)(uintptr_t)
+		    ((bdmr_chosen->start + bdmr_chosen->len - e820_need_space)
+		     & -(uint64_t)_Alignof(mem_node_t));
+	pool_add(nodes, mmr);
 	/* Copy out the memory map.  Discard memory ranges of length zero. */
-	mr = mrs;
-	nmr = 0;
-	for (bp = bparms; bp; bp = bp->next) {
-		if (bp->type != BP_MRNG)
-			continue;
-		bdmr = &bp->u->mem_range;
+	for (i = 0; i < num_bdmrs; ++i) {
+		bdmr = &bdmrs[i];
 		if (!bdmr->len)
 			continue;
+		node = node_alloc();
+		mr = &node->mr;
 		mr->start = bdmr->start;
 		mr->len = bdmr->len;
 		mr->e820_type = bdmr->e820_type;
 		mr->e820_ext_attr = bdmr->e820_ext_attr;
 		mr->uefi_attr = bdmr->uefi_attr;
 		if (bdmr == bdmr_chosen) {
-			mr->len -= e820_need_space;
+			mr->len = (uint64_t)(uintptr_t)nodes - mr->start;
 			if (mr->len) {
-				++mr;
-				++nmr;
+				sl_insert(node);
+				node = node_alloc();
+				mr = &node->mr;
 			}
-			mr->start = (uint64_t)(uintptr_t)mrs;
-			mr->len = e820_need_space;
+			mr->start = (uint64_t)(uintptr_t)nodes;
+			mr->len = bdmr->start + bdmr->len - mr->start;
 			mr->e820_type = E820_RESERVED;
 			mr->e820_ext_attr = bdmr->e820_ext_attr;
 			mr->uefi_attr = bdmr->uefi_attr;
 		}
-		++mr;
-		++nmr;
+		sl_insert(node);
+	}
+	/*
+	 * Keep stage 1's boot-time data in base memory --- boot parameters,
+	 * copies of option ROM images, etc. --- from being allocated over,
+	 * until we are done with it.
+	 */
+	bdbm = bparm_tbl_find(bparms, BP_BMEM, NULL);
+	if (bdbm)
+		boottime_bmem_bot = (uint32_t)bdbm->boottime_bmem_bot_seg *
+				    PARA_SIZE;
+	node = first_range();
+	mr = &node->mr;
+	if (boottime_bmem_bot && mr->start == 0 &&
+	    mr->e820_type == E820_RAM && mr->len >= boottime_bmem_bot)
+		split_range(node, boottime_bmem_bot,
+		    E820_RESERVED, E820_RAM);
+	else
+		boottime_bmem_bot = 0;
+}
+
+/*
+ * Copy the boot parameter table into extended memory, so that we do not
+ * need the copy in base memory any more.  Return the new table.
+ */
+static bparm_tbl_t *copy_bparms(const bparm_tbl_t *bparms)
+{
+	bparm_tbl_t *new_bparms = mem_slab_alloc(bparms->total_sz);
+	memcpy(new_bparms, bparms, bparms->total_sz);
+	return new_bparms;
+}
+
+/* Return the paging structure that a paging structure entry points to. */
+static uint64_t *pte_table(uint64_t e)
+{
+	return (uint64_t *)(uintptr_t)(e & PTE_ADDR_MASK);
+}
+
+/* Return a new blank paging structure. */
+static uint64_t *new_table(void)
+{
+	uint64_t *tbl = pg_alloc();
+	memset(tbl, 0, PAGE_SIZE);
+	return tbl;
+}
+
+#ifdef __x86_64__
+/*
+ * Return the PDPT covering the virtual address `va'.  If `create', make
+ * one if needed; otherwise return NULL if there is none.
+ */
+static uint64_t *find_pdpt(uint64_t va, bool create)
+{
+	uint64_t *p_pml4e = &pml4[(va >> 39) & 0x1ff];
+	if (!*p_pml4e) {
+		if (!create)
+			return NULL;
+		*p_pml4e = (uint64_t)(uintptr_t)new_table() |
+			   PTE_P | PTE_RW | PTE_US;
+	}
+	return pte_table(*p_pml4e);
+}
+#endif
+
+/*
+ * Return the PD covering the virtual address `va'.  If `create', make one
+ * if needed --- in long mode, splitting up a 1 GiB page if there is one;
+ * otherwise return NULL if there is no PD.
+ */
+static uint64_t *find_pd(uintptr_t va, bool create)
+{
+#ifndef __x86_64__
+	(void)create;
+	return pte_table(pdpt[va >> 30]);
+#else
+	uint64_t *pdpt_ = find_pdpt(va, create), *p_pdpte, pdpte, *pd;
+	unsigned i;
+	if (!pdpt_)
+		return NULL;
+	p_pdpte = &pdpt_[(va >> 30) & 0x1ff];
+	pdpte = *p_pdpte;
+	if (pdpte && (pdpte & PDE_PS) == 0)
+		return pte_table(pdpte);
+	if (!create)
+		return NULL;
+	pd = new_table();
+	if (pdpte) {
+		for (i = 0; i <= 0x1ff; ++i) {
+			pd[i] = pdpte;
+			pdpte += LARGE_PAGE_SIZE;
+		}
 	}
-	/* Sort the memory map by order of increasing ending addresses. */
-	shellsort(mrs, nmr);
-	/* Remember the memory map. */
-	mem_ranges = mrs;
-	num_mem_ranges = nmr;
-	max_mem_ranges = mmr;
+	*p_pdpte = (uint64_t)(uintptr_t)pd | PTE_P | PTE_RW | PTE_US;
+	return pd;
+#endif
 }
 
 /*
@@ -218,34 +543,79 @@ static uint64_t *ensure_pt(uint64_t *p_pde)
 	uint64_t pde = *p_pde, *pt, pte;
 	unsigned i;
 	if (pde) {
-		if ((pde & PDE_PS) == 0) {
-			pt = (uint64_t *)((uint32_t)pde & -PAGE_SIZE);
-			return pt;
-		}
-		pt = mem_alloc(PAGE_SIZE, PAGE_SIZE, 0);
+		if ((pde & PDE_PS) == 0)
+			return pte_table(pde);
+		pt = pg_alloc();
 		pte = pde & ~(uint64_t)PDE_PS;
 		for (i = 0; i <= 0x1ff; ++i) {
 			pt[i] = pte;
 			pte += PAGE_SIZE;
 		}
-	} else {
-		pt = mem_alloc(PAGE_SIZE, PAGE_SIZE, 0);
-		memset(pt, 0, PAGE_SIZE);
-	}
-	pde = (uint32_t)pt | PTE_P | PTE_RW | PTE_US;
+	} else
+		pt = new_table();
+	pde = (uint64_t)(uintptr_t)pt | PTE_P | PTE_RW | PTE_US;
 	*p_pde = pde;
 	return pt;
 }
 
-static void do_va_map(uint32_t vstart, uint64_t pstart, uint32_t len,
+/*
+ * If the PT under the PDE *`p_pde' maps 2 MiB of physically contiguous,
+ * 2 MiB aligned memory, with the same flags throughout, turn it back into
+ * a large page.  If the PT maps nothing at all, drop it.  Either way, give
+ * the PT back to the page arena.
+ */
+static void promote_pt(uint64_t *p_pde)
+{
+	const uint64_t ad_mask = ~(uint64_t)(PTE_A | PTE_D);
+	uint64_t pde = *p_pde, *pt, pte0;
+	unsigned i;
+	if (!pde || (pde & PDE_PS) != 0)
+		return;
+	pt = pte_table(pde);
+	pte0 = pt[0] & ad_mask;
+	if (!pte0) {
+		for (i = 1; i <= 0x1ff; ++i)
+			if (pt[i])
+				return;
+	} else if ((pte0 & PTE_PAT) == 0 &&
+		   (uint32_t)pte0 % LARGE_PAGE_SIZE < PAGE_SIZE) {
+		for (i = 1; i <= 0x1ff; ++i)
+			if ((pt[i] & ad_mask) != pte0 + i * PAGE_SIZE)
+				return;
+	} else
+		return;
+	*p_pde = pte0 ? pte0 | PDE_PS : 0;
+	pt_free(pt);
+}
+
+/*
+ * Go over the PTs covering the `len' bytes of virtual addresses at `vstart'
+ * (`len' != 0), & fold them back into large pages where possible (see
+ * promote_pt(.)).
+ *
+ * The caller should flush the TLB afterwards.
+ */
+static void promote_pts(uintptr_t vstart, uintptr_t len)
+{
+	uintptr_t va = vstart & -LARGE_PAGE_SIZE,
+		  va_last = (vstart + (len - 1)) & -LARGE_PAGE_SIZE;
+	for (;;) {
+		uint64_t *pd = find_pd(va, false);
+		if (pd)
+			promote_pt(&pd[(va >> 21) & 0x1ff]);
+		if (va == va_last)
+			break;
+		va += LARGE_PAGE_SIZE;
+	}
+}
+
+static void do_va_map(uintptr_t vstart, uint64_t pstart, uintptr_t len,
     unsigned pte_flags)
 {
+	uintptr_t vstart0 = vstart, len0 = len;
 	while (len) {
-		unsigned pdpti = vstart >> 30,
-			 pdi = (vstart >> 21) & 0x1ff;
-		uint32_t pdpte = (uint32_t)pdpt[pdpti];
-		uint64_t *pd, pde, *pt;
-		pd = (uint64_t *)((uint32_t)pdpte & -PDPT_ALIGN);
+		unsigned pdi = (vstart >> 21) & 0x1ff;
+		uint64_t *pd = find_pd(vstart, true), pde, *pt;
 		if (vstart % LARGE_PAGE_SIZE == 0 &&
 		    pstart % LARGE_PAGE_SIZE == 0 &&
 		    len >= LARGE_PAGE_SIZE &&
@@ -265,21 +635,22 @@ static void do_va_map(uint32_t vstart, uint64_t pstart, uint32_t len,
 			len -= PAGE_SIZE;
 		}
 	}
+	if (len0)
+		promote_pts(vstart0, len0);
 }
 
-static void do_va_id_map(uint32_t start, uint32_t len, unsigned pte_flags)
+static void do_va_id_map(uintptr_t start, uintptr_t len, unsigned pte_flags)
 {
 	do_va_map(start, (uint64_t)start, len, pte_flags);
 }
 
+#ifndef __x86_64__
 static void do_va_unmap(uint32_t vstart, uint32_t len)
 {
+	uint32_t vstart0 = vstart, len0 = len;
 	while (len) {
-		unsigned pdpti = vstart >> 30,
-			 pdi = (vstart >> 21) & 0x1ff;
-		uint32_t pdpte = (uint32_t)pdpt[pdpti];
-		uint64_t *pd, pde, *pt;
-		pd = (uint64_t *)((uint32_t)pdpte & -PDPT_ALIGN);
+		unsigned pdi = (vstart >> 21) & 0x1ff;
+		uint64_t *pd = find_pd(vstart, false), pde, *pt;
 		pde = pd[pdi];
 		if ((pde & PDE_PS) != 0) {
 			if (vstart % LARGE_PAGE_SIZE == 0 &&
@@ -295,17 +666,27 @@ static void do_va_unmap(uint32_t vstart, uint32_t len)
 				vstart += PAGE_SIZE;
 				len -= PAGE_SIZE;
 			}
+		} else if (pde && vstart % LARGE_PAGE_SIZE == 0 &&
+			   len >= LARGE_PAGE_SIZE) {
+			/* Unmapping a whole PT's worth --- drop the PT. */
+			pd[pdi] = 0;
+			pt_free(pte_table(pde));
+			vstart += LARGE_PAGE_SIZE;
+			len -= LARGE_PAGE_SIZE;
 		} else {
 			if (pde) {
 				unsigned pti = (vstart >> 12) & 0x1ff;
-				pt = (uint64_t *)((uint32_t)pde & -PAGE_SIZE);
+				pt = pte_table(pde);
 				pt[pti] = 0;
 			}
 			vstart += PAGE_SIZE;
 			len -= PAGE_SIZE;
 		}
 	}
+	if (len0)
+		promote_pts(vstart0, len0);
 }
+#endif
 
 static unsigned uefi_attr_to_pte_flags(uint64_t uefi_attr)
 {
@@ -317,20 +698,70 @@ static unsigned uefi_attr_to_pte_flags(uint64_t uefi_attr)
 		return PTE_CD;
 }
 
+/*
+ * If there are any memory ranges below `limit' that are non-cacheable or
+ * only write-through cacheable, then modify the PTs to properly handle
+ * these.
+ *
+ * Make the pages write-through where write-through is supported.  Make the
+ * rest of the pages uncached.
+ *
+ * The memory map may gain new ranges in the course of this, as we allocate
+ * PTs.  Nodes do not move though, so this is fine.
+ */
+static void va_map_cache_attrs(uint64_t limit)
+{
+	mem_node_t *node = first_range();
+	while (node) {
+		mem_range_t *mr = &node->mr;
+		uint64_t start64, len64;
+		uintptr_t start, len;
+		unsigned pte_flags = uefi_attr_to_pte_flags(mr->uefi_attr);
+		if (!pte_flags) {
+			node = node->next[0];
+			continue;
+		}
+		start64 = mr->start;
+		if (start64 >= limit) {
+			node = node->next[0];
+			continue;
+		}
+		start = (uintptr_t)start64;
+		len64 = mr->len;
+		if (len64 >= limit - start64)
+			len = (uintptr_t)(limit - start64);
+		else
+			len = (uintptr_t)len64;
+		if (start % PAGE_SIZE != 0) {
+			len += start % PAGE_SIZE;
+			start &= -PAGE_SIZE;
+		}
+		if (len % PAGE_SIZE != 0)
+			len = (len + PAGE_SIZE - 1) & -PAGE_SIZE;
+		do_va_id_map(start, len, pte_flags);
+		while (node && node->mr.start <= start64)
+			node = node->next[0];
+	}
+}
+
+#ifndef __x86_64__
 static void va_init(void)
 {
 	unsigned nvr, mvr, i;
+	mem_node_t *node, *next;
 	/*
 	 * First allocate some memory to keep track of unused virtual
 	 * memory address ranges, & initialize these.
 	 */
-	mvr = max_mem_ranges;
-	unused_va_ranges = mem_alloc(mvr * sizeof(va_range_t),
-				     _Alignof(va_range_t), 0);
+	mvr = (3 * num_mem_ranges + 1) / 2;
+	if (mvr < 16)
+		mvr = 16;
+	unused_va_ranges = mem_slab_alloc(mvr * sizeof(va_range_t));
 	nvr = 0;
-	for (i = 1; i <= num_mem_ranges; ++i) {
+	for (node = first_range(); node; node = next) {
 		uint64_t prev_end, start;
-		prev_end = mem_ranges[i - 1].start + mem_ranges[i - 1].len;
+		next = node->next[0];
+		prev_end = node->mr.start + node->mr.len;
 		if (prev_end - 1 >= XM32_MAX_ADDR - 1)
 			break;
 		prev_end = (prev_end + PAGE_SIZE - 1) & -(uint64_t)PAGE_SIZE;
@@ -342,10 +773,10 @@ static void va_init(void)
 		 */
 		if (prev_end < BMEM_MAX_ADDR)
 			prev_end = BMEM_MAX_ADDR;
-		if (i == num_mem_ranges)
+		if (!next)
 			start = XM32_MAX_ADDR;
 		else {
-			start = mem_ranges[i].start & -(uint64_t)PAGE_SIZE;
+			start = next->mr.start & -(uint64_t)PAGE_SIZE;
 			if (start > XM32_MAX_ADDR)
 				start = XM32_MAX_ADDR;
 		}
@@ -362,78 +793,106 @@ static void va_init(void)
 	 * Set up the page-directory-pointer table (PDPT) & the 4 page
 	 * directories (PDs) for PAE paging.
 	 */
-	pdpt = mem_alloc(4 * sizeof(uint64_t), PDPT_ALIGN, 0);
-	for (i = 0; i < 4; ++i) {
-		uint64_t *pd = mem_alloc(PAGE_SIZE, PAGE_SIZE, 0);
-		memset(pd, 0, PAGE_SIZE);
-		pdpt[i] = (uint64_t)(uint32_t)pd | PTE_P;
-	}
+	pdpt = mem_slab_alloc(4 * sizeof(uint64_t));
+	for (i = 0; i < 4; ++i)
+		pdpt[i] = (uint64_t)(uint32_t)new_table() | PTE_P;
 	/*
 	 * Fill in the page directories & page tables (PTs) with identity
 	 * mappings for all physical memory addresses below 4 GiB that may
 	 * be backed by physical hardware.
 	 */
 	do_va_id_map(0, unused_va_ranges[0].start,
-	    uefi_attr_to_pte_flags(mem_ranges[0].uefi_attr));
+	    uefi_attr_to_pte_flags(first_range()->mr.uefi_attr));
 	for (i = 1; i < nvr; ++i) {
 		uint32_t prev_end = unused_va_ranges[i - 1].start +
 				    unused_va_ranges[i - 1].len;
 		uint32_t start = unused_va_ranges[i].start;
 		do_va_id_map(prev_end, start - prev_end, 0);
 	}
-	/*
-	 * If there are any memory ranges that are non-cacheable or only
-	 * write-through cacheable, then modify the PTs to properly handle
-	 * these.
-	 *
-	 * Make the pages write-through where write-through is supported.
-	 * Make the rest of the pages uncached.
-	 *
-	 * FIXME: the mem_ranges[] array may expand in the course of this
-	 * loop.  This should not affect correctness though.
-	 */
-	i = 0;
-	while (i < num_mem_ranges) {
-		mem_range_t *mr = &mem_ranges[i];
-		uint64_t start64, len64;
-		uint32_t start, len;
-		unsigned pte_flags = uefi_attr_to_pte_flags(mr->uefi_attr);
-		if (!pte_flags) {
-			++i;
-			continue;
-		}
-		start64 = mem_ranges[i].start;
-		if (start64 >= XM32_MAX_ADDR) {
-			++i;
-			continue;
-		}
-		start = (uint32_t)start64;
-		len64 = mem_ranges[i].len;
-		if (len64 >= XM32_MAX_ADDR - start)
-			len = (uint32_t)XM32_MAX_ADDR - start;
-		else
-			len = (uint32_t)len64;
-		if (start % PAGE_SIZE != 0) {
-			len += start % PAGE_SIZE;
-			start &= -PAGE_SIZE;
-		}
-		if (len % PAGE_SIZE != 0)
-			len = (len + PAGE_SIZE - 1) & -PAGE_SIZE;
-		do_va_id_map(start, len, pte_flags);
-		while (i < num_mem_ranges && mem_ranges[i].start <= start64)
-			++i;
-	}
+	va_map_cache_attrs(XM32_MAX_ADDR);
 	/* Bring up our page tables. */
 	wr_cr4(rd_cr4() | CR4_PAE);
 	wr_cr3((uint32_t)pdpt);
 	wr_cr0(rd_cr0() | CR0_PG);
 }
+#else
+static void va_init(void)
+{
+	uint64_t top = XM32_MAX_ADDR, va, *pdpt0;
+	bool huge_p = (cpuid_edx(0x80000001UL) & CPUID_X_PDPE1GB) != 0;
+	mem_node_t *node;
+	unsigned i;
+	/*
+	 * Find the end of physical memory, rounded up to a 1 GiB boundary.
+	 * We map everything below this directly, at virtual addresses equal
+	 * to the physical addresses.
+	 */
+	for (node = first_range(); node; node = node->next[0]) {
+		uint64_t end = node->mr.start + node->mr.len;
+		if (end > top)
+			top = end;
+	}
+	top = (top + HUGE_PAGE_SIZE - 1) & -HUGE_PAGE_SIZE;
+	pml4 = new_table();
+	/*
+	 * Map the lowest 4 GiB with 2 MiB pages, under 4 PDs.  These PDs
+	 * also serve as PAE paging structures, which rm16_call(...) switches
+	 * to on its way to & from real mode.
+	 */
+	do_va_id_map(0, XM32_MAX_ADDR, 0);
+	/* Map the rest with 1 GiB pages, if the CPU has them. */
+	for (va = XM32_MAX_ADDR; va != top; va += HUGE_PAGE_SIZE) {
+		if (huge_p)
+			find_pdpt(va, true)[(va >> 30) & 0x1ff] =
+			    va | PTE_P | PTE_RW | PTE_US | PDE_PS;
+		else
+			do_va_id_map(va, HUGE_PAGE_SIZE, 0);
+	}
+	va_map_cache_attrs(top);
+	va_top = top;
+	/* Set up the PAE PDPT for rm16_call(...). */
+	pdpt0 = find_pdpt(0, false);
+	pae_pdpt = mem_slab_alloc(4 * sizeof(uint64_t));
+	for (i = 0; i < 4; ++i)
+		pae_pdpt[i] = (pdpt0[i] & PTE_ADDR_MASK) | PTE_P;
+	mem_cr3_pae = (uint32_t)(uintptr_t)pae_pdpt;
+	/* Switch from start64.asm's boot-time page tables to ours. */
+	wr_cr3((uintptr_t)pml4);
+}
+#endif
 
-/* Initialize memory allocation & virtual memory addressing. */
-void mem_init(bparm_t *bparms)
+/*
+ * Initialize memory allocation & virtual memory addressing.  Also move the
+ * boot parameters into extended memory, & return the new list.
+ */
+bparm_tbl_t *mem_init(bparm_tbl_t *bparms)
 {
+	if (bparms->magic != BPARM_MAGIC || bparms->ver != BPARM_VER)
+		hlt();
 	mem_map_init(bparms);
+	bparms = copy_bparms(bparms);
 	va_init();
+	return bparms;
+}
+
+/*
+ * Release the base memory holding stage 1's boot-time data, once we no
+ * longer need it.
+ *
+ * Stage 1's base memory size (at 0x40:0x13) already counts this area, as it
+ * lies at the bottom of the base memory block, so only the memory map
+ * changes here.  The base memory size is left alone: rm16_init() has
+ * already moved it down to meet the EBDA, & option ROMs may have lowered
+ * it further.
+ */
+void mem_reclaim_boottime(void)
+{
+	mem_node_t *node = first_range();
+	if (boottime_bmem_bot) {
+		node->mr.e820_type = E820_RAM;
+		merge_ranges(node);
+		boottime_bmem_bot = 0;
+	}
 }
 
 /*
@@ -444,6 +903,7 @@ void *mem_alloc(size_t sz, size_t align, uintptr_t max_addr)
 {
 	uint64_t max_addr64;
 	uintptr_t astart, aend;
+	mem_node_t *node;
 	mem_range_t *mr;
 	if (!sz)
 		return NULL;
@@ -452,20 +912,221 @@ void *mem_alloc(size_t sz, size_t align, uintptr_t max_addr)
 		max_addr64 = XM32_MAX_ADDR;
 	if (max_addr64 < sz)
 		hlt();
-	for (mr = find_highest_range_below(max_addr64); ; --mr) {
+	pool_top_up();
+	for (node = find_highest_range_below(max_addr64); ;
+	     node = prev_range(node)) {
+		if (!node)
+			hlt();
+		mr = &node->mr;
 		if (mr->e820_type != E820_RAM || mr->len < sz)
 			continue;
 		aend = mr->start + mr->len;
 		astart = (aend - sz) & -align;
 		if (astart >= mr->start)
 			break;
-		if (!mr->start)
-			hlt();
 	}
-	split_range(mr, astart, E820_RAM, E820_RESERVED);
+	split_range(node, astart, E820_RAM, E820_RESERVED);
+	/*
+	 * Merge the new reserved block with any reserved block right above
+	 * it, so that the map does not grow with every allocation.
+	 */
+	if (mr->start != astart)
+		node = node->next[0];
+	merge_ranges(node);
 	return (void *)astart;
 }
 
+/*
+ * Give back `sz' bytes of reserved physical memory at `p' --- which need
+ * not be a whole block from mem_alloc(, , ) --- so that it becomes free
+ * RAM again.
+ */
+void mem_free(void *p, size_t sz)
+{
+	uint64_t start = (uintptr_t)p, end = start + sz;
+	mem_node_t *node, *prev;
+	mem_range_t *mr;
+	if (!sz)
+		return;
+	pool_top_up();
+	/* Find the range starting at or below `start'. */
+	node = sl_find_before(start + 1, NULL);
+	mr = &node->mr;
+	if (node == &mem_head || end - mr->start > mr->len ||
+	    mr->e820_type != E820_RESERVED)
+		hlt();
+	split_range(node, end, E820_RESERVED, E820_RESERVED);
+	if (mr->start != start) {
+		split_range(node, start, E820_RESERVED, E820_RAM);
+		node = node->next[0];
+	} else
+		mr->e820_type = E820_RAM;
+	merge_ranges(node);
+	prev = prev_range(node);
+	if (prev)
+		merge_ranges(prev);
+}
+
+/*
+ * Take any free RAM within the `sz' bytes at `p' back out of the physical
+ * memory map; parts which are already reserved, or not RAM, are left as
+ * they are.  This is e.g. to hold on to some of stage 1's boot-time data
+ * after mem_reclaim_boottime(), or to keep out base memory which an option
+ * ROM has taken for itself.
+ */
+void mem_reserve(void *p, size_t sz)
+{
+	uint64_t start = (uintptr_t)p, end = start + sz, rstart, rend;
+	mem_node_t *node, *prev;
+	mem_range_t *mr;
+	while (start < end) {
+		pool_top_up();
+		node = sl_find_before(start + 1, NULL);
+		if (node == &mem_head ||
+		    node->mr.start + node->mr.len <= start)
+			node = node->next[0];
+		if (!node || node->mr.start >= end)
+			return;
+		mr = &node->mr;
+		rstart = mr->start > start ? mr->start : start;
+		rend = mr->start + mr->len;
+		if (rend > end)
+			rend = end;
+		start = rend;
+		if (mr->e820_type != E820_RAM)
+			continue;
+		split_range(node, rend, E820_RAM, E820_RAM);
+		if (mr->start != rstart) {
+			split_range(node, rstart, E820_RAM, E820_RESERVED);
+			node = node->next[0];
+		} else
+			mr->e820_type = E820_RESERVED;
+		merge_ranges(node);
+		prev = prev_range(node);
+		if (prev)
+			merge_ranges(prev);
+	}
+}
+
+/*
+ * Return the memory range in the physical memory map which contains the
+ * address `addr', or NULL if none does.
+ */
+const mem_range_t *mem_range_at(uint64_t addr)
+{
+	mem_node_t *node = sl_find_before(addr + 1, NULL);
+	if (node == &mem_head || addr - node->mr.start >= node->mr.len)
+		return NULL;
+	return &node->mr;
+}
+
+/*
+ * Allocate a small object of `sz' bytes for internal use, from a slab.
+ * Larger objects are reserved straight from the memory map.
+ */
+void *mem_slab_alloc(size_t sz)
+{
+	unsigned cls = 0;
+	size_t csz = MEM_SLAB_MIN;
+	mem_free_obj_t *obj;
+	if (!sz)
+		return NULL;
+	if (sz > MEM_SLAB_MAX)
+		return mem_alloc(sz, MEM_SLAB_MIN, 0);
+	while (csz < sz) {
+		csz <<= 1;
+		++cls;
+	}
+	obj = free_objs[cls];
+	if (!obj) {
+		/* Slice up a new page into objects of this size. */
+		char *pg = pg_alloc();
+		size_t off = PAGE_SIZE;
+		while (off != 0) {
+			off -= csz;
+			obj = (mem_free_obj_t *)(pg + off);
+			obj->next = free_objs[cls];
+			free_objs[cls] = obj;
+		}
+	}
+	free_objs[cls] = obj->next;
+	return obj;
+}
+
+/*
+ * Free an object of `sz' bytes obtained from mem_slab_alloc(`sz').
+ */
+void mem_slab_free(void *p, size_t sz)
+{
+	unsigned cls = 0;
+	size_t csz = MEM_SLAB_MIN;
+	mem_free_obj_t *obj = p;
+	if (!sz)
+		return;
+	if (sz > MEM_SLAB_MAX) {
+		mem_free(p, sz);
+		return;
+	}
+	while (csz < sz) {
+		csz <<= 1;
+		++cls;
+	}
+	obj->next = free_objs[cls];
+	free_objs[cls] = obj;
+}
+
+/*
+ * Invalidate the TLB entries for the virtual addresses from `vstart' up to
+ * `vend' (both page aligned).  Return true if this took a full TLB flush.
+ *
+ * invlpg also clears the paging-structure caches, so this takes care of
+ * PTs which were split or promoted along the way.  PTs dropped with
+ * pt_free(.) go back to the page arena here --- but not within a batch,
+ * where the unmapped addresses may not be invalidated yet; then they wait
+ * for mem_va_commit().
+ */
+static bool va_inval(uint64_t vstart, uint64_t vend)
+{
+	bool flushed = false;
+	if (vend - vstart > (uint64_t)MEM_INVLPG_MAX * PAGE_SIZE) {
+		flush_cr3();
+		/* That also took care of any pending invalidations. */
+		va_pend_start = va_pend_end = 0;
+		va_pend_cnt = 0;
+		flushed = true;
+	} else {
+		while (vstart != vend) {
+			invlpg((void *)(uintptr_t)vstart);
+			vstart += PAGE_SIZE;
+		}
+	}
+	if (!va_batch_depth)
+		pt_release();
+	return flushed;
+}
+
+/*
+ * Note that the `vstart' to `vend' virtual addresses were just unmapped,
+ * & invalidate their TLB entries --- or, within a batch, put this off.
+ */
+static void va_unmapped(uint64_t vstart, uint64_t vend)
+{
+	if (va_batch_depth) {
+		if (!va_pend_end) {
+			va_pend_start = vstart;
+			va_pend_end = vend;
+		} else {
+			if (va_pend_start > vstart)
+				va_pend_start = vstart;
+			if (va_pend_end < vend)
+				va_pend_end = vend;
+		}
+		++va_pend_cnt;
+	} else if (!va_inval(vstart, vend))
+		++num_flushes_avoided;
+}
+
+#ifndef __x86_64__
 /*
  * Map some physical memory --- possibly beyond the 32-bit physical space
  * --- into our 32-bit virtual address space.
@@ -490,7 +1151,13 @@ void *mem_va_map(uint64_t pa, size_t sz, unsigned pte_flags)
 			unused_va_ranges[i].len = vrsz;
 			vstart = unused_va_ranges[i].start + vrsz;
 			do_va_map(vstart, pstart, sz_to_map, pte_flags);
-			flush_cr3();
+			/*
+			 * Always invalidate right away, even within a batch,
+			 * in case we are reusing addresses unmapped earlier
+			 * in the batch.
+			 */
+			if (!va_inval(vstart, (uint64_t)vstart + sz_to_map))
+				++num_flushes_avoided;
 			return (char *)vstart + (size_t)(pa % PAGE_SIZE);
 		}
 	}
@@ -513,7 +1180,7 @@ void mem_va_unmap(volatile void *va, size_t sz)
 	vend = ((uint32_t)va + sz + PAGE_SIZE - 1) & -(uint64_t)PAGE_SIZE;
 	sz_to_unmap = vend - vstart;
 	do_va_unmap(vstart, sz_to_unmap);
-	flush_cr3();
+	va_unmapped(vstart, (uint64_t)vstart + sz_to_unmap);
 	i = num_unused_va_ranges;
 	while (i-- != 0) {
 		va_range_t *vr = &unused_va_ranges[i];
@@ -542,3 +1209,112 @@ void mem_va_unmap(volatile void *va, size_t sz)
 	hlt();
 	__builtin_unreachable();
 }
+#else
+/* Return the caching flags that the direct map normally gives `pa'. */
+static unsigned va_dflt_flags(uint64_t pa)
+{
+	const mem_range_t *mr = mem_range_at(pa);
+	return mr ? uefi_attr_to_pte_flags(mr->uefi_attr) : 0;
+}
+
+/* Return the caching flags that the direct map now gives `va'. */
+static unsigned va_cur_flags(uint64_t va)
+{
+	uint64_t *tbl = find_pdpt(va, false), e;
+	if (!tbl)
+		return 0;
+	e = tbl[(va >> 30) & 0x1ff];
+	if (e && (e & PDE_PS) == 0) {
+		e = pte_table(e)[(va >> 21) & 0x1ff];
+		if (e && (e & PDE_PS) == 0)
+			e = pte_table(e)[(va >> 12) & 0x1ff];
+	}
+	return (unsigned)e & (PTE_WT | PTE_CD);
+}
+
+/*
+ * Return a virtual address for some physical memory.  All of physical
+ * memory is already mapped at virtual addresses equal to the physical
+ * ones, so this only needs to change the mapping if the caller wants
+ * different caching, or the memory lies beyond the end of the direct map
+ * (e.g. a 64-bit PCI BAR).
+ */
+void *mem_va_map(uint64_t pa, size_t sz, unsigned pte_flags)
+{
+	uint64_t pstart, pend;
+	if (!sz)
+		return NULL;
+	pstart = pa & -(uint64_t)PAGE_SIZE;
+	pend = (pa + sz + PAGE_SIZE - 1) & -(uint64_t)PAGE_SIZE;
+	if (pend > va_top || va_cur_flags(pstart) != pte_flags) {
+		do_va_id_map(pstart, pend - pstart, pte_flags);
+		if (!va_inval(pstart, pend))
+			++num_flushes_avoided;
+	}
+	return (void *)(uintptr_t)pa;
+}
+
+/*
+ * Finish using some virtual memory obtained from mem_va_map(...).  The
+ * direct map stays, but gets back its usual caching flags.
+ */
+void mem_va_unmap(volatile void *va, size_t sz)
+{
+	uint64_t vstart, vend;
+	unsigned pte_flags;
+	if (!sz)
+		return;
+	vstart = (uintptr_t)va & -(uint64_t)PAGE_SIZE;
+	vend = ((uintptr_t)va + sz + PAGE_SIZE - 1) & -(uint64_t)PAGE_SIZE;
+	if (vstart >= va_top)
+		return;
+	if (vend > va_top)
+		vend = va_top;
+	pte_flags = va_dflt_flags(vstart);
+	if (va_cur_flags(vstart) == pte_flags)
+		return;
+	do_va_id_map(vstart, vend - vstart, pte_flags);
+	va_unmapped(vstart, vend);
+}
+#endif
+
+/*
+ * Start a batch of mem_va_unmap(, ) calls, whose TLB invalidations are
+ * put off until the matching mem_va_commit().  Batches may be nested.
+ */
+void mem_va_begin(void)
+{
+	++va_batch_depth;
+}
+
+/*
+ * End a batch of mappings & unmappings started with mem_va_begin(), & do
+ * any TLB invalidations put off until now, in one go.
+ */
+void mem_va_commit(void)
+{
+	if (!va_batch_depth)
+		hlt();
+	if (--va_batch_depth)
+		return;
+	if (va_pend_end) {
+		/*
+		 * If the batch's unmappings could be invalidated page by
+		 * page, then each of them avoided a full TLB flush.
+		 */
+		if (!va_inval(va_pend_start, va_pend_end))
+			num_flushes_avoided += va_pend_cnt;
+		va_pend_start = va_pend_end = 0;
+		va_pend_cnt = 0;
+	} else
+		pt_release();
+}
+
+/*
+ * Return the no. of full TLB flushes that mem_va_map(, , ) &
+ * mem_va_unmap(, ) have avoided so far.
+ */
+unsigned mem_va_flushes_avoided(void)
+{
+	return num_flushes_avoided;
+}
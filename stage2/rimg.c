@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2021 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Running PCI option ROM images' initialization code.
+ *
+ * Stage 1 says, for each PCI device, whether its ROM should be run during
+ * boot (RIMG_EAGER), only when stage 2 first needs the device
+ * (RIMG_DEFER), or never (RIMG_SKIP).  Each ROM run is timed on the boot
+ * timeline, & a watchdog on the timer tick (int 0x1c) reports any ROM
+ * which does not return in time.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stage2/stage2.h"
+
+/* Seconds to let an option ROM's init. code run before giving up on it. */
+#define RIMG_WD_SECS	15U
+/* ...in timer ticks, at about 18.2 ticks per second. */
+#define RIMG_WD_TICKS	(RIMG_WD_SECS * 182U / 10U)
+
+/* End of conventional memory; ROM code above this is in shadow RAM etc. */
+#define CONV_MEM_END	0xa0000U
+
+/* Flags in bdat_pci_dev_t::rimg_policy. */
+#define RIMG_RAN	0x80U	/* ROM has been run */
+#define RIMG_KEPT	0x40U	/* ROM's init. image is being kept in
+				   stage 1's boot-time data */
+
+/* 16-bit code & data for calling option ROMs under the watchdog. */
+extern void rimg_call16(void);
+extern farptr16_t rimg_wd_callee;
+extern uint16_t rimg_wd_ticks, rimg_wd_locn;
+
+static bdat_pci_dev_t *pds = NULL;
+static uint32_t num_pds = 0;
+
+/* Get at a variable in the 16-bit data segment. */
+static __seg_gs void *rimg_data16(const void *var)
+{
+	return (__seg_gs void *)((uintptr_t)bda.ebda * PARA_SIZE +
+				 (uintptr_t)var);
+}
+
+/* Say whether a device's option ROM is deferred & not yet run. */
+static bool rimg_deferred_pd_p(const bdat_pci_dev_t *pd)
+{
+	return pd->rimg_seg &&
+	       (pd->rimg_policy & ~RIMG_KEPT) == RIMG_DEFER;
+}
+
+static bool rimg_vga_p(const bdat_pci_dev_t *pd)
+{
+	switch (pd->class_if & 0xffff0000UL) {
+	    case 0x03000000:  /* VGA */
+	    case 0x03010000:  /* XGA */
+		return true;
+	    default:
+		return false;
+	}
+}
+
+/*
+ * After an option ROM's init. code has run, see how much of its run time
+ * area in base memory the ROM still wants, by looking at the size byte in
+ * its header.  Give back the rest.
+ */
+static void rimg_trim(bdat_pci_dev_t *pd)
+{
+	uintptr_t rt = (uintptr_t)pd->rimg_rt_seg * PARA_SIZE;
+	uint32_t kept;
+	const volatile uint8_t *hdr = (const volatile uint8_t *)rt;
+	if (!pd->rimg_rt_sz || rt >= CONV_MEM_END ||
+	    hdr[0] != 0x55 || hdr[1] != 0xaa)
+		return;
+	kept = ((uint32_t)hdr[2] * HKIBYTE + KIBYTE - 1) & -KIBYTE;
+	if (kept >= pd->rimg_rt_sz)
+		return;
+	mem_free((void *)(rt + kept), pd->rimg_rt_sz - kept);
+	pd->rimg_rt_sz = kept;
+}
+
+/*
+ * Find room in base memory for a PCI 3+ option ROM's run time area, where
+ * stage 1 could not put it in shadow RAM.  Free RAM above the end of base
+ * memory --- such as tails which earlier ROMs gave back --- is used first.
+ * Failing that, the area goes at the end of base memory, & the EBDA moves
+ * down past it, with the base memory size following the EBDA.
+ */
+static void rimg_place_rt(bdat_pci_dev_t *pd)
+{
+	uintptr_t rt, ebda = (uintptr_t)bda.ebda * PARA_SIZE, new_ebda;
+	size_t ebda_sz = (size_t)*(const volatile uint8_t *)ebda * KIBYTE;
+	rt = (uintptr_t)mem_alloc(pd->rimg_rt_sz, HKIBYTE, BMEM_MAX_ADDR);
+	if (rt < (uintptr_t)bda.base_kib * KIBYTE) {
+		new_ebda = (uintptr_t)mem_alloc(ebda_sz, KIBYTE, rt);
+		memcpy((void *)new_ebda, (const void *)ebda, ebda_sz);
+		mem_free((void *)ebda, ebda_sz);
+		bda.ebda = (uint16_t)(new_ebda / PARA_SIZE);
+		bda.base_kib = (uint16_t)(new_ebda / KIBYTE);
+	}
+	pd->rimg_rt_seg = (uint16_t)(rt / PARA_SIZE);
+}
+
+/*
+ * If the EBDA sits at the end of base memory, & there is now free RAM
+ * right above it --- e.g. a run time area which a ROM gave back whole ---
+ * move the EBDA up to the top of that RAM, & raise the base memory size
+ * to match.
+ */
+static void rimg_raise_base(void)
+{
+	uintptr_t ebda = (uintptr_t)bda.ebda * PARA_SIZE, end, new_ebda;
+	size_t ebda_sz = (size_t)*(const volatile uint8_t *)ebda * KIBYTE;
+	const mem_range_t *mr;
+	if (ebda != (uintptr_t)bda.base_kib * KIBYTE)
+		return;
+	mr = mem_range_at(ebda + ebda_sz);
+	if (!mr || mr->e820_type != E820_RAM)
+		return;
+	end = mr->start + mr->len;
+	if (end > CONV_MEM_END)
+		end = CONV_MEM_END;
+	new_ebda = (end - ebda_sz) & -KIBYTE;
+	if (new_ebda <= ebda)
+		return;
+	mem_reserve((void *)new_ebda, ebda_sz);
+	memmove((void *)new_ebda, (const void *)ebda, ebda_sz);
+	if (new_ebda - ebda < ebda_sz)
+		ebda_sz = new_ebda - ebda;
+	mem_free((void *)ebda, ebda_sz);
+	bda.ebda = (uint16_t)(new_ebda / PARA_SIZE);
+	bda.base_kib = (uint16_t)(new_ebda / KIBYTE);
+}
+
+/* Run one option ROM image's init. code, & time it. */
+static void rimg_run(bdat_pci_dev_t *pd)
+{
+	unsigned tl = tl_begin(TL_RIMG, pd->pci_locn);
+	uint16_t base_kib;
+	if (!pd->rimg_rt_seg)
+		rimg_place_rt(pd);
+	base_kib = bda.base_kib;
+	*(__seg_gs farptr16_t *)rimg_data16(&rimg_wd_callee) =
+	    MK_FP16(pd->rimg_seg, 0x0003);
+	*(__seg_gs uint16_t *)rimg_data16(&rimg_wd_locn) =
+	    (uint16_t)pd->pci_locn;
+	*(__seg_gs uint16_t *)rimg_data16(&rimg_wd_ticks) = RIMG_WD_TICKS;
+	rm16_call(pd->pci_locn, 0, 0, pd->rimg_rt_seg,
+	    MK_FP16(rm16_cs, (uint16_t)(uintptr_t)rimg_call16));
+	/*
+	 * If the ROM took some base memory for itself by lowering the base
+	 * memory size, keep this out of our memory map.
+	 */
+	if (bda.base_kib < base_kib)
+		mem_reserve((void *)((uintptr_t)bda.base_kib * KIBYTE),
+		    (size_t)(base_kib - bda.base_kib) * KIBYTE);
+	pd->rimg_policy |= RIMG_RAN;
+	rimg_trim(pd);
+	if ((pd->rimg_policy & RIMG_KEPT) != 0) {
+		mem_free((void *)((uintptr_t)pd->rimg_seg * PARA_SIZE),
+		    pd->rimg_sz);
+		pd->rimg_policy &= ~RIMG_KEPT;
+	}
+	rimg_raise_base();
+	tl_end(tl);
+}
+
+/*
+ * Run the option ROMs which should be run during boot: either those for
+ * VGA/XGA controllers, or all the others.  Return the no. of ROMs run.
+ */
+unsigned rimg_init(const bparm_tbl_t *bparms, bool init_vga)
+{
+	uint32_t i;
+	unsigned num_run = 0;
+	pds = bparm_tbl_find(bparms, BP_PCID, &num_pds);
+	for (i = 0; i < num_pds; ++i) {
+		bdat_pci_dev_t *pd = &pds[i];
+		if (rimg_vga_p(pd) != init_vga || !pd->rimg_seg ||
+		    pd->rimg_policy != RIMG_EAGER)
+			continue;
+		rimg_run(pd);
+		++num_run;
+	}
+	return num_run;
+}
+
+/* Say whether any option ROMs are still waiting to be run. */
+bool rimg_deferred_p(void)
+{
+	uint32_t i;
+	for (i = 0; i < num_pds; ++i)
+		if (rimg_deferred_pd_p(&pds[i]))
+			return true;
+	return false;
+}
+
+/*
+ * Once the option ROMs to be run during boot have all been run, free up
+ * stage 1's boot-time data --- except for any deferred ROMs' init. images
+ * there, which are freed as the ROMs are run --- & raise the base memory
+ * size if this left free RAM right above the EBDA.
+ */
+void rimg_fini(void)
+{
+	uint32_t i;
+	mem_reclaim_boottime();
+	for (i = 0; i < num_pds; ++i) {
+		bdat_pci_dev_t *pd = &pds[i];
+		void *rimg = (void *)((uintptr_t)pd->rimg_seg * PARA_SIZE);
+		const mem_range_t *mr;
+		if (!rimg_deferred_pd_p(pd))
+			continue;
+		mr = mem_range_at((uintptr_t)rimg);
+		if (!mr || mr->e820_type != E820_RAM)
+			continue;
+		mem_reserve(rimg, pd->rimg_sz);
+		pd->rimg_policy |= RIMG_KEPT;
+	}
+	rimg_raise_base();
+}
+
+/*
+ * Run any deferred option ROMs for devices whose class, subclass, etc.
+ * match `class_if' under `mask' --- e.g. just before stage 2 first uses
+ * such a device.  This should come after rimg_fini().  The ROM shadow RAM
+ * is unlocked while the ROMs run.  Return the no. of ROMs run.
+ */
+unsigned rimg_init_deferred(uint32_t class_if, uint32_t mask)
+{
+	uint32_t i;
+	unsigned num_run = 0;
+	for (i = 0; i < num_pds; ++i) {
+		bdat_pci_dev_t *pd = &pds[i];
+		if (!rimg_deferred_pd_p(pd) ||
+		    (pd->class_if & mask) != class_if)
+			continue;
+		if (!num_run)
+			shdw_unlock();
+		rimg_run(pd);
+		++num_run;
+	}
+	if (num_run)
+		shdw_lock();
+	return num_run;
+}
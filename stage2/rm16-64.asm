@@ -0,0 +1,197 @@
+; Copyright (c) 2021 TK Chia
+;
+; Redistribution and use in source and binary forms, with or without
+; modification, are permitted provided that the following conditions are
+; met:
+;
+;   * Redistributions of source code must retain the above copyright
+;     notice, this list of conditions and the following disclaimer.
+;   * Redistributions in binary form must reproduce the above copyright
+;     notice, this list of conditions and the following disclaimer in the
+;     documentation and/or other materials provided with the distribution.
+;   * Neither the name of the developer(s) nor the names of its
+;     contributors may be used to endorse or promote products derived from
+;     this software without specific prior written permission.
+;
+; THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+; IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+; TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+; PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+; HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+; SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+; TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+; PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+; LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+; NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+; SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+; Real mode support for the x86-64 long mode build of stage 2.  This is
+; rm16.asm ported to the SysV x86-64 calling convention; rm16_call(...)
+; drops from long mode to PAE paged protected mode (see va_init(...) in
+; mem.c), then lets the 16-bit rm16_call.cont1 do the rest.
+
+%include "stage2/stage2.inc"
+
+%define	KIBYTE		1024
+%define PARA_SIZE	0x10
+%define BMEM_MAX_ADDR	0x100000
+
+	bits	64
+
+	section	.text
+
+	extern	mem_alloc, _stext16, _etext16, _sdata16, _end16, gdt_desc_cs16
+	extern	rm16_call.cont1, rm16_call.rm_cs16, vecs16, NUM_VECS16
+	extern	mem_cr3_pae
+
+	global	rm16_init
+rm16_init:
+	push	rbx
+	mov	edi, _etext16		; allocate base memory for the real-
+	mov	esi, PARA_SIZE		; -mode code
+	mov	edx, BMEM_MAX_ADDR
+	call	mem_alloc
+	or	[gdt_desc_cs16+2], eax	; fix up the GDT entry for SEL_CS16
+	mov	esi, text16_load	; copy out the 16-bit code
+	lea	edi, [rax+_stext16]
+	mov	ecx, (text16_load.end-text16_load)/4
+	rep movsd
+	mov	ecx, eax		; save real mode code seg. no.; also
+	shr	ecx, 4			; patch seg. no. in copied code
+	mov	[rm16_cs], cx
+	mov	[rax+rm16_call.rm_cs16], cx
+	mov	edi, _end16		; allocate base memory for the real-
+	mov	esi, KIBYTE		; -mode data
+	mov	edx, BMEM_MAX_ADDR
+	call	mem_alloc
+	mov	edx, eax		; initialize the EBDA pointer
+	shr	edx, 4
+	mov	[bda.ebda], dx
+	shr	edx, 6			; if the EBDA (& thus the code) went
+	cmp	dx, [bda.base_kib]	; below the end of base mem., move
+	jnb	.ebda_ok		; the end down to meet it
+	mov	[bda.base_kib], dx
+.ebda_ok:
+	mov	esi, data16_load	; copy out the 16-bit initialized data
+	lea	edi, [rax+_sdata16]
+	mov	ecx, (data16_load.end-data16_load)/4
+	rep movsd
+	lea	ebx, [rax+vecs16]
+	lea	ecx, [rax+_end16+3]	; blank out the uninitialized data
+	sub	ecx, edi
+	shr	ecx, 2
+	xor	eax, eax
+	rep stosd
+	mov	esi, ebx		; initialize real-mode intr. vectors
+	xchg	edi, eax		; before calling option ROMs
+	mov	cl, NUM_VECS16
+	movzx	eax, word [rm16_cs]
+	shl	eax, 16
+.vecs:	lodsw
+	stosd
+	loop	.vecs
+	mov	ax, bda.def_kb_buf-bda	; initialize IRQ 1 keyboard buffer
+	mov	[bda.kb_buf_start], ax
+	mov	[bda.kb_buf_head], ax
+	mov	[bda.kb_buf_tail], ax
+	mov	al, bda.def_kb_buf_end-bda
+	mov	[bda.kb_buf_end], ax
+	pop	rbx
+	ret
+
+	align	16
+	global	rm16_call
+rm16_call:
+	push	rbx
+	push	rbp
+	push	r12
+	push	r13
+	push	r14
+	push	r15
+	pushfq
+	mov	[rm16_args], edi	; stash the callee's eax, edx, ecx,
+	mov	[rm16_args+4], esi	; & ebx, & far address, since we need
+	mov	[rm16_args+8], edx	; these registers for switching modes
+	mov	[rm16_args+12], ecx
+	mov	[rm16_callee], r8d
+	mov	rax, cr3
+	mov	[rm16_cr3], eax
+	cli
+	push	SEL_CS32		; drop to compatibility mode
+	push	.compat
+	retfq
+
+	bits	32
+
+.compat:
+	mov	eax, cr0		; leave long mode
+	and	eax, ~CR0_PG
+	mov	cr0, eax
+	mov	ecx, MSR_EFER
+	rdmsr
+	and	eax, ~EFER_LME
+	wrmsr
+	mov	eax, [mem_cr3_pae]	; turn on PAE paging, using the long
+	mov	cr3, eax		; mode page tables' lowest 4 GiB
+	mov	eax, cr0
+	or	eax, CR0_PG
+	mov	cr0, eax
+	mov	eax, [rm16_args]
+	mov	edx, [rm16_args+4]
+	mov	ecx, [rm16_args+8]
+	mov	ebx, [rm16_args+12]
+	mov	edi, rm16_callee
+	call	SEL_CS16:rm16_call.cont1
+	mov	si, SEL_DS32
+	mov	ds, si
+	mov	es, si
+	mov	ss, si
+	mov	fs, si
+	mov	gs, si
+	mov	eax, cr0		; go back to long mode
+	and	eax, ~CR0_PG
+	mov	cr0, eax
+	mov	eax, [rm16_cr3]
+	mov	cr3, eax
+	mov	ecx, MSR_EFER
+	rdmsr
+	or	eax, EFER_LME
+	wrmsr
+	mov	eax, cr0
+	or	eax, CR0_PG
+	mov	cr0, eax
+	jmp	SEL_CS64:.lm
+
+	bits	64
+
+.lm:
+	mov	esp, esp		; upper halves of registers are now
+	popfq				; undefined
+	pop	r15
+	pop	r14
+	pop	r13
+	pop	r12
+	pop	rbp
+	pop	rbx
+	ret
+
+	align	4
+data16_load:
+	incbin	"stage2/data16.bin"
+	align	4, db 0
+.end:
+text16_load:
+	incbin	"stage2/text16.bin"
+	align	4
+.end:
+
+	section	.bss
+
+rm16_args:
+	resd	4
+rm16_callee:
+	resd	1
+rm16_cr3:
+	resd	1
+
+	common	rm16_cs	2
@@ -61,6 +61,11 @@ rm16_init:
 	mov	edx, eax		; initialize the EBDA pointer
 	shr	edx, 4
 	mov	[bda.ebda], dx
+	shr	edx, 6			; if the EBDA (& thus the code) went
+	cmp	dx, [bda.base_kib]	; below the end of base mem., move
+	jnb	.ebda_ok		; the end down to meet it
+	mov	[bda.base_kib], dx
+.ebda_ok:
 	mov	esi, data16_load	; copy out the 16-bit initialized data
 	lea	edi, [eax+_sdata16]
 	mov	ecx, (data16_load.end-data16_load)/4
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2021 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Locking the shadow RAM which stage 1 placed option ROM images in (see
+ * stage1/shdw.c), once the ROMs have been initialized.  It can be unlocked
+ * again for a while to initialize deferred ROMs.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "stage2/stage2.h"
+
+#define SHDW_START	0xc0000U
+#define SHDW_CHUNK	(16 * KIBYTE)
+
+/* PCI configuration mechanism #1 I/O ports. */
+#define PCI_CONF_ADDR	0x0cf8
+#define PCI_CONF_DATA	0x0cfc
+
+/* PAM register bits for one 16 KiB chunk. */
+#define PAM_RE		0x1U	/* reads go to RAM */
+#define PAM_WE		0x2U	/* writes go to RAM */
+
+static bdat_shdw_t shdw;
+static bool shdw_p = false;
+
+static void shdw_conf_sel(uint8_t off)
+{
+	uint32_t locn = shdw.pci_locn & 0xffffU;
+	outpd(PCI_CONF_ADDR, 0x80000000UL | locn << 8 | (off & 0xfcU));
+}
+
+static uint8_t shdw_conf_rd(uint8_t off)
+{
+	shdw_conf_sel(off);
+	return inp(PCI_CONF_DATA + (off & 3U));
+}
+
+static void shdw_conf_wr(uint8_t off, uint8_t v)
+{
+	shdw_conf_sel(off);
+	outp(PCI_CONF_DATA + (off & 3U), v);
+}
+
+/*
+ * Take note of any shadow RAM set up by stage 1.  This should be called
+ * while the boot parameters are still around.
+ */
+void shdw_init(const bparm_tbl_t *bparms)
+{
+	const bdat_shdw_t *bd = bparm_tbl_find(bparms, BP_SHDW, NULL);
+	if (!bd)
+		return;
+	shdw = *bd;
+	shdw_p = true;
+}
+
+/* Set the PAM bits for all the shadow RAM chunks which stage 1 used. */
+static void shdw_set(uint8_t bits)
+{
+	uint32_t addr;
+	if (!shdw_p)
+		return;
+	for (addr = shdw.start; addr < shdw.end; addr += SHDW_CHUNK) {
+		unsigned chunk = (addr - SHDW_START) / SHDW_CHUNK,
+			 shift = chunk % 2 * 4;
+		uint8_t off = shdw.pam_off + chunk / 2,
+			pam = shdw_conf_rd(off);
+		pam &= ~((PAM_RE | PAM_WE) << shift);
+		pam |= bits << shift;
+		shdw_conf_wr(off, pam);
+	}
+}
+
+/* Make the shadow RAM read-only. */
+void shdw_lock(void)
+{
+	shdw_set(PAM_RE);
+}
+
+/*
+ * Make the shadow RAM writable again, e.g. so that a deferred option ROM
+ * can be initialized in place.
+ */
+void shdw_unlock(void)
+{
+	shdw_set(PAM_RE | PAM_WE);
+}
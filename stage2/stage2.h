@@ -31,21 +31,46 @@
 #define H_STAGE2_STAGE2
 
 #include <inttypes.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include "bparm.h"
 
 typedef uint32_t farptr16_t;
 
+/* acpi.c functions. */
+
+extern unsigned acpi_init(const bparm_tbl_t *);
+extern void *acpi_find(const char *, unsigned);
+
 /* irq.c functions. */
 
-extern void irq_init(bparm_t *);
+extern void irq_init(void);
 
 /* mem.c functions. */
 
-extern void mem_init(bparm_t *);
+extern bparm_tbl_t *mem_init(bparm_tbl_t *);
+extern void mem_reclaim_boottime(void);
 extern void *mem_alloc(size_t, size_t, uintptr_t);
+extern void mem_free(void *, size_t);
+extern void mem_reserve(void *, size_t);
+extern const struct mem_range *mem_range_at(uint64_t);
+extern void *mem_slab_alloc(size_t);
+extern void mem_slab_free(void *, size_t);
 extern void *mem_va_map(uint64_t, size_t, unsigned);
 extern void mem_va_unmap(volatile void *, size_t);
+extern void mem_va_begin(void);
+extern void mem_va_commit(void);
+extern unsigned mem_va_flushes_avoided(void);
+#ifdef __x86_64__
+extern uint32_t mem_cr3_pae;
+#endif
+
+/* rimg.c functions. */
+
+extern unsigned rimg_init(const bparm_tbl_t *, bool);
+extern bool rimg_deferred_p(void);
+extern unsigned rimg_init_deferred(uint32_t, uint32_t);
+extern void rimg_fini(void);
 
 /* rm16.asm functions. */
 
@@ -54,12 +79,31 @@ extern void rm16_init(void);
 extern void rm16_call(uint32_t eax, uint32_t edx, uint32_t ecx, uint32_t ebx,
 		      farptr16_t callee);
 
+/* shdw.c functions. */
+
+extern void shdw_init(const bparm_tbl_t *);
+extern void shdw_lock(void);
+extern void shdw_unlock(void);
+
+/* timeline.c functions. */
+
+#define TL_NONE		(~0U)	/* dummy handle from tl_begin(, ) */
+
+extern void tl_init(bparm_tbl_t *);
+extern unsigned tl_begin(uint32_t, uint32_t);
+extern void tl_end(unsigned);
+extern bdat_timeline_t *tl_get(void);
+extern void tl_set_arg(unsigned, uint32_t);
+
 /* Macros, inline functions, & other definitions. */
 
 #define XM32_MAX_ADDR	0x100000000ULL	/* end of 32-bit extended memory,
 					   i.e. the 4 GiB mark */
 #define PAGE_SIZE	0x1000UL	/* size of a virtual memory page */
 #define LARGE_PAGE_SIZE	0x200000UL	/* size of a larger VM page */
+#define HUGE_PAGE_SIZE	0x40000000ULL	/* size of a 1 GiB VM page (long
+					   mode only) */
+#define PTE_ADDR_MASK	0x000ffffffffff000ULL  /* phys. addr. in a PTE */
 #define PDPT_ALIGN	0x20U		/* alignment of the page-dir.-ptr.
 					   table (PDPT) for PAE paging */
 
@@ -69,6 +113,9 @@ extern void rm16_call(uint32_t eax, uint32_t edx, uint32_t ecx, uint32_t ebx,
 #define PTE_US		(1UL <<  2)	/* user/supervisor */
 #define PTE_WT		(1UL <<  3)	/* write-through */
 #define PTE_CD		(1UL <<  4)	/* cache disable */
+#define PTE_A		(1UL <<  5)	/* accessed */
+#define PTE_D		(1UL <<  6)	/* dirty */
+#define PTE_PAT		(1UL <<  7)	/* (page table) PAT index bit */
 #define PDE_PS		(1UL <<  7)	/* (page dir.) large page size */
 
 /* Flags in the cr0 register. */
@@ -78,6 +125,9 @@ extern void rm16_call(uint32_t eax, uint32_t edx, uint32_t ecx, uint32_t ebx,
 /* Flags in the cr4 register. */
 #define CR4_PAE		(1UL <<  5)	/* physical address extension (PAE) */
 
+/* Flags in edx from cpuid leaf 0x80000001. */
+#define CPUID_X_PDPE1GB	(1UL << 26)	/* 1 GiB pages */
+
 /* Legacy 8259 programmable interrupt controller (PIC) I/O port numbers. */
 #define PIC1_CMD	0x0020
 #define PIC1_DATA	0x0021
@@ -185,32 +235,37 @@ static inline farptr16_t MK_FP16(uint16_t seg, uint16_t off)
 	return (farptr16_t)seg << 16 | off;
 }
 
+/*
+ * Control registers are 32 bits wide in protected mode, & 64 bits wide in
+ * long mode.
+ */
+
 /* Read cr0. */
-static inline uint32_t rd_cr0(void)
+static inline uintptr_t rd_cr0(void)
 {
-	uint32_t v;
-	__asm volatile("movl %%cr0, %0" : "=r" (v));
+	uintptr_t v;
+	__asm volatile("mov %%cr0, %0" : "=r" (v));
 	return v;
 }
 
 /* Write cr0. */
-static inline void wr_cr0(uint32_t v)
+static inline void wr_cr0(uintptr_t v)
 {
-	__asm volatile("movl %0, %%cr0" : : "r" (v) : "memory");
+	__asm volatile("mov %0, %%cr0" : : "r" (v) : "memory");
 }
 
 /* Read cr3. */
-static inline uint32_t rd_cr3(void)
+static inline uintptr_t rd_cr3(void)
 {
-	uint32_t v;
-	__asm volatile("movl %%cr3, %0" : "=r" (v));
+	uintptr_t v;
+	__asm volatile("mov %%cr3, %0" : "=r" (v));
 	return v;
 }
 
 /* Write cr3. */
-static inline void wr_cr3(uint32_t v)
+static inline void wr_cr3(uintptr_t v)
 {
-	__asm volatile("movl %0, %%cr3" : : "r" (v) : "memory");
+	__asm volatile("mov %0, %%cr3" : : "r" (v) : "memory");
 }
 
 /* Flush page table caches by reading & writing cr3. */
@@ -219,18 +274,43 @@ static inline void flush_cr3(void)
 	wr_cr3(rd_cr3());
 }
 
+/* Invalidate TLB entries for the page at `va', & paging-structure caches. */
+static inline void invlpg(volatile void *va)
+{
+	__asm volatile("invlpg %0" : : "m" (*(volatile char *)va) : "memory");
+}
+
 /* Read cr4. */
-static inline uint32_t rd_cr4(void)
+static inline uintptr_t rd_cr4(void)
 {
-	uint32_t v;
-	__asm volatile("movl %%cr4, %0" : "=r" (v));
+	uintptr_t v;
+	__asm volatile("mov %%cr4, %0" : "=r" (v));
 	return v;
 }
 
 /* Write cr4. */
-static inline void wr_cr4(uint32_t v)
+static inline void wr_cr4(uintptr_t v)
 {
-	__asm volatile("movl %0, %%cr4" : : "r" (v) : "memory");
+	__asm volatile("mov %0, %%cr4" : : "r" (v) : "memory");
+}
+
+/* Run cpuid with the given leaf, & return edx. */
+static inline uint32_t cpuid_edx(uint32_t leaf)
+{
+	uint32_t a, b, c, d;
+	__asm volatile("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d)
+			       : "0" (leaf), "2" (0));
+	return d;
+}
+
+/* Return the physical address given in a ptr64_t. */
+static inline uint64_t ptr64_to_pa(ptr64_t p)
+{
+#ifndef __x86_64__
+	return p;
+#else
+	return (uint64_t)(uintptr_t)p;
+#endif
 }
 
 /* Read a byte from an I/O port. */
@@ -261,6 +341,12 @@ static inline void outp_w(uint16_t p, uint8_t v)
 	__asm volatile("outb %%al, %0" : : "Nd" ((uint16_t)0x80));
 }
 
+/* Write a longword to an I/O port. */
+static inline void outpd(uint16_t p, uint32_t v)
+{
+	__asm volatile("outl %1, %0" : : "Nd" (p), "a" (v));
+}
+
 /* Disable interrupts. */
 static inline void cli(void)
 {
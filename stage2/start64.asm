@@ -0,0 +1,129 @@
+; Copyright (c) 2021 TK Chia
+;
+; Redistribution and use in source and binary forms, with or without
+; modification, are permitted provided that the following conditions are
+; met:
+;
+;   * Redistributions of source code must retain the above copyright
+;     notice, this list of conditions and the following disclaimer.
+;   * Redistributions in binary form must reproduce the above copyright
+;     notice, this list of conditions and the following disclaimer in the
+;     documentation and/or other materials provided with the distribution.
+;   * Neither the name of the developer(s) nor the names of its
+;     contributors may be used to endorse or promote products derived from
+;     this software without specific prior written permission.
+;
+; THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+; IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+; TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+; PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+; HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+; SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+; TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+; PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+; LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+; NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+; SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+; Entry point for the x86-64 long mode build of stage 2 (stage2-64.sys).
+; stage 1 jumps here in long mode, still on the UEFI firmware's page
+; tables.
+
+%include "stage2/stage2.inc"
+
+	bits	64
+
+	section	.text
+
+PTE_P	equ	1 << 0
+PTE_RW	equ	1 << 1
+PTE_PS	equ	1 << 7
+LARGE_PAGE_SIZE equ 0x200000
+
+	extern	stage2_main
+
+	global	_start
+_start:
+	cli
+	cld
+	mov	esp, starting_stack
+	lgdt	[gdtr]
+	lidt	[idtrrm]
+	push	SEL_CS64
+	push	.cont
+	retfq
+.cont:
+	mov	ax, SEL_DS32
+	mov	ds, ax
+	mov	es, ax
+	mov	ss, ax
+	mov	fs, ax
+	mov	gs, ax
+	mov	ebx, boot_pts		; set up page tables to identity map
+	mov	edi, ebx		; the lowest 4 GiB with 2 MiB pages,
+	mov	ecx, (boot_pts.end-boot_pts)/8 ; until mem_init(...) can
+	xor	eax, eax		; build proper ones
+	rep stosq
+	lea	eax, [rbx+0x1000+PTE_P+PTE_RW]
+	mov	[rbx], rax		; PML4 -> PDPT
+	lea	edi, [rbx+0x1000]
+	mov	ecx, 4
+.pdpt:	add	eax, 0x1000		; PDPT -> 4 PDs
+	stosq
+	loop	.pdpt
+	lea	edi, [rbx+0x2000]
+	mov	eax, PTE_P+PTE_RW+PTE_PS
+	mov	ecx, 4*0x1000/8
+.pd:	stosq				; PDs -> memory
+	add	rax, LARGE_PAGE_SIZE
+	loop	.pd
+	mov	cr3, rbx
+	mov	edi, ebp
+	call	stage2_main
+
+	section .rodata
+
+gdtr:	dw	gdt_end-gdt-1
+	dq	gdt
+idtrrm:	dw	0x100*4-1
+	dq	0
+
+	section	.data
+
+	global	gdt_desc_cs16
+
+	align	8
+gdt	equ	$-8
+%if SEL_CS32 != $-gdt
+%   error "SEL_CS32 does not match actual GDT"
+%endif
+	dq	0x00cf9a000000ffff	; 32-bit protected mode code seg.
+%if SEL_DS32 != $-gdt
+%   error "SEL_DS32 does not match actual GDT"
+%endif
+	dq	0x00cf92000000ffff	; 32-bit protected mode data seg.
+%if SEL_CS16 != $-gdt
+%   error "SEL_CS16 does not match actual GDT"
+%endif
+gdt_desc_cs16:
+	dq	0x008f9a000000ffff	; 16-bit protected mode code seg.
+					; pointing to our 16-bit code
+%if SEL_DS16_ZERO != $-gdt
+%   error "SEL_DS16_ZERO does not match actual GDT"
+%endif
+	dq	0x008f92000000ffff	; 16-bit protected mode data seg.
+					; pointing to linear address zero
+%if SEL_CS64 != $-gdt
+%   error "SEL_CS64 does not match actual GDT"
+%endif
+	dq	0x00af9a000000ffff	; 64-bit long mode code seg.
+gdt_end:
+
+	section	.bss
+
+	alignb	0x1000
+boot_pts:
+	resb	6*0x1000		; PML4, PDPT, & 4 PDs
+.end:
+	resb	0x1000
+starting_stack:
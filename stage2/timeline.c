@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2021 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Routines for adding stage 2's boot phases to the boot timeline that
+ * stage 1 passes in the boot parameters.  The timeline then stays in
+ * memory, where tl_get() can find it.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stage2/stage2.h"
+
+static bdat_timeline_t *tl = NULL;
+
+/* Find the boot timeline in the boot parameters. */
+void tl_init(bparm_tbl_t *bparms)
+{
+	tl = bparm_tbl_find(bparms, BP_TIML, NULL);
+}
+
+/*
+ * Start timing a boot phase.  Return a handle to pass to tl_end(...) when
+ * the phase finishes.
+ */
+unsigned tl_begin(uint32_t tag, uint32_t arg)
+{
+	bdat_tl_ent_t *ent;
+	unsigned idx;
+	if (!tl)
+		return TL_NONE;
+	idx = tl->num_ents;
+	if (idx >= tl->max_ents)
+		return TL_NONE;
+	ent = &tl->ents[idx];
+	ent->tag = tag;
+	ent->arg = arg;
+	ent->tsc_end = 0;
+	ent->tsc_start = rdtsc();
+	tl->num_ents = idx + 1;
+	return idx;
+}
+
+/* Finish timing a boot phase. */
+void tl_end(unsigned idx)
+{
+	uint64_t tsc = rdtsc();
+	if (tl && idx < tl->num_ents)
+		tl->ents[idx].tsc_end = tsc;
+}
+
+/*
+ * Change the extra information recorded for a boot phase, for when this
+ * is only known once the phase is under way.
+ */
+void tl_set_arg(unsigned idx, uint32_t arg)
+{
+	if (tl && idx < tl->num_ents)
+		tl->ents[idx].arg = arg;
+}
+
+/* Return the boot timeline, or NULL if there is none. */
+bdat_timeline_t *tl_get(void)
+{
+	return tl;
+}